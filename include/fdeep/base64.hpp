@@ -6,107 +6,305 @@
 
 #pragma once
 
+#include "fdeep/common.hpp"
+
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <future>
+#include <limits>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <nlohmann/json.hpp>
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 namespace fdeep { namespace internal
 {
 
-// Make sure data outlives instances of this this fascade class.
-class json_data_strs_char_prodiver {
-public:
-    json_data_strs_char_prodiver(const nlohmann::json& data,
-        std::string::value_type pad_right_char) :
-        data_(data),
-        it_data_(std::begin(data_)),
-        current_str_(data_to_str(*it_data_)),
-        it_str_(std::begin(current_str_)),
-        pad_right_char_(pad_right_char)
+// source: https://stackoverflow.com/a/31322410/1866775
+static const std::uint8_t from_base64[] = { 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  62, 255,  62, 255,  63,
+     52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 255, 255, 255, 255, 255, 255,
+    255,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+     15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 255, 255, 255, 255,  63,
+    255,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+     41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 255, 255, 255, 255, 255};
+static const char to_base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "abcdefghijklmnopqrstuvwxyz"
+    "0123456789+/";
+
+// Base64 text is stored in the JSON model either as one string,
+// or as an array of strings (convert_model.py splits it into chunks).
+// The chunks are referenced, not copied,
+// so the JSON data has to outlive them.
+typedef std::pair<const char*, std::size_t> base64_chunk;
+typedef std::vector<base64_chunk> base64_chunks;
+
+inline base64_chunks get_base64_chunks(const nlohmann::json& data)
+{
+    base64_chunks result;
+    const auto add_chunk = [&result](const nlohmann::json& str)
     {
+        const std::string& chars = str.get_ref<const std::string&>();
+        result.emplace_back(chars.data(), chars.size());
+    };
+    if (data.is_string())
+    {
+        add_chunk(data);
+    }
+    else
+    {
+        result.reserve(data.size());
+        for (const auto& str : data)
+        {
+            add_chunk(str);
+        }
     }
-    static std::string data_to_str(const nlohmann::json& dat)
+    return result;
+}
+
+inline std::size_t base64_chunks_size(const base64_chunks& chunks)
+{
+    std::size_t sum = 0;
+    for (const auto& chunk : chunks)
     {
-        std::string result = dat;
-        return result;
+        sum += chunk.second;
     }
-    std::size_t size() const
+    return sum;
+}
+
+inline std::uint8_t decode_base64_char(char c)
+{
+    const auto idx = static_cast<unsigned char>(c);
+    return idx < sizeof(from_base64) ? from_base64[idx] : 255;
+}
+
+// Decodes a group of four base64 characters into up to three bytes.
+// Trailing '=' characters are only allowed in the last group of the text.
+// Returns the number of bytes written.
+inline std::size_t decode_base64_quad(const char* src, std::uint8_t* dest,
+    bool is_last)
+{
+    std::size_t n_chars = 4;
+    if (is_last)
     {
-        std::size_t sum = 0;
-        for (const auto& dat : data_)
+        while (n_chars > 2 && src[n_chars - 1] == '=')
         {
-            sum += data_to_str(dat).size();
+            --n_chars;
         }
-        return sum;
     }
-    std::string::value_type next()
+    std::uint32_t bits = 0;
+    std::uint8_t invalid = 0;
+    for (std::size_t i = 0; i < 4; ++i)
+    {
+        const std::uint8_t value = i < n_chars ? decode_base64_char(src[i]) : 0;
+        invalid |= value;
+        bits = (bits << 6) | (value & 0x3f);
+    }
+    if (invalid & 0x80)
+    {
+        raise_error("invalid base64 data");
+    }
+    const std::uint8_t bytes[3] = {
+        static_cast<std::uint8_t>(bits >> 16),
+        static_cast<std::uint8_t>(bits >> 8),
+        static_cast<std::uint8_t>(bits)};
+    std::memcpy(dest, bytes, n_chars - 1);
+    return n_chars - 1;
+}
+
+#if defined(__SSSE3__)
+// Decodes 16 base64 characters into 12 bytes.
+// Returns false, without writing anything,
+// if they contain characters outside of the standard alphabet.
+// Wojciech Mula, Daniel Lemire: Faster Base64 Encoding and Decoding
+// Using AVX2 Instructions, https://arxiv.org/abs/1704.00605
+inline bool decode_base64_block_ssse3(const char* src, std::uint8_t* dest)
+{
+    const __m128i lut_lo = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+
+    const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+    const __m128i lo_nibbles = _mm_and_si128(in, mask_2f);
+    const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+        _mm_setzero_si128())) != 0xffff)
+    {
+        return false;
+    }
+    const __m128i eq_2f = _mm_cmpeq_epi8(in, mask_2f);
+    const __m128i roll = _mm_shuffle_epi8(lut_roll,
+        _mm_add_epi8(eq_2f, hi_nibbles));
+    const __m128i values = _mm_add_epi8(in, roll);
+
+    // Pack the 6-bit values of each group of four characters into 24 bits.
+    const __m128i merged_pairs = _mm_maddubs_epi16(values,
+        _mm_set1_epi32(0x01400140));
+    const __m128i merged_quads = _mm_madd_epi16(merged_pairs,
+        _mm_set1_epi32(0x00011000));
+    const __m128i out = _mm_shuffle_epi8(merged_quads, _mm_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dest), out);
+    const std::uint32_t last = static_cast<std::uint32_t>(
+        _mm_cvtsi128_si32(_mm_srli_si128(out, 8)));
+    std::memcpy(dest + 8, &last, 4);
+    return true;
+}
+#endif
+
+// Decodes size characters into dest, which must be large enough.
+// Returns the number of bytes written.
+inline std::size_t decode_base64(const char* src, std::size_t size,
+    std::uint8_t* dest, bool is_last)
+{
+    const std::size_t n_quads = (size + 3) / 4;
+    std::size_t written = 0;
+    std::size_t quad = 0;
+#if defined(__SSSE3__)
+    // The last quad might contain padding,
+    // which is left to the scalar code.
+    for (; quad + 5 <= n_quads; quad += 4)
     {
-        if (it_data_ == std::end(data_))
+        if (!decode_base64_block_ssse3(src + 4 * quad, dest + written))
         {
-            return pad_right_char_;
+            break;
         }
-        if (it_str_ == std::end(current_str_))
+        written += 12;
+    }
+#endif
+    for (; quad + 1 < n_quads; ++quad)
+    {
+        written += decode_base64_quad(src + 4 * quad, dest + written, false);
+    }
+    if (n_quads > 0)
+    {
+        // An incomplete last quad is padded with '='.
+        char last_quad[4] = {'=', '=', '=', '='};
+        std::copy(src + 4 * quad, src + size, last_quad);
+        written += decode_base64_quad(last_quad, dest + written, is_last);
+    }
+    return written;
+}
+
+// Number of bytes the chunks decode to, assuming the padding is valid.
+inline std::size_t base64_decoded_size(const base64_chunks& chunks)
+{
+    const std::size_t size = base64_chunks_size(chunks);
+    std::size_t padding = 0;
+    for (auto it = chunks.rbegin(); it != chunks.rend() && padding < 2; ++it)
+    {
+        std::size_t i = it->second;
+        while (i > 0 && padding < 2 && it->first[i - 1] == '=')
         {
-            ++it_data_;
-            current_str_ = data_to_str(*it_data_);
-            it_str_ = std::begin(current_str_);
+            --i;
+            ++padding;
+        }
+        if (i > 0)
+        {
+            break;
         }
-        return *(it_str_++);
     }
-private:
-    const nlohmann::json& data_;
-    nlohmann::json::const_iterator it_data_;
-    std::string current_str_;
-    std::string::const_iterator it_str_;
-    std::string::value_type pad_right_char_;
-};
+    return 3 * ((size + 3) / 4) - padding - (size % 4 == 0 ? 0 : 4 - size % 4);
+}
 
-// source: https://stackoverflow.com/a/31322410/1866775
-static const std::uint8_t from_base64[] = { 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  62, 255,  62, 255,  63,
-     52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 255, 255, 255, 255, 255, 255,
-    255,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
-     15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 255, 255, 255, 255,  63,
-    255,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
-     41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 255, 255, 255, 255, 255};
-static const char to_base64[] =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-    "abcdefghijklmnopqrstuvwxyz"
-    "0123456789+/";
-inline std::vector<std::uint8_t> Base64_decode(
-    json_data_strs_char_prodiver&& encoded_string)
+// The text size from which on decoding in multiple threads pays off.
+static const std::size_t base64_parallel_min_size = 1 << 20;
+
+// Decodes all chunks into dest, which must hold base64_decoded_size bytes.
+// Every chunk except the last one is expected to consist of
+// complete groups of four characters (as written by convert_model.py),
+// so the chunks can be decoded independently, and in parallel.
+// Otherwise the text is joined before decoding.
+inline void decode_base64_chunks(const base64_chunks& chunks,
+    std::uint8_t* dest)
+{
+    const bool chunks_independent = std::all_of(chunks.begin(),
+        chunks.empty() ? chunks.end() : chunks.end() - 1,
+        [](const base64_chunk& chunk) { return chunk.second % 4 == 0; });
+    if (!chunks_independent)
+    {
+        std::string joined;
+        joined.reserve(base64_chunks_size(chunks));
+        for (const auto& chunk : chunks)
+        {
+            joined.append(chunk.first, chunk.second);
+        }
+        decode_base64(joined.data(), joined.size(), dest, true);
+        return;
+    }
+
+    const auto decode_range = [&chunks, dest](std::size_t begin,
+        std::size_t end, std::size_t dest_offset)
+    {
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            dest_offset += decode_base64(chunks[i].first, chunks[i].second,
+                dest + dest_offset, i + 1 == chunks.size());
+        }
+    };
+
+    const std::size_t n_threads = std::min<std::size_t>(chunks.size(),
+        base64_chunks_size(chunks) < base64_parallel_min_size
+            ? 1 : std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::future<void>> jobs;
+    jobs.reserve(n_threads);
+    std::size_t begin = 0;
+    std::size_t dest_offset = 0;
+    for (std::size_t t = 0; t < n_threads; ++t)
+    {
+        const std::size_t end = chunks.size() * (t + 1) / n_threads;
+        jobs.push_back(std::async(t + 1 == n_threads
+            ? std::launch::deferred : std::launch::async,
+            decode_range, begin, end, dest_offset));
+        for (; begin < end; ++begin)
+        {
+            dest_offset += 3 * chunks[begin].second / 4;
+        }
+    }
+    // The deferred last job runs in this thread while the others work.
+    for (auto it = jobs.rbegin(); it != jobs.rend(); ++it)
+    {
+        it->get();
+    }
+}
+
+// Decodes base64 text consisting of little-endian float32 values.
+inline float_vec decode_base64_floats(const base64_chunks& chunks)
 {
-    // Make sure string length is a multiple of 4
-    auto encoded_size = (encoded_string.size() + 3) & ~size_t(3);
-
-    std::vector<std::uint8_t> ret;
-    ret.reserve(3 * encoded_size / 4);
-    for (size_t i = 0; i < encoded_size; i += 4)
-    {
-        // Get values for each group of four base 64 characters
-        std::uint8_t b4[4];
-        const auto c0 = encoded_string.next();
-        const auto c1 = encoded_string.next();
-        const auto c2 = encoded_string.next();
-        const auto c3 = encoded_string.next();
-        b4[0] = (c0 <= 'z') ? from_base64[static_cast<std::size_t>(c0)] : 0xff;
-        b4[1] = (c1 <= 'z') ? from_base64[static_cast<std::size_t>(c1)] : 0xff;
-        b4[2] = (c2 <= 'z') ? from_base64[static_cast<std::size_t>(c2)] : 0xff;
-        b4[3] = (c3 <= 'z') ? from_base64[static_cast<std::size_t>(c3)] : 0xff;
-        // Transform into a group of three bytes
-        std::uint8_t b3[3];
-        b3[0] = static_cast<std::uint8_t>(((b4[0] & 0x3f) << 2) + ((b4[1] & 0x30) >> 4));
-        b3[1] = static_cast<std::uint8_t>(((b4[1] & 0x0f) << 4) + ((b4[2] & 0x3c) >> 2));
-        b3[2] = static_cast<std::uint8_t>(((b4[2] & 0x03) << 6) + ((b4[3] & 0x3f) >> 0));
-        // Add the byte to the return value if it isn't part of an '=' character (indicated by 0xff)
-        if (b4[1] != 0xff) ret.push_back(b3[0]);
-        if (b4[2] != 0xff) ret.push_back(b3[1]);
-        if (b4[3] != 0xff) ret.push_back(b3[2]);
+    assertion(std::numeric_limits<float>::is_iec559,
+        "The floating-point format of your system is not supported.");
+    const std::size_t n_bytes = base64_decoded_size(chunks);
+    assertion(n_bytes % sizeof(float) == 0, "invalid float vector data");
+    if (std::is_same<float_type, float>::value)
+    {
+        // Decode directly into the resulting storage.
+        float_vec out(n_bytes / sizeof(float));
+        decode_base64_chunks(chunks, reinterpret_cast<std::uint8_t*>(out.data()));
+        return out;
     }
-    return ret;
+    std::vector<float> values(n_bytes / sizeof(float));
+    decode_base64_chunks(chunks, reinterpret_cast<std::uint8_t*>(values.data()));
+    return float_vec(values.begin(), values.end());
 }
 
 } } // namespace fdeep, namespace internal
@@ -0,0 +1,343 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#if defined(_WIN32)
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fdeep { namespace internal
+{
+
+// Binary model format, as written by convert_model.py with --binary:
+//
+// offset  size  content
+//      0     8  magic "FDEEPBIN"
+//      8     4  format version (uint32)
+//     12     4  byte order mark (uint32 0x01020304)
+//     16     4  blob alignment in bytes (uint32)
+//     20     4  reserved (zero)
+//     24     8  metadata size in bytes (uint64)
+//     32     8  offset of the blob section in bytes (uint64)
+//     40     -  metadata (UTF-8 JSON)
+//      -     -  blob section (raw float32 values)
+//
+// All numbers are stored in the byte order of the byte order mark,
+// i.e., little endian when written by convert_model.py,
+// and native when written as a cache entry (see model_cache.hpp).
+// The values are used as they are, so files of the other byte order
+// are rejected.
+//
+// The metadata is the usual JSON model, but every float array
+// is replaced by {"blob_offset": offset, "blob_count": count},
+// with the offset (in bytes) relative to the start of the blob section.
+// The bytes of arrays of other types (see decode_typed_array)
+// are stored as blobs too, referenced by
+// {"bytes_offset": offset, "bytes_size": size in bytes}.
+// The blob section and every blob in it are aligned to the blob alignment.
+static const char binary_model_magic[] = "FDEEPBIN";
+static const std::uint32_t binary_model_version = 2;
+static const std::uint32_t binary_model_byte_order_mark = 0x01020304;
+static const std::size_t binary_model_header_size = 40;
+static const std::size_t binary_model_blob_alignment = 64;
+
+// Read-only view of a whole file.
+// On POSIX systems the file is memory-mapped,
+// so its pages are only loaded when touched,
+// and they are shared with all other processes mapping the same file.
+class mapped_file
+{
+public:
+    explicit mapped_file(const std::string& path) :
+        data_(nullptr), size_(0)
+    {
+#if defined(_WIN32)
+        std::ifstream stream(path, std::ios::binary | std::ios::ate);
+        assertion(stream.good(), "Can not open " + path);
+        size_ = static_cast<std::size_t>(stream.tellg());
+        // Stored as 64-bit words to keep the float blobs aligned.
+        buffer_.resize((size_ + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t));
+        stream.seekg(0);
+        stream.read(reinterpret_cast<char*>(buffer_.data()),
+            static_cast<std::streamsize>(size_));
+        assertion(stream.good(), "Can not read " + path);
+        data_ = reinterpret_cast<const std::uint8_t*>(buffer_.data());
+#else
+        const int fd = open(path.c_str(), O_RDONLY);
+        assertion(fd >= 0, "Can not open " + path);
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0 || file_stat.st_size <= 0)
+        {
+            close(fd);
+            raise_error("Can not determine size of " + path);
+        }
+        size_ = static_cast<std::size_t>(file_stat.st_size);
+        void* const mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        // The mapping stays valid after closing the file descriptor.
+        close(fd);
+        assertion(mapping != MAP_FAILED, "Can not map " + path);
+        data_ = static_cast<const std::uint8_t*>(mapping);
+#endif
+    }
+    ~mapped_file()
+    {
+#if !defined(_WIN32)
+        munmap(const_cast<std::uint8_t*>(data_), size_);
+#endif
+    }
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const std::uint8_t* data() const
+    {
+        return data_;
+    }
+    std::size_t size() const
+    {
+        return size_;
+    }
+private:
+    const std::uint8_t* data_;
+    std::size_t size_;
+#if defined(_WIN32)
+    std::vector<std::uint64_t> buffer_;
+#endif
+};
+
+inline std::size_t align_binary_model_offset(std::size_t offset)
+{
+    return (offset + binary_model_blob_alignment - 1) /
+        binary_model_blob_alignment * binary_model_blob_alignment;
+}
+
+template <typename T>
+T read_binary_model_value(const std::uint8_t* data)
+{
+    T result;
+    std::memcpy(&result, data, sizeof(T));
+    return result;
+}
+
+// Fast, non-cryptographic hash of the given bytes.
+// FNV-1a, but on 64-bit words instead of single bytes.
+inline std::uint64_t hash_binary_data(const std::uint8_t* data,
+    std::size_t size)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    const auto add = [&hash](std::uint64_t value)
+    {
+        hash = (hash ^ value) * 1099511628211ull;
+        hash ^= hash >> 32;
+    };
+    const std::size_t n_words = size / sizeof(std::uint64_t);
+    for (std::size_t i = 0; i < n_words; ++i)
+    {
+        add(read_binary_model_value<std::uint64_t>(
+            data + i * sizeof(std::uint64_t)));
+    }
+    for (std::size_t i = n_words * sizeof(std::uint64_t); i < size; ++i)
+    {
+        add(data[i]);
+    }
+    add(size);
+    return hash;
+}
+
+struct binary_model_layout
+{
+    const char* metadata_begin_;
+    const char* metadata_end_;
+    const std::uint8_t* blobs_begin_;
+    std::size_t blobs_size_;
+};
+
+inline binary_model_layout parse_binary_model_header(
+    const std::uint8_t* data, std::size_t size)
+{
+    assertion(size >= binary_model_header_size &&
+        std::memcmp(data, binary_model_magic, 8) == 0,
+        "not a binary frugally-deep model");
+    const auto version = read_binary_model_value<std::uint32_t>(data + 8);
+    const auto byte_order_mark = read_binary_model_value<std::uint32_t>(data + 12);
+    assertion(byte_order_mark != 0x04030201,
+        "binary model has the byte order of another platform");
+    assertion(version == binary_model_version,
+        "unsupported binary model version " + std::to_string(version));
+    const auto alignment = read_binary_model_value<std::uint32_t>(data + 16);
+    const auto metadata_size = read_binary_model_value<std::uint64_t>(data + 24);
+    const auto blobs_offset = read_binary_model_value<std::uint64_t>(data + 32);
+    assertion(byte_order_mark == binary_model_byte_order_mark &&
+        alignment > 0 && alignment % sizeof(float) == 0 &&
+        blobs_offset % alignment == 0 &&
+        blobs_offset >= binary_model_header_size &&
+        metadata_size <= blobs_offset - binary_model_header_size &&
+        blobs_offset <= size,
+        "invalid binary model header");
+    const char* metadata_begin = reinterpret_cast<const char*>(
+        data + binary_model_header_size);
+    return {metadata_begin,
+        metadata_begin + metadata_size,
+        data + blobs_offset,
+        static_cast<std::size_t>(size - blobs_offset)};
+}
+
+// An array of a model, located or decoded by the loader,
+// i.e., float values or other bytes in a memory-mapped binary model,
+// or float values decoded by the json_model_parser.
+struct model_blob
+{
+    const std::uint8_t* data_; // nullptr for decoded values
+    std::size_t size_; // in bytes
+    bool floats_;
+    // The bytes stay valid as long as the model exists,
+    // so layers can use them in place (see decode_weights).
+    bool shared_;
+    std::shared_ptr<const float_vec> decoded_;
+};
+
+// Float values decoded (or computed) by the loader.
+inline model_blob decoded_float_blob(
+    const std::shared_ptr<const float_vec>& values)
+{
+    return {nullptr, values->size() * sizeof(float_type), true, false, values};
+}
+
+static const char blob_id_key[] = "blob_id";
+
+// The arrays of a model, which its JSON data refers to
+// by {"blob_id": index} instead of containing them.
+// The JSON data never holds addresses, only indices checked against the table,
+// so a model file can not make the loader read arbitrary memory.
+class blob_table
+{
+public:
+    blob_table() : blobs_()
+    {
+    }
+    // Returns the index of the added blob.
+    std::size_t add(const model_blob& blob)
+    {
+        blobs_.push_back(blob);
+        return blobs_.size() - 1;
+    }
+    const model_blob& get_floats(const nlohmann::json& reference) const
+    {
+        const model_blob& blob = get(reference);
+        assertion(blob.floats_, "invalid float blob reference");
+        return blob;
+    }
+    const model_blob& get_bytes(const nlohmann::json& reference) const
+    {
+        const model_blob& blob = get(reference);
+        assertion(!blob.floats_, "invalid byte blob reference");
+        return blob;
+    }
+private:
+    const model_blob& get(const nlohmann::json& reference) const
+    {
+        const auto it = reference.find(blob_id_key);
+        assertion(it != reference.end() && it->is_number_unsigned() &&
+            it->get<std::size_t>() < blobs_.size(), "invalid blob reference");
+        return blobs_[it->get<std::size_t>()];
+    }
+
+    std::vector<model_blob> blobs_;
+};
+
+inline nlohmann::json blob_reference(std::size_t id)
+{
+    return {{blob_id_key, id}};
+}
+
+inline bool is_blob_reference(const nlohmann::json& data)
+{
+    return data.is_object() && data.find(blob_id_key) != data.end();
+}
+
+// Replaces the blob references in the metadata
+// by references to entries of the given blob table,
+// so decode_floats and decode_typed_array can read them
+// without knowing about the blob section.
+// Shared blobs stay valid as long as the model exists.
+inline void resolve_blobs(nlohmann::json& data,
+    const binary_model_layout& layout, bool shared, blob_table& blobs)
+{
+    if (data.is_object())
+    {
+        assertion(!is_blob_reference(data),
+            std::string("reserved key in model: ") + blob_id_key);
+        const auto it_offset = data.find("blob_offset");
+        if (it_offset != data.end())
+        {
+            const std::size_t offset = *it_offset;
+            const std::size_t count = data.at("blob_count");
+            assertion(offset % sizeof(float) == 0 &&
+                offset <= layout.blobs_size_ &&
+                count <= (layout.blobs_size_ - offset) / sizeof(float),
+                "invalid float blob");
+            data = blob_reference(blobs.add({layout.blobs_begin_ + offset,
+                count * sizeof(float), true, shared, nullptr}));
+            return;
+        }
+        const auto it_bytes_offset = data.find("bytes_offset");
+        if (it_bytes_offset != data.end())
+        {
+            const std::size_t offset = *it_bytes_offset;
+            const std::size_t size = data.at("bytes_size");
+            assertion(offset <= layout.blobs_size_ &&
+                size <= layout.blobs_size_ - offset, "invalid byte blob");
+            data = blob_reference(blobs.add({layout.blobs_begin_ + offset,
+                size, false, shared, nullptr}));
+            return;
+        }
+    }
+    if (data.is_object() || data.is_array())
+    {
+        for (auto& element : data)
+        {
+            resolve_blobs(element, layout, shared, blobs);
+        }
+    }
+}
+
+inline const float* float_blob_data(const model_blob& blob)
+{
+    return reinterpret_cast<const float*>(blob.data_);
+}
+
+inline std::size_t float_blob_count(const model_blob& blob)
+{
+    return blob.size_ / sizeof(float);
+}
+
+inline float_vec decode_float_blob(const model_blob& blob)
+{
+    if (blob.decoded_)
+    {
+        return *blob.decoded_;
+    }
+    const float* values = float_blob_data(blob);
+    return float_vec(values, values + float_blob_count(blob));
+}
+
+} } // namespace fdeep, namespace internal
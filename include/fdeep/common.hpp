@@ -71,6 +71,49 @@ inline void assertion(bool cond, const std::string& error)
     typedef float float_type;
 #endif
 
+// Mixed precision: Tensors and weights stay float_type,
+// but some layer types accumulate their sums in double
+// (and batch normalization computes in double),
+// which avoids most of the numerical drift without the memory
+// and speed cost of FDEEP_FLOAT_TYPE double.
+// FDEEP_ACCUMULATE_DOUBLE enables it for all of these layer types,
+// FDEEP_ACCUMULATE_DOUBLE_<TYPE> for single ones.
+#if defined(FDEEP_ACCUMULATE_DOUBLE) || defined(FDEEP_ACCUMULATE_DOUBLE_DENSE)
+    typedef double dense_accumulator_type;
+#else
+    typedef float_type dense_accumulator_type;
+#endif
+
+#if defined(FDEEP_ACCUMULATE_DOUBLE) || defined(FDEEP_ACCUMULATE_DOUBLE_CONVOLUTION)
+    typedef double convolution_accumulator_type;
+#else
+    typedef float_type convolution_accumulator_type;
+#endif
+
+#if defined(FDEEP_ACCUMULATE_DOUBLE) || defined(FDEEP_ACCUMULATE_DOUBLE_SOFTMAX)
+    typedef double softmax_accumulator_type;
+#else
+    typedef float_type softmax_accumulator_type;
+#endif
+
+#if defined(FDEEP_ACCUMULATE_DOUBLE) || defined(FDEEP_ACCUMULATE_DOUBLE_BATCH_NORMALIZATION)
+    typedef double batch_normalization_accumulator_type;
+#else
+    typedef float_type batch_normalization_accumulator_type;
+#endif
+
+#if defined(FDEEP_ACCUMULATE_DOUBLE) || defined(FDEEP_ACCUMULATE_DOUBLE_POOLING)
+    typedef double pooling_accumulator_type;
+#else
+    typedef float_type pooling_accumulator_type;
+#endif
+
+template <typename Accumulator>
+bool accumulates_wider()
+{
+    return sizeof(Accumulator) > sizeof(float_type);
+}
+
 #if EIGEN_VERSION_AT_LEAST(3,3,0)
     typedef Eigen::Index EigenIndex;
 #else
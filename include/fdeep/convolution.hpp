@@ -9,22 +9,38 @@
 #include "fdeep/common.hpp"
 
 #include "fdeep/filter.hpp"
+#include "fdeep/sparse_weights.hpp"
+#include "fdeep/weight_matrix.hpp"
+#include "fdeep/weights_storage.hpp"
 
 #include <algorithm>
 #include <cassert>
 #include <cstddef>
+#include <memory>
+#include <utility>
 #include <vector>
 
 namespace fdeep { namespace internal
 {
 
+// The weights of all filters form one (filter_count, fy * fx * fz)
+// row-major matrix, which is the order they are stored in the model file,
+// so they do not need to be rearranged (or even copied).
+// It is the transposed weight matrix of the im2col product.
 struct im2col_filter_matrix
 {
-    ColMajorMatrixXf mat_;
+    weight_matrix_ptr matrix_;
     tensor_shape filter_shape_;
     std::size_t filter_count_;
 };
 
+inline weight_matrix_ptr create_im2col_float_weight_matrix(
+    const weights_storage& weights, const weights_storage& bias)
+{
+    return create_float_weight_matrix(weights, bias, true,
+        accumulates_wider<convolution_accumulator_type>(), true);
+}
+
 inline im2col_filter_matrix generate_im2col_filter_matrix(
     const std::vector<filter>& filters)
 {
@@ -35,100 +51,53 @@ inline im2col_filter_matrix generate_im2col_filter_matrix(
     const std::size_t fy = filters.front().shape().height_;
     const std::size_t fx = filters.front().shape().width_;
     const std::size_t fz = filters.front().shape().depth_;
-    ColMajorMatrixXf b(filters.size(), fy * fx * fz + 1);
-    EigenIndex b_y = 0;
-    EigenIndex b_x = 0;
-    for (std::size_t f = 0; f < filters.size(); ++f)
+    float_vec weights;
+    weights.reserve(filters.size() * fy * fx * fz);
+    float_vec bias;
+    bias.reserve(filters.size());
+    for (const filter& filter : filters)
     {
-        b_x = 0;
-        const filter& filter = filters[f];
         for (std::size_t yf = 0; yf < fy; ++yf)
         {
             for (std::size_t xf = 0; xf < fx; ++xf)
             {
                 for (std::size_t zf = 0; zf < fz; ++zf)
                 {
-                    b(b_y, b_x++) = filter.get(tensor_pos(yf, xf, zf));
+                    weights.push_back(filter.get(tensor_pos(yf, xf, zf)));
                 }
             }
         }
-        b(b_y, b_x++) = filter.get_bias();
-        ++b_y;
+        bias.push_back(filter.get_bias());
     }
-    return {b, filters.front().shape(), filters.size()};
+    return {create_im2col_float_weight_matrix(
+            weights_storage(std::move(weights)),
+            weights_storage(std::move(bias))),
+        filters.front().shape(), filters.size()};
 }
 
-inline im2col_filter_matrix generate_im2col_single_filter_matrix(
-    const filter& filter)
-{
-    return generate_im2col_filter_matrix(filter_vec(1, filter));
-}
-
-// GEMM convolution, faster but uses more RAM
-// https://stackoverflow.com/questions/16798888/2-d-convolution-as-a-matrix-matrix-multiplication
-// https://github.com/tensorflow/tensorflow/blob/a0d784bdd31b27e013a7eac58a86ba62e86db299/tensorflow/core/kernels/conv_ops_using_gemm.cc
-// http://www.youtube.com/watch?v=pA4BsUK3oP4&t=36m22s
-inline tensor convolve_im2col(
-    std::size_t out_height,
-    std::size_t out_width,
-    std::size_t strides_y,
-    std::size_t strides_x,
-    const im2col_filter_matrix& filter_mat,
-    const tensor& in_padded)
+// Uses the weights as they are, unless they need to be dilated.
+inline im2col_filter_matrix generate_im2col_filter_matrix(
+    const shape2& dilation_rate,
+    const tensor_shape& filter_shape, std::size_t k,
+    const weights_storage& weights, const weights_storage& bias)
 {
-    const auto fy = filter_mat.filter_shape_.height_;
-    const auto fx = filter_mat.filter_shape_.width_;
-    const auto fz = filter_mat.filter_shape_.depth_;
-    ColMajorMatrixXf a(fy * fx * fz + 1, out_height * out_width);
-    EigenIndex a_x = 0;
-    for (std::size_t y = 0; y < out_height; ++y)
+    if (dilation_rate.height_ != 1 || dilation_rate.width_ != 1)
     {
-        for (std::size_t x = 0; x < out_width; ++x)
-        {
-            EigenIndex a_y = 0;
-            for (std::size_t yf = 0; yf < fy; ++yf)
-            {
-                for (std::size_t xf = 0; xf < fx; ++xf)
-                {
-                    for (std::size_t zf = 0; zf < fz; ++zf)
-                    {
-                        a(a_y++, a_x) = in_padded.get_ignore_rank(tensor_pos(
-                                strides_y * y + yf,
-                                strides_x * x + xf,
-                                zf));
-                    }
-                }
-                a(a_y, a_x) = static_cast<float_type>(1);
-            }
-            ++a_x;
-        }
+        return generate_im2col_filter_matrix(generate_filters(
+            dilation_rate, filter_shape, k,
+            weights.to_float_vec(), bias.to_float_vec()));
     }
+    assertion(k > 0, "at least one filter needed");
+    assertion(weights.size() == k * filter_shape.volume(),
+        "invalid weight size");
+    assertion(bias.size() == k, "invalid bias size");
+    return {create_im2col_float_weight_matrix(weights, bias), filter_shape, k};
+}
 
-    const std::size_t val_cnt =
-        static_cast<std::size_t>(filter_mat.mat_.rows() * a.cols());
-    assertion(val_cnt % (out_height * out_width) == 0,
-        "Can not calculate out_depth");
-
-    const std::size_t out_depth = val_cnt / (out_height * out_width);
-    assertion(val_cnt == out_depth * out_height * out_width,
-        "Invalid target size");
-
-    shared_float_vec res_vec = fplus::make_shared_ref<float_vec>();
-    res_vec->resize(static_cast<std::size_t>(out_depth * out_height * out_width));
-
-    Eigen::Map<ColMajorMatrixXf, Eigen::Unaligned> out_mat_map(
-        res_vec->data(),
-        static_cast<EigenIndex>(filter_mat.mat_.rows()),
-        static_cast<EigenIndex>(a.cols()));
-
-    // https://stackoverflow.com/questions/48644724/multiply-two-eigen-matrices-directly-into-memory-of-target-matrix
-    out_mat_map.noalias() = filter_mat.mat_ * a;
-
-    return tensor(
-        tensor_shape_with_changed_rank(
-            tensor_shape(out_height, out_width, out_depth),
-            in_padded.shape().rank()),
-        res_vec);
+inline im2col_filter_matrix generate_im2col_single_filter_matrix(
+    const filter& filter)
+{
+    return generate_im2col_filter_matrix(filter_vec(1, filter));
 }
 
 enum class padding { valid, same, causal };
@@ -214,30 +183,123 @@ inline convolution_config preprocess_convolution(
         out_height_size_t, out_width_size_t};
 }
 
-inline tensor convolve(
+// GEMM convolution, faster but uses more RAM
+// https://stackoverflow.com/questions/16798888/2-d-convolution-as-a-matrix-matrix-multiplication
+// https://github.com/tensorflow/tensorflow/blob/a0d784bdd31b27e013a7eac58a86ba62e86db299/tensorflow/core/kernels/conv_ops_using_gemm.cc
+// http://www.youtube.com/watch?v=pA4BsUK3oP4&t=36m22s
+// The input consists of n_slices images (in_height, in_width, depth)
+// stored one after another. They are convolved in one single matrix product,
+// and the padding is applied while building the im2col matrix,
+// so no padded copy of the input is needed.
+// The im2col matrix is column-major, so its columns (one per output pixel)
+// are the input rows of the filter weight matrix.
+// The output images are stored one after another too.
+inline shared_float_vec convolve_im2col_slices(
+    const convolution_config& conv_cfg,
+    std::size_t strides_y,
+    std::size_t strides_x,
+    const im2col_filter_matrix& filter_mat,
+    const float_type* in_values,
+    std::size_t n_slices,
+    std::size_t in_height,
+    std::size_t in_width)
+{
+    const auto fy = filter_mat.filter_shape_.height_;
+    const auto fx = filter_mat.filter_shape_.width_;
+    const auto fz = filter_mat.filter_shape_.depth_;
+    const std::size_t out_height = conv_cfg.out_height_;
+    const std::size_t out_width = conv_cfg.out_width_;
+    const std::size_t slice_volume = in_height * in_width * fz;
+
+    ColMajorMatrixXf a(fy * fx * fz, n_slices * out_height * out_width);
+    EigenIndex a_x = 0;
+    for (std::size_t slice = 0; slice < n_slices; ++slice)
+    {
+        const float_type* slice_values = in_values + slice * slice_volume;
+        for (std::size_t y = 0; y < out_height; ++y)
+        {
+            for (std::size_t x = 0; x < out_width; ++x)
+            {
+                float_type* a_col = a.data() + a_x * a.rows();
+                for (std::size_t yf = 0; yf < fy; ++yf)
+                {
+                    // Positions in the unpadded input.
+                    const std::size_t y_in_padded = strides_y * y + yf;
+                    const bool y_valid = y_in_padded >= conv_cfg.pad_top_ &&
+                        y_in_padded - conv_cfg.pad_top_ < in_height;
+                    for (std::size_t xf = 0; xf < fx; ++xf)
+                    {
+                        const std::size_t x_in_padded = strides_x * x + xf;
+                        const bool x_valid = x_in_padded >= conv_cfg.pad_left_ &&
+                            x_in_padded - conv_cfg.pad_left_ < in_width;
+                        if (y_valid && x_valid)
+                        {
+                            std::copy_n(slice_values +
+                                ((y_in_padded - conv_cfg.pad_top_) * in_width +
+                                    (x_in_padded - conv_cfg.pad_left_)) * fz,
+                                fz, a_col);
+                        }
+                        else
+                        {
+                            std::fill_n(a_col, fz, static_cast<float_type>(0));
+                        }
+                        a_col += fz;
+                    }
+                }
+                ++a_x;
+            }
+        }
+    }
+
+    const std::size_t filter_count = filter_mat.filter_count_;
+    shared_float_vec res_vec = fplus::make_shared_ref<float_vec>();
+    res_vec->resize(filter_count * static_cast<std::size_t>(a.cols()));
+
+    filter_mat.matrix_->apply(a.data(), static_cast<std::size_t>(a.cols()),
+        res_vec->data());
+
+    return res_vec;
+}
+
+// Convolves all slices (the outer dimensions) of the input
+// and returns the output shape of one slice along with the output values.
+inline std::pair<tensor_shape, shared_float_vec> convolve_slices(
     const shape2& strides,
     const padding& pad_type,
     const im2col_filter_matrix& filter_mat,
-    const tensor& input)
+    const tensor& input,
+    const tensor_shape& slice_shape)
 {
-    assertion(filter_mat.filter_shape_.depth_ == input.shape().depth_,
+    assertion(filter_mat.filter_shape_.depth_ == slice_shape.depth_,
         "invalid filter depth");
 
     const auto conv_cfg = preprocess_convolution(
         filter_mat.filter_shape_.without_depth(),
-        strides, pad_type, input.shape().height_, input.shape().width_);
+        strides, pad_type, slice_shape.height_, slice_shape.width_);
 
-    const std::size_t out_height = conv_cfg.out_height_;
-    const std::size_t out_width = conv_cfg.out_width_;
+    const std::size_t n_slices =
+        input.shape().volume() / (slice_shape.height_ * slice_shape.width_ * slice_shape.depth_);
 
-    const auto in_padded = pad_tensor(0,
-        conv_cfg.pad_top_, conv_cfg.pad_bottom_, conv_cfg.pad_left_, conv_cfg.pad_right_,
-        input);
+    const auto out_shape = tensor_shape_with_changed_rank(
+        tensor_shape(conv_cfg.out_height_, conv_cfg.out_width_,
+            filter_mat.filter_count_),
+        slice_shape.rank());
 
-    return convolve_im2col(
-        out_height, out_width,
-        strides.height_, strides.width_,
-        filter_mat, in_padded);
+    return {out_shape, convolve_im2col_slices(conv_cfg,
+        strides.height_, strides.width_, filter_mat,
+        input.as_vector()->data(), n_slices,
+        slice_shape.height_, slice_shape.width_)};
+}
+
+inline tensor convolve(
+    const shape2& strides,
+    const padding& pad_type,
+    const im2col_filter_matrix& filter_mat,
+    const tensor& input)
+{
+    const auto result = convolve_slices(strides, pad_type, filter_mat,
+        input, input.shape());
+    return tensor(result.first, result.second);
 }
 
 } } // namespace fdeep, namespace internal
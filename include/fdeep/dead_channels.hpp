@@ -0,0 +1,447 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/import_model.hpp"
+
+#include <fplus/fplus.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace fdeep { namespace internal
+{
+
+// Dead channels: Output channels of a convolution or dense layer,
+// whose weights are all zero (e.g., pruned filters),
+// or which a following batch normalization scales with a gamma of zero,
+// have the same value for every input.
+// When a model is loaded, they are removed from the layer producing them,
+// and from the batch normalizations and element-wise activations
+// between it and the convolution or dense layer consuming them,
+// whose weights for these input channels are sliced out,
+// so all of these layers become smaller instead of computing zeros.
+// The constant values of the removed channels are folded into the bias
+// of the consuming layer. This is exact for dense layers and for
+// convolutions without padding. Convolutions with padding would see
+// the padded zeros instead, so only channels with a value of zero
+// are removed in front of them.
+// The weights are only scanned in place. The sliced ones are added
+// to the blob table of the model, like the ones decoded by the loader.
+
+// Indices (per connection) of the layers consuming the output of a layer.
+typedef std::map<std::string, std::vector<std::size_t>> layer_consumers;
+
+inline layer_consumers find_layer_consumers(const nlohmann::json& layers)
+{
+    layer_consumers result;
+    for (std::size_t i = 0; i < layers.size(); ++i)
+    {
+        for (const auto& inbound_node : layers[i]["inbound_nodes"])
+        {
+            for (const auto& connection : inbound_node)
+            {
+                result[create_node_connection(connection).layer_id_].push_back(i);
+            }
+        }
+    }
+    return result;
+}
+
+inline bool has_single_inbound_connection(const nlohmann::json& data)
+{
+    return data["inbound_nodes"].size() == 1 &&
+        data["inbound_nodes"][0].size() == 1;
+}
+
+// Dense layers and convolutions with weights stored as float values,
+// which can be sliced (see float_weight_matrix).
+inline bool has_float_weight_matrix(const nlohmann::json& data,
+    const nlohmann::json& params)
+{
+    const std::string type = data["class_name"];
+    const std::string name = data["name"];
+    return (type == "Dense" || type == "Conv1D" || type == "Conv2D") &&
+        json_object_get(data["config"], "groups", 1) == 1 &&
+        !get_layer_param(params, name, "weights").is_null() &&
+        get_layer_param(params, name, "weights_int8").is_null() &&
+        get_layer_param(params, name, "weights_palette_indices").is_null() &&
+        get_layer_param(params, name, "weights_half").is_null();
+}
+
+// Convolutions store their weights as one row per filter.
+inline bool has_transposed_weight_matrix(const nlohmann::json& data)
+{
+    return data["class_name"] != "Dense";
+}
+
+inline std::size_t output_channel_count(const nlohmann::json& data)
+{
+    return data["class_name"] == "Dense"
+        ? create_size_t(data["config"]["units"])
+        : create_size_t(data["config"]["filters"]);
+}
+
+// Layers keeping constant channels constant, and the channels in place.
+inline bool is_channel_wise_layer(const nlohmann::json& data,
+    const nlohmann::json& producer_data)
+{
+    const std::string type = data["class_name"];
+    if (type == "BatchNormalization")
+    {
+        const auto axis = create_vector<int>(create_int, data["config"]["axis"]);
+        const std::string producer_type = producer_data["class_name"];
+        return axis.size() == 1 && (axis.front() == -1 ||
+            (producer_type == "Conv2D" && axis.front() == 3) ||
+            (producer_type == "Conv1D" && axis.front() == 2));
+    }
+    if (type == "Activation")
+    {
+        return data["config"]["activation"] != "softmax";
+    }
+    return fplus::is_elem_of(type, std::vector<std::string>({
+        "ReLU", "LeakyReLU", "ELU", "Dropout", "AlphaDropout",
+        "GaussianDropout", "GaussianNoise"}));
+}
+
+// A producing layer, the channel-wise layers after it,
+// and the consuming layer, each being the only user of the one before.
+struct dead_channel_chain
+{
+    std::size_t producer_;
+    std::vector<std::size_t> channel_wise_layers_;
+    std::size_t consumer_;
+};
+
+inline fplus::maybe<dead_channel_chain> find_dead_channel_chain(
+    const nlohmann::json& layers, const layer_consumers& consumers,
+    const std::vector<std::string>& output_layer_names,
+    const nlohmann::json& params, std::size_t producer)
+{
+    const auto& producer_data = layers[producer];
+    if (!has_float_weight_matrix(producer_data, params) ||
+        !has_single_inbound_connection(producer_data) ||
+        producer_data["config"]["activation"] == "softmax")
+    {
+        return fplus::nothing<dead_channel_chain>();
+    }
+    dead_channel_chain chain = {producer, {}, 0};
+    std::string name = producer_data["name"];
+    for (;;)
+    {
+        const auto it = consumers.find(name);
+        if (fplus::is_elem_of(name, output_layer_names) ||
+            it == consumers.end() || it->second.size() != 1)
+        {
+            return fplus::nothing<dead_channel_chain>();
+        }
+        const std::size_t next = it->second.front();
+        const auto& data = layers[next];
+        if (!has_single_inbound_connection(data))
+        {
+            return fplus::nothing<dead_channel_chain>();
+        }
+        if (has_float_weight_matrix(data, params))
+        {
+            chain.consumer_ = next;
+            return chain;
+        }
+        if (!is_channel_wise_layer(data, producer_data))
+        {
+            return fplus::nothing<dead_channel_chain>();
+        }
+        chain.channel_wise_layers_.push_back(next);
+        name = data["name"];
+    }
+}
+
+// The float values of a parameter, used in place where possible.
+// Unlike with decode_weights, this includes float blobs
+// in a binary model the layers will copy their weights from,
+// because the values are only needed while the model is loaded.
+inline weights_storage view_weights(const nlohmann::json& data,
+    const blob_table& blobs)
+{
+    if (std::is_same<float_type, float>::value && is_blob_reference(data))
+    {
+        const model_blob& blob = blobs.get_floats(data);
+        if (!blob.decoded_)
+        {
+            return weights_storage(
+                reinterpret_cast<const float_type*>(float_blob_data(blob)),
+                float_blob_count(blob));
+        }
+    }
+    return decode_weights(data, blobs);
+}
+
+inline std::size_t weight_index(bool transposed,
+    std::size_t n_in, std::size_t n_out, std::size_t i, std::size_t j)
+{
+    return transposed ? j * n_in + i : i * n_out + j;
+}
+
+// Keeps the weights of the inputs i with keep_in[i]
+// and of the outputs j with keep_out[j],
+// stored like the ones of a float_weight_matrix.
+inline float_vec slice_weight_matrix(const weights_storage& weights,
+    bool transposed,
+    const std::vector<bool>& keep_in, const std::vector<bool>& keep_out)
+{
+    const std::vector<bool>& keep_rows = transposed ? keep_out : keep_in;
+    const std::vector<bool>& keep_cols = transposed ? keep_in : keep_out;
+    assertion(weights.size() == keep_rows.size() * keep_cols.size(),
+        "invalid weight count");
+    float_vec result;
+    for (std::size_t r = 0; r < keep_rows.size(); ++r)
+    {
+        for (std::size_t c = 0; c < keep_cols.size() && keep_rows[r]; ++c)
+        {
+            if (keep_cols[c])
+            {
+                result.push_back(weights.data()[r * keep_cols.size() + c]);
+            }
+        }
+    }
+    return result;
+}
+
+inline float_vec slice_channels(const weights_storage& values,
+    const std::vector<bool>& keep)
+{
+    assertion(values.size() == keep.size(), "invalid channel count");
+    float_vec result;
+    for (std::size_t i = 0; i < values.size(); ++i)
+    {
+        if (keep[i])
+        {
+            result.push_back(values.data()[i]);
+        }
+    }
+    return result;
+}
+
+inline nlohmann::json add_float_blob(blob_table& blobs, float_vec&& values)
+{
+    return blob_reference(blobs.add(decoded_float_blob(
+        std::make_shared<const float_vec>(std::move(values)))));
+}
+
+// Returns the number of removed channels.
+inline std::size_t eliminate_dead_channels(const dead_channel_chain& chain,
+    nlohmann::json& layers, nlohmann::json& params,
+    const std::shared_ptr<blob_table>& blobs)
+{
+    const get_param_f get_param([&params]
+        (const std::string& layer_name, const std::string& param_name)
+        -> nlohmann::json
+    {
+        return get_layer_param(params, layer_name, param_name);
+    }, blobs);
+
+    nlohmann::json& producer_data = layers[chain.producer_];
+    const std::string producer_name = producer_data["name"];
+    const bool producer_transposed = has_transposed_weight_matrix(producer_data);
+    const std::size_t n = output_channel_count(producer_data);
+    const weights_storage producer_weights =
+        view_weights(get_param(producer_name, "weights"), get_param.blobs());
+    if (n == 0 || producer_weights.size() % n != 0)
+    {
+        return 0;
+    }
+    const std::size_t producer_n_in = producer_weights.size() / n;
+
+    std::vector<bool> dead(n, true);
+    for (std::size_t i = 0; i < producer_n_in; ++i)
+    {
+        for (std::size_t j = 0; j < n; ++j)
+        {
+            dead[j] = dead[j] && producer_weights.data()[weight_index(
+                producer_transposed, producer_n_in, n, i, j)] == 0;
+        }
+    }
+    for (const std::size_t idx : chain.channel_wise_layers_)
+    {
+        const auto gamma = get_param(layers[idx]["name"], "gamma");
+        if (layers[idx]["class_name"] == "BatchNormalization" &&
+            !gamma.is_null())
+        {
+            const weights_storage gamma_values =
+                view_weights(gamma, get_param.blobs());
+            assertion(gamma_values.size() == n, "invalid gamma");
+            for (std::size_t j = 0; j < n; ++j)
+            {
+                dead[j] = dead[j] || gamma_values.data()[j] == 0;
+            }
+        }
+    }
+    if (std::count(dead.begin(), dead.end(), true) == 0)
+    {
+        return 0;
+    }
+
+    nlohmann::json& consumer_data = layers[chain.consumer_];
+    const std::string consumer_name = consumer_data["name"];
+    const bool consumer_transposed = has_transposed_weight_matrix(consumer_data);
+    const std::size_t consumer_n_out = output_channel_count(consumer_data);
+    const weights_storage consumer_weights =
+        view_weights(get_param(consumer_name, "weights"), get_param.blobs());
+    if (consumer_n_out == 0 || consumer_weights.size() % consumer_n_out != 0 ||
+        (consumer_weights.size() / consumer_n_out) % n != 0)
+    {
+        return 0;
+    }
+    const std::size_t consumer_n_in = consumer_weights.size() / consumer_n_out;
+
+    // The value of each channel at the input of the consumer,
+    // computed by the producer if its weights are zero.
+    const bool producer_use_bias = producer_data["config"]["use_bias"];
+    const weights_storage producer_bias = producer_use_bias
+        ? view_weights(get_param(producer_name, "bias"), get_param.blobs())
+        : weights_storage(float_vec(n, 0));
+    assertion(producer_bias.size() == n, "size of bias does not match");
+    // The rank of the output matters for the axis of batch normalizations.
+    const std::string producer_type = producer_data["class_name"];
+    const tensor_shape values_shape = producer_type == "Conv2D"
+        ? tensor_shape(1, 1, n)
+        : producer_type == "Conv1D" ? tensor_shape(1, n) : tensor_shape(n);
+    tensor values = create_activation_layer_type_name(get_param,
+        producer_data, producer_data["config"]["activation"], "")->apply(
+            {tensor(values_shape, producer_bias.to_float_vec())}).front();
+    for (const std::size_t idx : chain.channel_wise_layers_)
+    {
+        values = create_layer(get_param, layers[idx], layer_creators())->apply(
+            {values}).front();
+    }
+    const float_vec constants = *values.as_vector();
+
+    const bool can_fold = consumer_data["class_name"] == "Dense" ||
+        consumer_data["config"]["padding"] == "valid";
+    std::vector<bool> keep(n);
+    for (std::size_t j = 0; j < n; ++j)
+    {
+        keep[j] = !dead[j] || (!can_fold && constants[j] != 0);
+    }
+    if (std::count(keep.begin(), keep.end(), true) == 0)
+    {
+        // Layers without channels are not supported.
+        keep.back() = true;
+    }
+    const std::size_t removed = static_cast<std::size_t>(
+        std::count(keep.begin(), keep.end(), false));
+    if (removed == 0)
+    {
+        return 0;
+    }
+
+    const bool consumer_use_bias = consumer_data["config"]["use_bias"];
+    float_vec consumer_bias = consumer_use_bias
+        ? decode_floats(get_param(consumer_name, "bias"), get_param.blobs())
+        : float_vec(consumer_n_out, 0);
+    assertion(consumer_bias.size() == consumer_n_out,
+        "size of bias does not match");
+    std::vector<bool> keep_consumer_in(consumer_n_in);
+    for (std::size_t i = 0; i < consumer_n_in; ++i)
+    {
+        keep_consumer_in[i] = keep[i % n];
+        if (!keep_consumer_in[i] && constants[i % n] != 0)
+        {
+            for (std::size_t j = 0; j < consumer_n_out; ++j)
+            {
+                consumer_bias[j] += constants[i % n] *
+                    consumer_weights.data()[weight_index(consumer_transposed,
+                        consumer_n_in, consumer_n_out, i, j)];
+            }
+        }
+    }
+
+    // Everything is computed before any parameters are replaced.
+    float_vec new_producer_weights = slice_weight_matrix(producer_weights,
+        producer_transposed, std::vector<bool>(producer_n_in, true), keep);
+    float_vec new_consumer_weights = slice_weight_matrix(consumer_weights,
+        consumer_transposed, keep_consumer_in,
+        std::vector<bool>(consumer_n_out, true));
+
+    params[producer_name]["weights"] =
+        add_float_blob(*blobs, std::move(new_producer_weights));
+    if (producer_use_bias)
+    {
+        params[producer_name]["bias"] = add_float_blob(*blobs,
+            slice_channels(producer_bias, keep));
+    }
+    producer_data["config"][producer_data["class_name"] == "Dense"
+        ? "units" : "filters"] = n - removed;
+
+    for (const std::size_t idx : chain.channel_wise_layers_)
+    {
+        const std::string name = layers[idx]["name"];
+        for (const std::string param_name :
+            {"moving_mean", "moving_variance", "beta", "gamma"})
+        {
+            const auto param = get_param(name, param_name);
+            if (!param.is_null())
+            {
+                params[name][param_name] = add_float_blob(*blobs,
+                    slice_channels(view_weights(param, get_param.blobs()), keep));
+            }
+        }
+    }
+
+    params[consumer_name]["weights"] =
+        add_float_blob(*blobs, std::move(new_consumer_weights));
+    if (consumer_use_bias || std::any_of(consumer_bias.begin(),
+        consumer_bias.end(), [](float_type b) { return b != 0; }))
+    {
+        params[consumer_name]["bias"] =
+            add_float_blob(*blobs, std::move(consumer_bias));
+        consumer_data["config"]["use_bias"] = true;
+    }
+    return removed;
+}
+
+// Removes the dead channels in all (also nested) models.
+// Returns the number of removed channels.
+inline std::size_t eliminate_dead_channels(nlohmann::json& architecture,
+    nlohmann::json& params, const std::shared_ptr<blob_table>& blobs)
+{
+    nlohmann::json& layers = architecture["config"]["layers"];
+    assertion(layers.is_array(), "missing layers array");
+    std::size_t removed = 0;
+    for (auto& data : layers)
+    {
+        if (data["class_name"] == "Model")
+        {
+            removed += eliminate_dead_channels(data, params, blobs);
+        }
+    }
+    const std::vector<std::string> output_layer_names = fplus::transform(
+        [](const node_connection& connection) { return connection.layer_id_; },
+        create_vector<node_connection>(create_node_connection,
+            architecture["config"]["output_layers"]));
+    const layer_consumers consumers = find_layer_consumers(layers);
+    for (std::size_t i = 0; i < layers.size(); ++i)
+    {
+        const auto chain = find_dead_channel_chain(
+            layers, consumers, output_layer_names, params, i);
+        if (chain.is_just())
+        {
+            removed += eliminate_dead_channels(
+                chain.unsafe_get_just(), layers, params, blobs);
+        }
+    }
+    return removed;
+}
+
+} } // namespace fdeep, namespace internal
@@ -8,8 +8,17 @@
 
 #include "fdeep/common.hpp"
 
+#include "fdeep/binary_model.hpp"
 #include "fdeep/convolution.hpp"
+#include "fdeep/dead_channels.hpp"
 #include "fdeep/filter.hpp"
+#include "fdeep/half_precision.hpp"
+#include "fdeep/json_model_parser.hpp"
+#include "fdeep/low_rank.hpp"
+#include "fdeep/model_cache.hpp"
+#include "fdeep/palettization.hpp"
+#include "fdeep/quantization.hpp"
+#include "fdeep/sparse_weights.hpp"
 #include "fdeep/tensor.hpp"
 #include "fdeep/tensor_pos.hpp"
 #include "fdeep/node.hpp"
@@ -17,6 +26,9 @@
 #include "fdeep/tensor_shape.hpp"
 #include "fdeep/tensor_shape_variable.hpp"
 #include "fdeep/recurrent_ops.hpp"
+#include "fdeep/weight_matrix.hpp"
+#include "fdeep/weights_pool.hpp"
+#include "fdeep/weights_storage.hpp"
 #include "fdeep/layers/add_layer.hpp"
 #include "fdeep/layers/average_layer.hpp"
 #include "fdeep/layers/average_pooling_2d_layer.hpp"
@@ -33,6 +45,7 @@
 #include "fdeep/layers/hard_sigmoid_layer.hpp"
 #include "fdeep/layers/input_layer.hpp"
 #include "fdeep/layers/layer.hpp"
+#include "fdeep/layers/lazy_layer.hpp"
 #include "fdeep/layers/leaky_relu_layer.hpp"
 #include "fdeep/layers/prelu_layer.hpp"
 #include "fdeep/layers/linear_layer.hpp"
@@ -61,3 +74,4 @@
 #include "fdeep/import_model.hpp"
 
 #include "fdeep/model.hpp"
+#include "fdeep/model_registry.hpp"
@@ -0,0 +1,344 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/weight_matrix.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace fdeep { namespace internal
+{
+
+// Weights can be stored as 16-bit floats (see convert_model.py --float16
+// and --bfloat16), which halves their memory (and memory bandwidth).
+// They are widened to float_type when used, so all computations,
+// and the activations, stay in full precision.
+// float16: IEEE 754 half precision (5 exponent bits, 10 mantissa bits).
+// bfloat16: the upper half of a float32 (8 exponent bits, 7 mantissa bits),
+// i.e., the range of float32 with less precision.
+enum class half_precision { float16, bfloat16 };
+
+typedef std::vector<std::uint16_t> half_vec;
+
+// The names used as dtype in the model file.
+inline half_precision create_half_precision(const std::string& dtype)
+{
+    if (dtype == "float16")
+        return half_precision::float16;
+    if (dtype == "bfloat16")
+        return half_precision::bfloat16;
+    raise_error("invalid half precision type: " + dtype);
+    return half_precision::float16; // Is never called
+}
+
+inline float half_to_float(std::uint16_t value, half_precision precision)
+{
+    std::uint32_t bits = static_cast<std::uint32_t>(value) << 16;
+    if (precision == half_precision::float16)
+    {
+        const std::uint32_t sign = (static_cast<std::uint32_t>(value) & 0x8000u) << 16;
+        const std::uint32_t exponent = (value >> 10) & 0x1fu;
+        std::uint32_t mantissa = value & 0x3ffu;
+        if (exponent == 0x1fu)
+        {
+            bits = sign | 0x7f800000u | (mantissa << 13);
+        }
+        else if (exponent != 0)
+        {
+            bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        }
+        else if (mantissa == 0)
+        {
+            bits = sign;
+        }
+        else
+        {
+            // Subnormal values become normal floats.
+            std::uint32_t float_exponent = 113;
+            while ((mantissa & 0x400u) == 0)
+            {
+                mantissa <<= 1;
+                --float_exponent;
+            }
+            bits = sign | (float_exponent << 23) | ((mantissa & 0x3ffu) << 13);
+        }
+    }
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+// Rounds to the nearest value, ties to even.
+inline std::uint16_t float_to_half(float value, half_precision precision)
+{
+    std::uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if (precision == half_precision::bfloat16)
+    {
+        if ((bits & 0x7fffffffu) > 0x7f800000u)
+        {
+            return static_cast<std::uint16_t>((bits >> 16) | 0x40u); // NaN
+        }
+        return static_cast<std::uint16_t>(
+            (bits + 0x7fffu + ((bits >> 16) & 1u)) >> 16);
+    }
+    const std::uint32_t sign = (bits >> 16) & 0x8000u;
+    const std::uint32_t magnitude = bits & 0x7fffffffu;
+    if (magnitude >= 0x7f800000u) // Inf or NaN
+    {
+        return static_cast<std::uint16_t>(sign | 0x7c00u |
+            (magnitude > 0x7f800000u ? 0x200u : 0u));
+    }
+    if (magnitude >= 0x477ff000u) // Rounds to more than 65504.
+    {
+        return static_cast<std::uint16_t>(sign | 0x7c00u);
+    }
+    if (magnitude >= 0x38800000u) // Normal
+    {
+        const std::uint32_t rounded =
+            magnitude + 0xfffu + ((magnitude >> 13) & 1u);
+        return static_cast<std::uint16_t>(sign | ((rounded - 0x38000000u) >> 13));
+    }
+    if (magnitude < 0x33000000u) // Rounds to zero.
+    {
+        return static_cast<std::uint16_t>(sign);
+    }
+    // Subnormal
+    const std::uint32_t shift = 126 - (magnitude >> 23);
+    const std::uint32_t mantissa = (magnitude & 0x7fffffu) | 0x800000u;
+    const std::uint32_t halfway = 1u << (shift - 1);
+    const std::uint32_t rest = mantissa & ((1u << shift) - 1);
+    std::uint32_t result = mantissa >> shift;
+    if (rest > halfway || (rest == halfway && (result & 1u) != 0))
+    {
+        ++result;
+    }
+    return static_cast<std::uint16_t>(sign | result);
+}
+
+inline half_vec floats_to_half(const float_type* values, std::size_t n,
+    half_precision precision)
+{
+    half_vec result(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        result[i] = float_to_half(static_cast<float>(values[i]), precision);
+    }
+    return result;
+}
+
+#if defined(__AVX2__)
+// Widens 8 values in registers: float16 with F16C,
+// bfloat16 by shifting it into the upper half of a float32.
+template <half_precision Precision>
+__m256 widen_half_8(const std::uint16_t* values)
+{
+    const __m128i halves = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(values));
+#if defined(__F16C__)
+    if (Precision == half_precision::float16)
+    {
+        return _mm256_cvtph_ps(halves);
+    }
+#endif
+    return _mm256_castsi256_ps(
+        _mm256_slli_epi32(_mm256_cvtepu16_epi32(halves), 16));
+}
+
+template <half_precision Precision>
+bool can_widen_half_8()
+{
+#if defined(__F16C__)
+    return true;
+#else
+    return Precision == half_precision::bfloat16;
+#endif
+}
+
+inline float horizontal_sum_float(__m256 values)
+{
+    const __m128 sum_4 = _mm_add_ps(_mm256_castps256_ps128(values),
+        _mm256_extractf128_ps(values, 1));
+    const __m128 sum_2 = _mm_add_ps(sum_4, _mm_movehl_ps(sum_4, sum_4));
+    const __m128 sum_1 = _mm_add_ss(sum_2, _mm_movehdup_ps(sum_2));
+    return _mm_cvtss_f32(sum_1);
+}
+
+inline __m256 multiply_add_float(__m256 a, __m256 b, __m256 acc)
+{
+#if defined(__FMA__)
+    return _mm256_fmadd_ps(a, b, acc);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), acc);
+#endif
+}
+#endif
+
+template <half_precision Precision>
+void widen_half(const std::uint16_t* values, std::size_t n, float_type* dest)
+{
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    if (std::is_same<float_type, float>::value && can_widen_half_8<Precision>())
+    {
+        float* dest_float = reinterpret_cast<float*>(dest);
+        for (; i + 8 <= n; i += 8)
+        {
+            _mm256_storeu_ps(dest_float + i, widen_half_8<Precision>(values + i));
+        }
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        dest[i] = static_cast<float_type>(half_to_float(values[i], Precision));
+    }
+}
+
+inline void widen_half(const std::uint16_t* values, std::size_t n,
+    half_precision precision, float_type* dest)
+{
+    if (precision == half_precision::float16)
+        widen_half<half_precision::float16>(values, n, dest);
+    else
+        widen_half<half_precision::bfloat16>(values, n, dest);
+}
+
+// Dot products of one input row with four rows of half values,
+// widened in registers, so the weights are read only once.
+template <half_precision Precision>
+void dot_half_x4(const float_type* a, const std::uint16_t* const* w,
+    std::size_t n, float_type* dest)
+{
+    std::size_t i = 0;
+    float_type sums[4] = {0, 0, 0, 0};
+#if defined(__AVX2__)
+    if (std::is_same<float_type, float>::value && can_widen_half_8<Precision>())
+    {
+        const float* a_float = reinterpret_cast<const float*>(a);
+        // Two accumulators per row, to hide the latency of the additions.
+        __m256 acc[8];
+        for (std::size_t k = 0; k < 8; ++k)
+        {
+            acc[k] = _mm256_setzero_ps();
+        }
+        for (; i + 16 <= n; i += 16)
+        {
+            const __m256 a_i = _mm256_loadu_ps(a_float + i);
+            const __m256 a_i_8 = _mm256_loadu_ps(a_float + i + 8);
+            for (std::size_t k = 0; k < 4; ++k)
+            {
+                acc[k] = multiply_add_float(a_i,
+                    widen_half_8<Precision>(w[k] + i), acc[k]);
+                acc[k + 4] = multiply_add_float(a_i_8,
+                    widen_half_8<Precision>(w[k] + i + 8), acc[k + 4]);
+            }
+        }
+        for (; i + 8 <= n; i += 8)
+        {
+            const __m256 a_i = _mm256_loadu_ps(a_float + i);
+            for (std::size_t k = 0; k < 4; ++k)
+            {
+                acc[k] = multiply_add_float(a_i,
+                    widen_half_8<Precision>(w[k] + i), acc[k]);
+            }
+        }
+        for (std::size_t k = 0; k < 4; ++k)
+        {
+            sums[k] = static_cast<float_type>(horizontal_sum_float(
+                _mm256_add_ps(acc[k], acc[k + 4])));
+        }
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        for (std::size_t k = 0; k < 4; ++k)
+        {
+            sums[k] += a[i] *
+                static_cast<float_type>(half_to_float(w[k][i], Precision));
+        }
+    }
+    std::copy_n(sums, 4, dest);
+}
+
+// Stores W transposed, i.e., one row per output channel, as half values,
+// which are widened while multiplying (see apply_compact_weight_rows).
+class half_weight_matrix : public weight_matrix
+{
+public:
+    // The values are given as (n_out, n_in) row-major.
+    half_weight_matrix(half_vec&& values, half_precision precision,
+        const float_vec& bias) :
+        weight_matrix(values.size() / bias.size(), bias.size()),
+        values_(std::move(values)),
+        precision_(precision),
+        bias_(bias)
+    {
+        assertion(values_.size() % bias.size() == 0, "invalid weight count");
+    }
+    void apply_columns(const float_type* in, std::size_t rows,
+        std::size_t first_col, std::size_t n_cols,
+        float_type* out) const override
+    {
+        check_columns(first_col, n_cols);
+        if (precision_ == half_precision::float16)
+            apply_columns_widened<half_precision::float16>(in, rows, first_col, n_cols, out);
+        else
+            apply_columns_widened<half_precision::bfloat16>(in, rows, first_col, n_cols, out);
+    }
+    half_precision precision() const
+    {
+        return precision_;
+    }
+private:
+    const std::uint16_t* row(std::size_t j) const
+    {
+        return values_.data() + j * n_in();
+    }
+    template <half_precision Precision>
+    void apply_columns_widened(const float_type* in, std::size_t rows,
+        std::size_t first_col, std::size_t n_cols, float_type* out) const
+    {
+        apply_compact_weight_rows(n_in(), bias_, in, rows, first_col, n_cols, out,
+            [this](std::size_t j, std::size_t count, float_type* dest)
+            {
+                widen_half<Precision>(row(j), count * n_in(), dest);
+            },
+            [this](const float_type* in_row, const std::size_t* js, float_type* dest)
+            {
+                const std::uint16_t* w[4] = {
+                    row(js[0]), row(js[1]), row(js[2]), row(js[3])};
+                dot_half_x4<Precision>(in_row, w, n_in(), dest);
+            });
+    }
+    half_vec values_;
+    half_precision precision_;
+    float_vec bias_;
+};
+
+// Converts float weights, given as (n_out, n_in) row-major,
+// e.g., to compare the accuracy of a model with and without it.
+inline weight_matrix_ptr convert_weight_matrix_half(
+    const float_vec& values, const float_vec& bias, half_precision precision)
+{
+    return std::make_shared<half_weight_matrix>(
+        floats_to_half(values.data(), values.size(), precision),
+        precision, bias);
+}
+
+} } // namespace fdeep, namespace internal
@@ -25,7 +25,13 @@
 #pragma GCC diagnostic pop
 #endif
 
+#include "fdeep/binary_model.hpp"
 #include "fdeep/common.hpp"
+#include "fdeep/half_precision.hpp"
+#include "fdeep/low_rank.hpp"
+#include "fdeep/json_model_parser.hpp"
+#include "fdeep/palettization.hpp"
+#include "fdeep/quantization.hpp"
 #include "fdeep/layers/add_layer.hpp"
 #include "fdeep/layers/average_layer.hpp"
 #include "fdeep/layers/average_pooling_2d_layer.hpp"
@@ -45,6 +51,7 @@
 #include "fdeep/layers/hard_sigmoid_layer.hpp"
 #include "fdeep/layers/input_layer.hpp"
 #include "fdeep/layers/layer.hpp"
+#include "fdeep/layers/lazy_layer.hpp"
 #include "fdeep/layers/leaky_relu_layer.hpp"
 #include "fdeep/layers/embedding_layer.hpp"
 #include "fdeep/layers/lstm_layer.hpp"
@@ -73,15 +80,23 @@
 #include "fdeep/tensor_shape.hpp"
 #include "fdeep/tensor_shape_variable.hpp"
 #include "fdeep/tensor.hpp"
+#include "fdeep/weights_storage.hpp"
 
 #include <fplus/fplus.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <future>
 #include <iostream>
 #include <limits>
 #include <memory>
 #include <string>
 #include <map>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -242,37 +257,149 @@ inline int create_int(const nlohmann::json& int_data)
     return val;
 }
 
-inline float_vec decode_floats(const nlohmann::json& data)
+inline float_vec decode_floats(const nlohmann::json& data,
+    const blob_table& blobs)
 {
-    assertion(data.is_array() || data.is_string(),
+    assertion(data.is_array() || data.is_string() || is_blob_reference(data),
         "invalid float array format");
 
+    if (is_blob_reference(data))
+    {
+        return decode_float_blob(blobs.get_floats(data));
+    }
+
     if (data.is_array() && !data.empty() && data[0].is_number())
     {
         const float_vec result = data;
         return result;
     }
 
-    assertion(std::numeric_limits<float>::is_iec559,
-        "The floating-point format of your system is not supported.");
+    return decode_base64_floats(get_base64_chunks(data));
+}
 
-    const auto res = Base64_decode(json_data_strs_char_prodiver(data, '='));
-    float_vec out;
-    assertion(res.size() % 4 == 0, "invalid float vector data");
-    out.reserve(res.size() / 4);
-    for (std::size_t i = 0; i < res.size(); i+=4)
+// Like decode_floats, but float blobs in a memory-mapped binary model,
+// which is kept alive by the model, are used in place instead of copied,
+// and so are the values already decoded by the json_model_parser.
+inline weights_storage decode_weights(const nlohmann::json& data,
+    const blob_table& blobs)
+{
+    if (is_blob_reference(data))
     {
-        float_type val = static_cast<float_type>(
-            *(reinterpret_cast<const float*>(&(res[i]))));
-        out.push_back(val);
+        const model_blob& blob = blobs.get_floats(data);
+        if (blob.decoded_)
+        {
+            return weights_storage(blob.decoded_);
+        }
+        if (std::is_same<float_type, float>::value && blob.shared_)
+        {
+            return weights_storage(
+                reinterpret_cast<const float_type*>(float_blob_data(blob)),
+                float_blob_count(blob));
+        }
     }
-    return out;
+    return weights_storage(decode_floats(data, blobs));
+}
+
+// Arrays of other types than float, e.g., quantized weights,
+// are stored as {"dtype": type, "bytes": base64 text},
+// or, in a binary model, with the bytes in a blob.
+template <typename T>
+std::vector<T> decode_typed_array(const nlohmann::json& data,
+    const std::string& dtype, const blob_table& blobs)
+{
+    assertion(data.is_object() && json_obj_has_member(data, "dtype") &&
+        data["dtype"] == dtype && json_obj_has_member(data, "bytes"),
+        "expected array of type " + dtype);
+    const nlohmann::json& bytes = data["bytes"];
+    std::vector<T> result;
+    if (is_blob_reference(bytes))
+    {
+        const model_blob& blob = blobs.get_bytes(bytes);
+        assertion(blob.size_ % sizeof(T) == 0, "invalid " + dtype + " array");
+        result.resize(blob.size_ / sizeof(T));
+        if (blob.size_ > 0)
+        {
+            std::memcpy(result.data(), blob.data_, blob.size_);
+        }
+        return result;
+    }
+    const base64_chunks chunks = get_base64_chunks(bytes);
+    const std::size_t size = base64_decoded_size(chunks);
+    assertion(size % sizeof(T) == 0, "invalid " + dtype + " array");
+    result.resize(size / sizeof(T));
+    if (size > 0)
+    {
+        decode_base64_chunks(chunks,
+            reinterpret_cast<std::uint8_t*>(result.data()));
+    }
+    return result;
+}
+
+// Weights quantized by convert_model.py --quantize-int8,
+// given as (n_out, n_in) values, with one scale per output channel.
+inline weight_matrix_ptr create_int8_weight_matrix(
+    const nlohmann::json& weights, const nlohmann::json& scales,
+    const weights_storage& bias, const blob_table& blobs)
+{
+    return std::make_shared<int8_weight_matrix>(
+        decode_typed_array<std::int8_t>(weights, "int8", blobs),
+        decode_floats(scales, blobs), bias.to_float_vec());
 }
 
-inline tensor create_tensor(const nlohmann::json& data)
+// Weights stored as 16-bit floats by convert_model.py --float16/--bfloat16,
+// given as (n_out, n_in) values.
+inline half_vec decode_half_array(const nlohmann::json& data,
+    half_precision& precision, const blob_table& blobs)
+{
+    assertion(data.is_object() && json_obj_has_member(data, "dtype"),
+        "invalid half precision values");
+    const std::string dtype = data["dtype"];
+    precision = create_half_precision(dtype);
+    return decode_typed_array<std::uint16_t>(data, dtype, blobs);
+}
+
+// Weights palettized by convert_model.py --palettize-4bit,
+// given as (n_out, n_in) packed indices into the palette.
+inline weight_matrix_ptr create_palette_weight_matrix(
+    const nlohmann::json& indices, const nlohmann::json& palette,
+    const weights_storage& bias, const blob_table& blobs)
+{
+    assertion(indices.is_object() && json_obj_has_member(indices, "shape") &&
+        indices["shape"].is_array() && indices["shape"].size() == 2,
+        "invalid palette indices");
+    const std::size_t n_out = indices["shape"][0];
+    const std::size_t n_in = indices["shape"][1];
+    assertion(n_out == bias.size(), "invalid number of palette indices");
+    return std::make_shared<palette_weight_matrix>(
+        decode_typed_array<std::uint8_t>(indices, "uint4", blobs), n_in,
+        decode_floats(palette, blobs), bias.to_float_vec());
+}
+
+// Weights factorized by convert_model.py --low-rank,
+// given as U (n_in, rank) and V (rank, n_out).
+inline weight_matrix_ptr create_low_rank_weight_matrix(
+    const nlohmann::json& u, const nlohmann::json& v,
+    const weights_storage& bias, const blob_table& blobs)
+{
+    return std::make_shared<low_rank_weight_matrix>(
+        decode_weights(u, blobs), decode_weights(v, blobs), bias);
+}
+
+inline weight_matrix_ptr create_half_weight_matrix(
+    const nlohmann::json& weights, const weights_storage& bias,
+    const blob_table& blobs)
+{
+    half_precision precision = half_precision::float16;
+    half_vec values = decode_half_array(weights, precision, blobs);
+    return std::make_shared<half_weight_matrix>(
+        std::move(values), precision, bias.to_float_vec());
+}
+
+inline tensor create_tensor(const nlohmann::json& data,
+    const blob_table& blobs)
 {
     const tensor_shape shape = create_tensor_shape(data["shape"]);
-    return tensor(shape, decode_floats(data["values"]));
+    return tensor(shape, decode_floats(data["values"], blobs));
 }
 
 template <typename T, typename F>
@@ -284,6 +411,40 @@ std::vector<T> create_vector(F f, const nlohmann::json& data)
         return fplus::singleton_seq(f(data));
 }
 
+// Like create_vector, but distributes the elements to up to
+// std::thread::hardware_concurrency() threads.
+// Each thread takes the next remaining element when done with one,
+// so expensive elements do not hold up the others.
+// The results keep the order of the elements.
+template <typename T, typename F>
+std::vector<T> create_vector_parallelly(F f, const nlohmann::json& data)
+{
+    assertion(data.is_array(), "invalid format for parallel creation");
+    const std::size_t n = data.size();
+    std::vector<T> result(n);
+    std::atomic<std::size_t> next(0);
+    const auto work = [&]()
+    {
+        for (std::size_t i = next++; i < n; i = next++)
+        {
+            result[i] = f(data[i]);
+        }
+    };
+    const std::size_t n_threads = std::min<std::size_t>(n,
+        std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::future<void>> jobs;
+    for (std::size_t t = 1; t < n_threads; ++t)
+    {
+        jobs.push_back(std::async(std::launch::async, work));
+    }
+    work();
+    for (auto& job : jobs)
+    {
+        job.get();
+    }
+    return result;
+}
+
 inline std::vector<tensor_shape_variable> create_tensor_shapes_variable(const nlohmann::json& data)
 {
     return create_vector<tensor_shape_variable>(create_tensor_shape_variable, data);
@@ -298,8 +459,34 @@ inline node_connection create_node_connection(const nlohmann::json& data)
     return node_connection(layer_id, node_idx, tensor_idx);
 }
 
-using get_param_f =
-    std::function<nlohmann::json(const std::string&, const std::string&)>;
+// Looks up the trainable parameters of a layer
+// by the names of the layer and the parameter.
+// Their arrays can refer to the blob table of the model,
+// so they are decoded with it, e.g.:
+//     decode_floats(get_param(name, "bias"), get_param.blobs())
+class get_param_f
+{
+public:
+    typedef std::function<nlohmann::json(
+        const std::string&, const std::string&)> lookup_f;
+    get_param_f(const lookup_f& lookup,
+        const std::shared_ptr<const blob_table>& blobs) :
+        lookup_(lookup), blobs_(blobs)
+    {
+    }
+    nlohmann::json operator()(const std::string& layer_name,
+        const std::string& param_name) const
+    {
+        return lookup_(layer_name, param_name);
+    }
+    const blob_table& blobs() const
+    {
+        return *blobs_;
+    }
+private:
+    lookup_f lookup_;
+    std::shared_ptr<const blob_table> blobs_;
+};
 
 using layer_creators =
     std::map<
@@ -322,9 +509,15 @@ layer_ptr create_layer(const get_param_f&,
     const nlohmann::json&,
     const layer_creators& custom_layer_creators);
 
+// The layers are independent of each other, so they can be created
+// (i.e., their weights decoded and transformed) in parallel.
+// Only the layers of the outermost model are, so nested models
+// do not start threads of their own on top.
+// Custom layer creators are not required to be thread-safe, though.
 inline layer_ptr create_model_layer(const get_param_f& get_param,
     const nlohmann::json& data,
-    const std::string& name, const layer_creators& custom_layer_creators)
+    const std::string& name, const layer_creators& custom_layer_creators,
+    bool create_layers_parallelly)
 {
     assertion(data["config"]["layers"].is_array(), "missing layers array");
 
@@ -332,8 +525,12 @@ inline layer_ptr create_model_layer(const get_param_f& get_param,
     {
         return create_layer(get_param, json, custom_layer_creators);
     };
-    const auto layers = create_vector<layer_ptr>(make_layer,
-        data["config"]["layers"]);
+    const auto layers =
+        create_layers_parallelly && custom_layer_creators.empty()
+        ? create_vector_parallelly<layer_ptr>(make_layer,
+            data["config"]["layers"])
+        : create_vector<layer_ptr>(make_layer,
+            data["config"]["layers"]);
 
     assertion(data["config"]["input_layers"].is_array(), "no input layers");
 
@@ -346,6 +543,14 @@ inline layer_ptr create_model_layer(const get_param_f& get_param,
     return std::make_shared<model_layer>(name, layers, inputs, outputs);
 }
 
+inline layer_ptr create_nested_model_layer(const get_param_f& get_param,
+    const nlohmann::json& data,
+    const std::string& name, const layer_creators& custom_layer_creators)
+{
+    return create_model_layer(get_param, data, name, custom_layer_creators,
+        false);
+}
+
 inline void fill_with_zeros(float_vec& xs)
 {
     std::fill(std::begin(xs), std::end(xs), static_cast<float_type>(0));
@@ -361,6 +566,40 @@ inline padding create_padding(const std::string& padding_str)
     }, padding_str));
 }
 
+// The weights of a dense layer or convolution,
+// if they are not stored as one matrix of float values (see convert_model.py),
+// otherwise nullptr.
+inline weight_matrix_ptr create_compact_weight_matrix(
+    const get_param_f& get_param, const std::string& name,
+    const weights_storage& bias)
+{
+    const nlohmann::json weights_int8 = get_param(name, "weights_int8");
+    if (!weights_int8.is_null())
+    {
+        return create_int8_weight_matrix(weights_int8,
+            get_param(name, "weights_scales"), bias, get_param.blobs());
+    }
+    const nlohmann::json weights_palette_indices =
+        get_param(name, "weights_palette_indices");
+    if (!weights_palette_indices.is_null())
+    {
+        return create_palette_weight_matrix(weights_palette_indices,
+            get_param(name, "weights_palette"), bias, get_param.blobs());
+    }
+    const nlohmann::json weights_half = get_param(name, "weights_half");
+    if (!weights_half.is_null())
+    {
+        return create_half_weight_matrix(weights_half, bias, get_param.blobs());
+    }
+    const nlohmann::json weights_low_rank_u = get_param(name, "weights_low_rank_u");
+    if (!weights_low_rank_u.is_null())
+    {
+        return create_low_rank_weight_matrix(weights_low_rank_u,
+            get_param(name, "weights_low_rank_v"), bias, get_param.blobs());
+    }
+    return nullptr;
+}
+
 inline layer_ptr create_conv_2d_layer(const get_param_f& get_param,
     const nlohmann::json& data,
     const std::string& name)
@@ -372,14 +611,28 @@ inline layer_ptr create_conv_2d_layer(const get_param_f& get_param,
     const shape2 dilation_rate = create_shape2(data["config"]["dilation_rate"]);
 
     const auto filter_count = create_size_t(data["config"]["filters"]);
-    float_vec bias(filter_count, 0);
     const bool use_bias = data["config"]["use_bias"];
-    if (use_bias)
-        bias = decode_floats(get_param(name, "bias"));
+    const weights_storage bias = use_bias
+        ? decode_weights(get_param(name, "bias"), get_param.blobs())
+        : weights_storage(float_vec(filter_count, 0));
     assertion(bias.size() == filter_count, "size of bias does not match");
 
-    const float_vec weights = decode_floats(get_param(name, "weights"));
     const shape2 kernel_size = create_shape2(data["config"]["kernel_size"]);
+
+    const auto matrix = create_compact_weight_matrix(get_param, name, bias);
+    if (matrix)
+    {
+        assertion(dilation_rate.height_ == 1 && dilation_rate.width_ == 1,
+            "convolutions with compact weights can not be dilated");
+        assertion(matrix->n_in() % kernel_size.area() == 0,
+            "invalid number of weights");
+        const tensor_shape filter_shape(kernel_size.height_,
+            kernel_size.width_, matrix->n_in() / kernel_size.area());
+        return std::make_shared<conv_2d_layer>(name,
+            filter_shape, filter_count, strides, pad_type, matrix);
+    }
+
+    const weights_storage weights = decode_weights(get_param(name, "weights"), get_param.blobs());
     assertion(weights.size() % kernel_size.area() == 0,
         "invalid number of weights");
     const std::size_t filter_depths =
@@ -406,13 +659,13 @@ inline layer_ptr create_separable_conv_2D_layer(const get_param_f& get_param,
     float_vec bias(filter_count, 0);
     const bool use_bias = data["config"]["use_bias"];
     if (use_bias)
-        bias = decode_floats(get_param(name, "bias"));
+        bias = decode_floats(get_param(name, "bias"), get_param.blobs());
     assertion(bias.size() == filter_count, "size of bias does not match");
 
     const float_vec slice_weights = decode_floats(
-        get_param(name, "slice_weights"));
+        get_param(name, "slice_weights"), get_param.blobs());
     const float_vec stack_weights = decode_floats(
-        get_param(name, "stack_weights"));
+        get_param(name, "stack_weights"), get_param.blobs());
     const shape2 kernel_size = create_shape2(data["config"]["kernel_size"]);
     assertion(slice_weights.size() % kernel_size.area() == 0,
         "invalid number of weights");
@@ -440,7 +693,7 @@ inline layer_ptr create_depthwise_conv_2D_layer(const get_param_f& get_param,
     const shape2 dilation_rate = create_shape2(data["config"]["dilation_rate"]);
 
     const float_vec slice_weights = decode_floats(
-        get_param(name, "slice_weights"));
+        get_param(name, "slice_weights"), get_param.blobs());
     const shape2 kernel_size = create_shape2(data["config"]["kernel_size"]);
     assertion(slice_weights.size() % kernel_size.area() == 0,
         "invalid number of weights");
@@ -450,7 +703,7 @@ inline layer_ptr create_depthwise_conv_2D_layer(const get_param_f& get_param,
     float_vec bias(filter_count, 0);
     const bool use_bias = data["config"]["use_bias"];
     if (use_bias)
-        bias = decode_floats(get_param(name, "bias"));
+        bias = decode_floats(get_param(name, "bias"), get_param.blobs());
     assertion(bias.size() == filter_count, "size of bias does not match");
     return std::make_shared<depthwise_conv_2d_layer>(name, input_depth,
         filter_shape, filter_count, strides, pad_type,
@@ -469,9 +722,9 @@ inline layer_ptr create_input_layer(
 inline layer_ptr create_batch_normalization_layer(const get_param_f& get_param,
     const nlohmann::json& data, const std::string& name)
 {
-    const float_vec moving_mean = decode_floats(get_param(name, "moving_mean"));
+    const float_vec moving_mean = decode_floats(get_param(name, "moving_mean"), get_param.blobs());
     const float_vec moving_variance =
-        decode_floats(get_param(name, "moving_variance"));
+        decode_floats(get_param(name, "moving_variance"), get_param.blobs());
     const bool center = data["config"]["center"];
     const bool scale = data["config"]["scale"];
     const auto axis_vec = create_vector<int>(create_int, data["config"]["axis"]);
@@ -480,8 +733,8 @@ inline layer_ptr create_batch_normalization_layer(const get_param_f& get_param,
     const float_type epsilon = data["config"]["epsilon"];
     float_vec gamma;
     float_vec beta;
-    if (scale) gamma = decode_floats(get_param(name, "gamma"));
-    if (center) beta = decode_floats(get_param(name, "beta"));
+    if (scale) gamma = decode_floats(get_param(name, "gamma"), get_param.blobs());
+    if (center) beta = decode_floats(get_param(name, "beta"), get_param.blobs());
     return std::make_shared<batch_normalization_layer>(
         name, axis, moving_mean, moving_variance, beta, gamma, epsilon);
 }
@@ -581,15 +834,20 @@ inline layer_ptr create_upsampling_2d_layer(
 inline layer_ptr create_dense_layer(const get_param_f& get_param,
     const nlohmann::json& data, const std::string& name)
 {
-    const float_vec weights = decode_floats(get_param(name, "weights"));
-
     std::size_t units = data["config"]["units"];
-    float_vec bias(units, 0);
     const bool use_bias = data["config"]["use_bias"];
-    if (use_bias)
-        bias = decode_floats(get_param(name, "bias"));
+    const weights_storage bias = use_bias
+        ? decode_weights(get_param(name, "bias"), get_param.blobs())
+        : weights_storage(float_vec(units, 0));
     assertion(bias.size() == units, "size of bias does not match");
 
+    const auto matrix = create_compact_weight_matrix(get_param, name, bias);
+    if (matrix)
+    {
+        return std::make_shared<dense_layer>(name, units, matrix);
+    }
+
+    const weights_storage weights = decode_weights(get_param(name, "weights"), get_param.blobs());
     return std::make_shared<dense_layer>(
         name, units, weights, bias);
 }
@@ -811,7 +1069,7 @@ inline layer_ptr create_prelu_layer(
         shared_axes = create_vector<std::size_t>(create_size_t,
             data["config"]["shared_axes"]);
     }
-    const float_vec alpha = decode_floats(get_param(name, "alpha"));
+    const float_vec alpha = decode_floats(get_param(name, "alpha"), get_param.blobs());
     return std::make_shared<prelu_layer>(name, alpha, shared_axes);
 }
 
@@ -908,11 +1166,58 @@ inline layer_ptr create_embedding_layer(const get_param_f &get_param,
 {
     const std::size_t input_dim = data["config"]["input_dim"];
     const std::size_t output_dim = data["config"]["output_dim"];
-    const float_vec weights = decode_floats(get_param(name, "weights"));
+    const nlohmann::json weights_half = get_param(name, "weights_half");
+    if (!weights_half.is_null())
+    {
+        half_precision precision = half_precision::float16;
+        half_vec values = decode_half_array(weights_half, precision,
+            get_param.blobs());
+        return std::make_shared<embedding_layer>(name, input_dim, output_dim,
+            std::move(values), precision);
+    }
+    const float_vec weights = decode_floats(get_param(name, "weights"), get_param.blobs());
 
     return std::make_shared<embedding_layer>(name, input_dim, output_dim, weights);
 }
 
+// The kernel and recurrent kernel of a recurrent layer (direction),
+// if they are stored as int8 or half values, i.e., as (n_out, n_in),
+// otherwise null pointers.
+// With int8 values, the inputs and the state are quantized
+// in each time step (see int8_weight_matrix).
+inline recurrent_weights create_compact_recurrent_weights(
+    const get_param_f& get_param, const std::string& name,
+    const std::string& prefix, std::size_t n_cols, bool use_bias,
+    const weights_storage& bias)
+{
+    const nlohmann::json weights_int8 =
+        get_param(name, prefix + "weights_int8");
+    const nlohmann::json weights_half =
+        get_param(name, prefix + "weights_half");
+    if (weights_int8.is_null() && weights_half.is_null())
+    {
+        return {nullptr, nullptr};
+    }
+    const auto biases = split_recurrent_bias(n_cols, use_bias, bias);
+    if (!weights_int8.is_null())
+    {
+        return {
+            create_int8_weight_matrix(weights_int8,
+                get_param(name, prefix + "weights_scales"), biases.first,
+                get_param.blobs()),
+            create_int8_weight_matrix(
+                get_param(name, prefix + "recurrent_weights_int8"),
+                get_param(name, prefix + "recurrent_weights_scales"),
+                biases.second, get_param.blobs())};
+    }
+    return {
+        create_half_weight_matrix(weights_half, biases.first,
+            get_param.blobs()),
+        create_half_weight_matrix(
+            get_param(name, prefix + "recurrent_weights_half"), biases.second,
+            get_param.blobs())};
+}
+
 inline layer_ptr create_lstm_layer(const get_param_f &get_param,
                                    const nlohmann::json &data,
                                    const std::string &name)
@@ -928,16 +1233,27 @@ inline layer_ptr create_lstm_layer(const get_param_f &get_param,
     );
     const bool use_bias = json_object_get(config, "use_bias", true);
 
-    float_vec bias;
-    if (use_bias)
-        bias = decode_floats(get_param(name, "bias"));
+    const weights_storage bias = use_bias
+        ? decode_weights(get_param(name, "bias"), get_param.blobs())
+        : weights_storage(float_vec());
 
-    const float_vec weights = decode_floats(get_param(name, "weights"));
-    const float_vec recurrent_weights = decode_floats(get_param(name, "recurrent_weights"));
     const bool return_sequences = json_object_get(config, "return_sequences", false);
     const bool return_state = json_object_get(config, "return_state", false);
     const bool stateful = json_object_get(config, "stateful", false);
 
+    const auto compact_weights = create_compact_recurrent_weights(
+        get_param, name, "", units * 4, use_bias, bias);
+    if (compact_weights.W_)
+    {
+        return std::make_shared<lstm_layer>(name, units, unit_activation,
+                                            recurrent_activation,
+                                            return_sequences, return_state, stateful,
+                                            compact_weights);
+    }
+
+    const weights_storage weights = decode_weights(get_param(name, "weights"), get_param.blobs());
+    const weights_storage recurrent_weights = decode_weights(get_param(name, "recurrent_weights"), get_param.blobs());
+
     return std::make_shared<lstm_layer>(name, units, unit_activation,
                                         recurrent_activation, use_bias,
                                         return_sequences, return_state, stateful,
@@ -963,18 +1279,28 @@ inline layer_ptr create_gru_layer(const get_param_f &get_param,
     const bool return_state = json_object_get(config, "return_state", false);
     const bool stateful = json_object_get(config, "stateful", false);
 
-    float_vec bias;
-    if (use_bias)
-        bias = decode_floats(get_param(name, "bias"));
-
-    const float_vec weights = decode_floats(get_param(name, "weights"));
-    const float_vec recurrent_weights = decode_floats(get_param(name, "recurrent_weights"));
+    const weights_storage bias = use_bias
+        ? decode_weights(get_param(name, "bias"), get_param.blobs())
+        : weights_storage(float_vec());
 
     bool reset_after = json_object_get(config,
         "reset_after",
         data["class_name"] == "CuDNNGRU"
     );
 
+    const auto compact_weights = create_compact_recurrent_weights(
+        get_param, name, "", units * 3, use_bias, bias);
+    if (compact_weights.W_)
+    {
+        return std::make_shared<gru_layer>(name, units, unit_activation,
+                                           recurrent_activation, reset_after,
+                                           return_sequences, return_state, stateful,
+                                           compact_weights);
+    }
+
+    const weights_storage weights = decode_weights(get_param(name, "weights"), get_param.blobs());
+    const weights_storage recurrent_weights = decode_weights(get_param(name, "recurrent_weights"), get_param.blobs());
+
     return std::make_shared<gru_layer>(name, units, unit_activation,
                                        recurrent_activation, use_bias, reset_after,
                                        return_sequences, return_state, stateful,
@@ -999,20 +1325,12 @@ inline layer_ptr create_bidirectional_layer(const get_param_f& get_param,
     );
     const bool use_bias = json_object_get(layer_config, "use_bias", true);
 
-    float_vec forward_bias;
-    float_vec backward_bias;
-
-    if (use_bias)
-    {
-        forward_bias = decode_floats(get_param(name, "forward_bias"));
-        backward_bias = decode_floats(get_param(name, "backward_bias"));
-    }
-
-    const float_vec forward_weights = decode_floats(get_param(name, "forward_weights"));
-    const float_vec backward_weights = decode_floats(get_param(name, "backward_weights"));
-
-    const float_vec forward_recurrent_weights = decode_floats(get_param(name, "forward_recurrent_weights"));
-    const float_vec backward_recurrent_weights = decode_floats(get_param(name, "backward_recurrent_weights"));
+    const weights_storage forward_bias = use_bias
+        ? decode_weights(get_param(name, "forward_bias"), get_param.blobs())
+        : weights_storage(float_vec());
+    const weights_storage backward_bias = use_bias
+        ? decode_weights(get_param(name, "backward_bias"), get_param.blobs())
+        : weights_storage(float_vec());
 
     const bool reset_after = json_object_get(layer_config,
         "reset_after",
@@ -1021,6 +1339,28 @@ inline layer_ptr create_bidirectional_layer(const get_param_f& get_param,
     const bool return_sequences = json_object_get(layer_config, "return_sequences", false);
     const bool stateful = json_object_get(layer_config, "stateful", false);
 
+    const std::size_t n_cols =
+        units * bidirectional_layer::wrapped_layer_n_gates(wrapped_layer_type);
+    const auto compact_forward_weights = create_compact_recurrent_weights(
+        get_param, name, "forward_", n_cols, use_bias, forward_bias);
+    if (compact_forward_weights.W_)
+    {
+        const auto compact_backward_weights = create_compact_recurrent_weights(
+            get_param, name, "backward_", n_cols, use_bias, backward_bias);
+        assertion(compact_backward_weights.W_ != nullptr,
+            "missing backward weights");
+        return std::make_shared<bidirectional_layer>(name, merge_mode, units, unit_activation,
+                                                     recurrent_activation, wrapped_layer_type,
+                                                     reset_after, return_sequences, stateful,
+                                                     compact_forward_weights, compact_backward_weights);
+    }
+
+    const weights_storage forward_weights = decode_weights(get_param(name, "forward_weights"), get_param.blobs());
+    const weights_storage backward_weights = decode_weights(get_param(name, "backward_weights"), get_param.blobs());
+
+    const weights_storage forward_recurrent_weights = decode_weights(get_param(name, "forward_recurrent_weights"), get_param.blobs());
+    const weights_storage backward_recurrent_weights = decode_weights(get_param(name, "backward_recurrent_weights"), get_param.blobs());
+
     return std::make_shared<bidirectional_layer>(name, merge_mode, units, unit_activation,
                                                  recurrent_activation, wrapped_layer_type,
                                                  use_bias, reset_after, return_sequences, stateful,
@@ -1037,75 +1377,138 @@ inline layer_ptr create_time_distributed_layer(const get_param_f& get_param,
     nlohmann::json data_inner_layer = data["config"]["layer"];
     data_inner_layer["name"] = data["name"];
     data_inner_layer["inbound_nodes"] = data["inbound_nodes"];
-    const std::size_t td_input_len = std::size_t(decode_floats(get_param(name, "td_input_len")).front());
-    const std::size_t td_output_len = std::size_t(decode_floats(get_param(name, "td_output_len")).front());
+    const std::size_t td_input_len = std::size_t(decode_floats(get_param(name, "td_input_len"), get_param.blobs()).front());
+    const std::size_t td_output_len = std::size_t(decode_floats(get_param(name, "td_output_len"), get_param.blobs()).front());
 
     layer_ptr inner_layer = create_layer(get_param, data_inner_layer, custom_layer_creators);
 
     return std::make_shared<time_distributed_layer>(name, inner_layer, td_input_len, td_output_len);
 }
 
+inline layer_creators default_layer_creators()
+{
+    return {
+        {"Conv1D", create_conv_2d_layer},
+        {"Conv2D", create_conv_2d_layer},
+        {"SeparableConv1D", create_separable_conv_2D_layer},
+        {"SeparableConv2D", create_separable_conv_2D_layer},
+        {"DepthwiseConv2D", create_depthwise_conv_2D_layer},
+        {"InputLayer", create_input_layer},
+        {"BatchNormalization", create_batch_normalization_layer},
+        {"Dropout", create_identity_layer},
+        {"AlphaDropout", create_identity_layer},
+        {"GaussianDropout", create_identity_layer},
+        {"GaussianNoise", create_identity_layer},
+        {"SpatialDropout1D", create_identity_layer},
+        {"SpatialDropout2D", create_identity_layer},
+        {"SpatialDropout3D", create_identity_layer},
+        {"LeakyReLU", create_leaky_relu_layer_isolated},
+        {"Permute", create_permute_layer },
+        {"PReLU", create_prelu_layer },
+        {"ELU", create_elu_layer_isolated},
+        {"ReLU", create_relu_layer_isolated},
+        {"MaxPooling1D", create_max_pooling_2d_layer},
+        {"MaxPooling2D", create_max_pooling_2d_layer},
+        {"AveragePooling1D", create_average_pooling_2d_layer},
+        {"AveragePooling2D", create_average_pooling_2d_layer},
+        {"GlobalMaxPooling1D", create_global_max_pooling_1d_layer},
+        {"GlobalMaxPooling2D", create_global_max_pooling_2d_layer},
+        {"GlobalAveragePooling1D", create_global_average_pooling_1d_layer},
+        {"GlobalAveragePooling2D", create_global_average_pooling_2d_layer},
+        {"UpSampling1D", create_upsampling_1d_layer},
+        {"UpSampling2D", create_upsampling_2d_layer},
+        {"Dense", create_dense_layer},
+        {"Add", create_add_layer},
+        {"Maximum", create_maximum_layer},
+        {"Concatenate", create_concatenate_layer},
+        {"Multiply", create_multiply_layer},
+        {"Average", create_average_layer},
+        {"Subtract", create_subtract_layer},
+        {"Flatten", create_flatten_layer},
+        {"ZeroPadding1D", create_zero_padding_2d_layer},
+        {"ZeroPadding2D", create_zero_padding_2d_layer},
+        {"Cropping1D", create_cropping_2d_layer},
+        {"Cropping2D", create_cropping_2d_layer},
+        {"Activation", create_activation_layer},
+        {"Reshape", create_reshape_layer},
+        {"Embedding", create_embedding_layer},
+        {"LSTM", create_lstm_layer},
+        {"CuDNNLSTM", create_lstm_layer},
+        {"GRU", create_gru_layer},
+        {"CuDNNGRU", create_gru_layer},
+        {"Bidirectional", create_bidirectional_layer},
+        {"Softmax", create_softmax_layer},
+    };
+}
+
+inline nlohmann::json get_layer_param(const nlohmann::json& params,
+    const std::string& layer_name, const std::string& param_name)
+{
+    const auto it_layer = params.find(layer_name);
+    if (it_layer == params.end())
+    {
+        return nlohmann::json();
+    }
+    const auto it_param = it_layer->find(param_name);
+    return it_param == it_layer->end() ? nlohmann::json() : *it_param;
+}
+
+inline bool is_stateful_layer_data(const nlohmann::json& data)
+{
+    const auto& config = data["config"];
+    return json_object_get(config, "stateful", false) ||
+        (json_obj_has_member(config, "layer") &&
+            json_object_get(config["layer"]["config"], "stateful", false));
+}
+
+// Creators for lazy loading (see load_model_binary_lazy):
+// The built-in layers with trainable parameters are created lazily,
+// i.e., on first use, from the given parameters,
+// which have to stay valid until then.
+// Custom layers are created right away,
+// because their creators are not required to be thread-safe.
+inline layer_creators lazy_layer_creators(
+    const layer_creators& custom_layer_creators,
+    const std::shared_ptr<const nlohmann::json>& params,
+    const std::shared_ptr<const blob_table>& blobs)
+{
+    layer_creators result = custom_layer_creators;
+    const get_param_f get_lazy_param([params]
+        (const std::string& layer_name, const std::string& param_name)
+        -> nlohmann::json
+    {
+        return get_layer_param(*params, layer_name, param_name);
+    }, blobs);
+    for (const auto& type_and_creator : default_layer_creators())
+    {
+        const auto create = type_and_creator.second;
+        result.emplace(type_and_creator.first, [create, get_lazy_param, params]
+            (const get_param_f& get_param, const nlohmann::json& data,
+                const std::string& name) -> layer_ptr
+        {
+            if (params->find(name) == params->end())
+            {
+                return create(get_param, data, name);
+            }
+            return std::make_shared<lazy_layer>(name,
+                is_stateful_layer_data(data),
+                [create, get_lazy_param, data, name]() -> layer_ptr
+            {
+                return create(get_lazy_param, data, name);
+            });
+        });
+    }
+    return result;
+}
+
 inline layer_ptr create_layer(const get_param_f& get_param,
     const nlohmann::json& data,
     const layer_creators& custom_layer_creators)
 {
     const std::string name = data["name"];
 
-    const layer_creators default_creators = {
-            {"Conv1D", create_conv_2d_layer},
-            {"Conv2D", create_conv_2d_layer},
-            {"SeparableConv1D", create_separable_conv_2D_layer},
-            {"SeparableConv2D", create_separable_conv_2D_layer},
-            {"DepthwiseConv2D", create_depthwise_conv_2D_layer},
-            {"InputLayer", create_input_layer},
-            {"BatchNormalization", create_batch_normalization_layer},
-            {"Dropout", create_identity_layer},
-            {"AlphaDropout", create_identity_layer},
-            {"GaussianDropout", create_identity_layer},
-            {"GaussianNoise", create_identity_layer},
-            {"SpatialDropout1D", create_identity_layer},
-            {"SpatialDropout2D", create_identity_layer},
-            {"SpatialDropout3D", create_identity_layer},
-            {"LeakyReLU", create_leaky_relu_layer_isolated},
-            {"Permute", create_permute_layer },
-            {"PReLU", create_prelu_layer },
-            {"ELU", create_elu_layer_isolated},
-            {"ReLU", create_relu_layer_isolated},
-            {"MaxPooling1D", create_max_pooling_2d_layer},
-            {"MaxPooling2D", create_max_pooling_2d_layer},
-            {"AveragePooling1D", create_average_pooling_2d_layer},
-            {"AveragePooling2D", create_average_pooling_2d_layer},
-            {"GlobalMaxPooling1D", create_global_max_pooling_1d_layer},
-            {"GlobalMaxPooling2D", create_global_max_pooling_2d_layer},
-            {"GlobalAveragePooling1D", create_global_average_pooling_1d_layer},
-            {"GlobalAveragePooling2D", create_global_average_pooling_2d_layer},
-            {"UpSampling1D", create_upsampling_1d_layer},
-            {"UpSampling2D", create_upsampling_2d_layer},
-            {"Dense", create_dense_layer},
-            {"Add", create_add_layer},
-            {"Maximum", create_maximum_layer},
-            {"Concatenate", create_concatenate_layer},
-            {"Multiply", create_multiply_layer},
-            {"Average", create_average_layer},
-            {"Subtract", create_subtract_layer},
-            {"Flatten", create_flatten_layer},
-            {"ZeroPadding1D", create_zero_padding_2d_layer},
-            {"ZeroPadding2D", create_zero_padding_2d_layer},
-            {"Cropping1D", create_cropping_2d_layer},
-            {"Cropping2D", create_cropping_2d_layer},
-            {"Activation", create_activation_layer},
-            {"Reshape", create_reshape_layer},
-            {"Embedding", create_embedding_layer},
-            {"LSTM", create_lstm_layer},
-            {"CuDNNLSTM", create_lstm_layer},
-            {"GRU", create_gru_layer},
-            {"CuDNNGRU", create_gru_layer},
-            {"Bidirectional", create_bidirectional_layer},
-            {"Softmax", create_softmax_layer},
-        };
-
     const wrapper_layer_creators wrapper_creators = {
-            {"Model", create_model_layer},
+            {"Model", create_nested_model_layer},
             {"TimeDistributed", create_time_distributed_layer},
     };
 
@@ -1121,7 +1524,7 @@ inline layer_ptr create_layer(const get_param_f& get_param,
     else
     {
         const layer_creators creators = fplus::map_union(custom_layer_creators,
-            default_creators);
+            default_layer_creators());
 
         auto result = fplus::throw_on_nothing(
             error("unknown layer type: " + type),
@@ -1151,19 +1554,28 @@ struct test_case
 
 using test_cases = std::vector<test_case>;
 
-inline test_case load_test_case(const nlohmann::json& data)
+inline test_case load_test_case(const nlohmann::json& data,
+    const blob_table& blobs)
 {
     assertion(data["inputs"].is_array(), "test needs inputs");
     assertion(data["outputs"].is_array(), "test needs outputs");
+    const auto make_tensor = [&blobs](const nlohmann::json& tensor_data)
+    {
+        return create_tensor(tensor_data, blobs);
+    };
     return {
-        create_vector<tensor>(create_tensor, data["inputs"]),
-        create_vector<tensor>(create_tensor, data["outputs"])
+        create_vector<tensor>(make_tensor, data["inputs"]),
+        create_vector<tensor>(make_tensor, data["outputs"])
     };
 }
 
-inline test_cases load_test_cases(const nlohmann::json& data)
+inline test_cases load_test_cases(const nlohmann::json& data,
+    const blob_table& blobs)
 {
-    return create_vector<test_case>(load_test_case, data);
+    return create_vector<test_case>([&blobs](const nlohmann::json& test_data)
+    {
+        return load_test_case(test_data, blobs);
+    }, data);
 }
 
 inline void check_test_outputs(float_type epsilon,
@@ -1212,4 +1624,44 @@ inline void check_test_outputs(float_type epsilon,
     }
 }
 
+// The deviation of one model output from its target values,
+// accumulated over test cases.
+struct output_errors
+{
+    double max_abs_error_;
+    double abs_error_sum_;
+    std::size_t value_count_;
+    double mean_abs_error() const
+    {
+        return value_count_ == 0 ? 0 :
+            abs_error_sum_ / static_cast<double>(value_count_);
+    }
+};
+
+// Like check_test_outputs, but measures how far the outputs are off
+// instead of failing, e.g., to compare approximations of a model.
+inline void add_output_errors(std::vector<output_errors>& errors,
+    const tensors& outputs, const tensors& targets)
+{
+    assertion(outputs.size() == targets.size(), "invalid output count");
+    errors.resize(outputs.size(), {0, 0, 0});
+    for (std::size_t i = 0; i < outputs.size(); ++i)
+    {
+        assertion(outputs[i].shape() == targets[i].shape(),
+            "Wrong output size. Is " + show_tensor_shape(outputs[i].shape()) +
+            ", should be " + show_tensor_shape(targets[i].shape()) + ".");
+        // Equal shapes have their values in the same order.
+        const float_vec& output = *outputs[i].as_vector();
+        const float_vec& target = *targets[i].as_vector();
+        for (std::size_t j = 0; j < output.size(); ++j)
+        {
+            const double error = std::abs(
+                static_cast<double>(output[j]) - static_cast<double>(target[j]));
+            errors[i].max_abs_error_ = std::max(errors[i].max_abs_error_, error);
+            errors[i].abs_error_sum_ += error;
+        }
+        errors[i].value_count_ += output.size();
+    }
+}
+
 } } // namespace fdeep, namespace internal
@@ -0,0 +1,264 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/base64.hpp"
+#include "fdeep/weights_pool.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace fdeep { namespace internal
+{
+
+// Parses a JSON model in one pass (SAX), without ever holding
+// the whole base64 text of the weights (or test cases) in memory.
+// The text of each float array is decoded as soon as the array is complete,
+// and the array is replaced by a reference to the decoded values
+// in the blob table of the parser.
+// Layers can share these values instead of copying them (see decode_weights),
+// and everything not taken by a layer is freed with the table.
+// If the test cases are not needed, they are skipped (and become null).
+// If a weights pool is given, the weights are deduplicated with it.
+class json_model_parser :
+    public nlohmann::detail::json_sax_dom_parser<nlohmann::json>
+{
+public:
+    typedef nlohmann::detail::json_sax_dom_parser<nlohmann::json> dom_parser;
+    typedef nlohmann::json::string_t string_t;
+    typedef nlohmann::json::number_integer_t number_integer_t;
+    typedef nlohmann::json::number_unsigned_t number_unsigned_t;
+    typedef nlohmann::json::number_float_t number_float_t;
+
+    json_model_parser(nlohmann::json& result, bool keep_tests,
+        weights_pool* pool = nullptr) :
+        dom_parser(result),
+        keep_tests_(keep_tests),
+        pool_(pool),
+        path_(),
+        skip_depth_(0),
+        skip_next_value_(false),
+        pending_array_(false),
+        collecting_(false),
+        chunks_(),
+        blobs_(std::make_shared<blob_table>())
+    {
+    }
+    json_model_parser(const json_model_parser&) = delete;
+    json_model_parser& operator=(const json_model_parser&) = delete;
+
+    void parse(std::istream& stream)
+    {
+        assertion(nlohmann::json::sax_parse(stream, this), "invalid JSON model");
+    }
+
+    // The arrays the parsed JSON data refers to.
+    // The loader can add arrays it computes from them.
+    std::shared_ptr<blob_table> blobs() const
+    {
+        return blobs_;
+    }
+
+    bool null()
+    {
+        return skipping() || (begin_element() && dom_parser::null());
+    }
+    bool boolean(bool val)
+    {
+        return skipping() || (begin_element() && dom_parser::boolean(val));
+    }
+    bool number_integer(number_integer_t val)
+    {
+        return skipping() || (begin_element() && dom_parser::number_integer(val));
+    }
+    bool number_unsigned(number_unsigned_t val)
+    {
+        return skipping() || (begin_element() && dom_parser::number_unsigned(val));
+    }
+    bool number_float(number_float_t val, const string_t& str)
+    {
+        return skipping() || (begin_element() && dom_parser::number_float(val, str));
+    }
+    bool string(string_t& val)
+    {
+        if (skipping())
+        {
+            return true;
+        }
+        if (pending_array_ || collecting_)
+        {
+            pending_array_ = false;
+            collecting_ = true;
+            chunks_.push_back(std::move(val));
+            return true;
+        }
+        if (is_float_array_path())
+        {
+            chunks_.push_back(std::move(val));
+            return emit_decoded_floats();
+        }
+        return dom_parser::string(val);
+    }
+    bool start_object(std::size_t len)
+    {
+        if (skipping_container())
+        {
+            return true;
+        }
+        path_.push_back("");
+        return begin_element() && dom_parser::start_object(len);
+    }
+    bool key(string_t& val)
+    {
+        if (skip_depth_ > 0)
+        {
+            return true;
+        }
+        assertion(val != blob_id_key,
+            std::string("reserved key in model: ") + blob_id_key);
+        path_.back() = val;
+        if (!keep_tests_ && path_.size() == 1 && val == "tests")
+        {
+            skip_next_value_ = true;
+        }
+        return dom_parser::key(val);
+    }
+    bool end_object()
+    {
+        if (skip_depth_ > 0)
+        {
+            return end_skipped_container();
+        }
+        path_.pop_back();
+        return dom_parser::end_object();
+    }
+    bool start_array(std::size_t len)
+    {
+        if (skipping_container())
+        {
+            return true;
+        }
+        // Wait for the first element to tell
+        // an array of base64 chunks from a normal one.
+        const bool float_array = is_float_array_path();
+        path_.push_back("");
+        if (float_array)
+        {
+            pending_array_ = true;
+            return true;
+        }
+        return begin_element() && dom_parser::start_array(len);
+    }
+    bool end_array()
+    {
+        if (skip_depth_ > 0)
+        {
+            return end_skipped_container();
+        }
+        path_.pop_back();
+        if (collecting_)
+        {
+            collecting_ = false;
+            return emit_decoded_floats();
+        }
+        return begin_element() && dom_parser::end_array();
+    }
+
+private:
+    // Float arrays are the values of trainable_params.<layer>.<param>
+    // and tests[i].inputs/outputs[j].values.
+    bool is_float_array_path() const
+    {
+        return (path_.size() == 3 && path_.front() == "trainable_params") ||
+            (path_.size() >= 2 && path_.front() == "tests" &&
+                path_.back() == "values");
+    }
+    // Elements of a pending float array, which are no strings,
+    // turn it into a normal array.
+    bool begin_element()
+    {
+        assertion(!collecting_, "invalid float array format");
+        if (pending_array_)
+        {
+            pending_array_ = false;
+            return dom_parser::start_array(static_cast<std::size_t>(-1));
+        }
+        return true;
+    }
+    bool skipping()
+    {
+        if (skip_depth_ > 0)
+        {
+            return true;
+        }
+        if (skip_next_value_)
+        {
+            skip_next_value_ = false;
+            dom_parser::null();
+            return true;
+        }
+        return false;
+    }
+    bool skipping_container()
+    {
+        if (skip_depth_ > 0 || skip_next_value_)
+        {
+            skip_next_value_ = false;
+            ++skip_depth_;
+            return true;
+        }
+        return false;
+    }
+    bool end_skipped_container()
+    {
+        --skip_depth_;
+        return skip_depth_ > 0 || dom_parser::null();
+    }
+    bool emit_decoded_floats()
+    {
+        base64_chunks chunks;
+        chunks.reserve(chunks_.size());
+        for (const auto& chunk : chunks_)
+        {
+            chunks.emplace_back(chunk.data(), chunk.size());
+        }
+        auto decoded = std::make_shared<const float_vec>(
+            decode_base64_floats(chunks));
+        chunks_.clear();
+        if (pool_ && path_.front() == "trainable_params")
+        {
+            decoded = pool_->deduplicate(decoded);
+        }
+        const std::size_t id = blobs_->add(decoded_float_blob(decoded));
+        string_t key = blob_id_key;
+        return dom_parser::start_object(1) &&
+            dom_parser::key(key) &&
+            dom_parser::number_unsigned(id) &&
+            dom_parser::end_object();
+    }
+
+    bool keep_tests_;
+    weights_pool* pool_;
+    std::vector<std::string> path_;
+    std::size_t skip_depth_;
+    bool skip_next_value_;
+    bool pending_array_;
+    bool collecting_;
+    std::vector<string_t> chunks_;
+    std::shared_ptr<blob_table> blobs_;
+};
+
+} } // namespace fdeep, namespace internal
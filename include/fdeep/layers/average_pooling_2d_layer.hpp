@@ -59,7 +59,7 @@ FDEEP_FORCE_INLINE tensor average_pool_2d(
             {
                 for (std::size_t x = 0; x < out_width; ++x)
                 {
-                    float_type val = 0;
+                    pooling_accumulator_type val = 0;
                     std::size_t divisor = 0;
                     for (std::size_t yf = 0; yf < pool_height; ++yf)
                     {
@@ -76,7 +76,7 @@ FDEEP_FORCE_INLINE tensor average_pool_2d(
                         }
                     }
 
-                    out.set(tensor_pos(z, y, x), val / static_cast<float_type>(divisor));
+                    out.set(tensor_pos(z, y, x), static_cast<float_type>(val / static_cast<pooling_accumulator_type>(divisor)));
                 }
             }
         }
@@ -96,7 +96,7 @@ FDEEP_FORCE_INLINE tensor average_pool_2d(
             {
                 for (std::size_t z = 0; z < feature_count; ++z)
                 {
-                    float_type val = 0;
+                    pooling_accumulator_type val = 0;
                     std::size_t divisor = 0;
                     for (std::size_t yf = 0; yf < pool_height; ++yf)
                     {
@@ -114,7 +114,7 @@ FDEEP_FORCE_INLINE tensor average_pool_2d(
                         }
                     }
 
-                    out.set_ignore_rank(tensor_pos(y, x, z), val / static_cast<float_type>(divisor));
+                    out.set_ignore_rank(tensor_pos(y, x, z), static_cast<float_type>(val / static_cast<pooling_accumulator_type>(divisor)));
                 }
             }
         }
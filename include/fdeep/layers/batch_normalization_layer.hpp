@@ -68,19 +68,21 @@ protected:
             {
                 for (std::size_t z = 0; z < output.shape().depth_; ++z)
                 {
-                    const float_type denom = std::sqrt(moving_variance_[z] + epsilon_);
+                    typedef batch_normalization_accumulator_type acc_type;
+                    const acc_type denom = std::sqrt(
+                        static_cast<acc_type>(moving_variance_[z]) + epsilon_);
                     for (std::size_t y = 0; y < output.shape().height_; ++y)
                     {
                         for (std::size_t x = 0; x < output.shape().width_; ++x)
                         {
-                            float_type val = input.get_ignore_rank(tensor_pos(dim5, dim4, y, x, z));
+                            acc_type val = input.get_ignore_rank(tensor_pos(dim5, dim4, y, x, z));
                             val -= moving_mean_[z];
                             if (use_gamma)
                                 val *= gamma_[z];
                             val /= denom;
                             if (use_beta)
                                 val += beta_[z];
-                            output.set_ignore_rank(tensor_pos(dim5, dim4, y, x, z), val);
+                            output.set_ignore_rank(tensor_pos(dim5, dim4, y, x, z), static_cast<float_type>(val));
                         }
                     }
                 }
@@ -9,7 +9,9 @@
 #include "fdeep/layers/layer.hpp"
 #include "fdeep/recurrent_ops.hpp"
 
+#include <future>
 #include <string>
+#include <thread>
 #include <functional>
 
 namespace fdeep
@@ -30,12 +32,36 @@ public:
                         const bool reset_after,
                         const bool return_sequences,
                         const bool stateful,
-                        const float_vec& forward_weights,
-                        const float_vec& forward_recurrent_weights,
-                        const float_vec& bias_forward,
-                        const float_vec& backward_weights,
-                        const float_vec& backward_recurrent_weights,
-                        const float_vec& bias_backward
+                        const weights_storage& forward_weights,
+                        const weights_storage& forward_recurrent_weights,
+                        const weights_storage& bias_forward,
+                        const weights_storage& backward_weights,
+                        const weights_storage& backward_recurrent_weights,
+                        const weights_storage& bias_backward
+                        )
+        : bidirectional_layer(name, merge_mode, n_units, activation,
+            recurrent_activation, wrapped_layer_type,
+            reset_after, return_sequences, stateful,
+            create_recurrent_weights(n_units,
+                wrapped_layer_n_gates(wrapped_layer_type), use_bias,
+                forward_weights, forward_recurrent_weights, bias_forward),
+            create_recurrent_weights(n_units,
+                wrapped_layer_n_gates(wrapped_layer_type), use_bias,
+                backward_weights, backward_recurrent_weights, bias_backward))
+        {
+    }
+
+    explicit bidirectional_layer(const std::string& name,
+                        const std::string& merge_mode,
+                        const std::size_t n_units,
+                        const std::string& activation,
+                        const std::string& recurrent_activation,
+                        const std::string& wrapped_layer_type,
+                        const bool reset_after,
+                        const bool return_sequences,
+                        const bool stateful,
+                        const recurrent_weights& forward_weights,
+                        const recurrent_weights& backward_weights
                         )
         : layer(name),
         merge_mode_(merge_mode),
@@ -43,110 +69,92 @@ public:
         activation_(activation),
         recurrent_activation_(recurrent_activation),
         wrapped_layer_type_(wrapped_layer_type),
-        use_bias_(use_bias),
         reset_after_(reset_after),
         return_sequences_(return_sequences),
         stateful_(stateful),
         forward_weights_(forward_weights),
-        forward_recurrent_weights_(forward_recurrent_weights),
-        bias_forward_(bias_forward),
-        backward_weights_(backward_weights),
-        backward_recurrent_weights_(backward_recurrent_weights),
-        bias_backward_(bias_backward),
-        forward_state_h_(stateful ? tensor(tensor_shape(n_units), static_cast<float_type>(0)) : fplus::nothing<tensor>()),
-        forward_state_c_(stateful && wrapped_layer_type_has_state_c(wrapped_layer_type) ? tensor(tensor_shape(n_units), static_cast<float_type>(0)) : fplus::nothing<tensor>()),
-        backward_state_h_(stateful ? tensor(tensor_shape(n_units), static_cast<float_type>(0)) : fplus::nothing<tensor>()),
-        backward_state_c_(stateful && wrapped_layer_type_has_state_c(wrapped_layer_type) ? tensor(tensor_shape(n_units), static_cast<float_type>(0)) : fplus::nothing<tensor>())
+        backward_weights_(backward_weights)
         {
     }
 
-    void reset_states() override
-     {
-        if (is_stateful()) {
-            forward_state_h_ = tensor(tensor_shape(n_units_), static_cast<float_type>(0));
-            forward_state_c_ = tensor(tensor_shape(n_units_), static_cast<float_type>(0));
-            backward_state_h_ = tensor(tensor_shape(n_units_), static_cast<float_type>(0));
-            backward_state_c_ = tensor(tensor_shape(n_units_), static_cast<float_type>(0));
-        }
-     }
-
      bool is_stateful() const override
      {
          return stateful_;
      }
 
-
-protected:
-
-    static bool wrapped_layer_type_has_state_c(const std::string& wrapped_layer_type) {
+    static std::size_t wrapped_layer_n_gates(const std::string& wrapped_layer_type) {
         if (wrapped_layer_type == "LSTM" || wrapped_layer_type == "CuDNNLSTM") {
-            return true;
+            return 4;
         }
         if (wrapped_layer_type == "GRU" || wrapped_layer_type == "CuDNNGRU") {
-            return false;
+            return 3;
         }
         raise_error("layer '" + wrapped_layer_type + "' not yet implemented");
-        return false;
+        return 0;
     }
 
+protected:
+
     tensors apply_impl(const tensors& inputs) const override final
     {
-        const auto input_shapes = fplus::transform(fplus_c_mem_fn_t(tensor, shape, tensor_shape), inputs);
+        state_dict states;
+        return apply_stateful_impl(inputs, states);
+    }
 
+    tensors apply_stateful_impl(const tensors& inputs,
+        state_dict& states) const override final
+    {
         // ensure that tensor shape is (1, 1, 1, seq_len, n_features)
-        assertion(inputs.front().shape().rank() == 2,
-                  "size_dim_5, size_dim_4 and height dimension must be 1, but shape is '" + show_tensor_shapes(input_shapes) + "'");
+        if (inputs.front().shape().rank() != 2)
+        {
+            const auto input_shapes = fplus::transform(fplus_c_mem_fn_t(tensor, shape, tensor_shape), inputs);
+            raise_error("size_dim_5, size_dim_4 and height dimension must be 1, but shape is '" + show_tensor_shapes(input_shapes) + "'");
+        }
 
         const auto input = inputs.front();
 
         tensors result_forward = {};
         tensors result_backward = {};
-        tensors bidirectional_result = {};
 
-        const tensor input_reversed = reverse_time_series_in_tensor(input);
+        const tensor zero_state(tensor_shape(n_units_), static_cast<float_type>(0));
+
+        // Both directions are independent of each other.
+        // For large enough workloads the backward one runs in its own thread.
+        const auto backward_launch_policy =
+            std::thread::hardware_concurrency() > 1 &&
+            input.shape().width_ * n_units_ * (input.shape().depth_ + n_units_)
+                >= parallel_directions_min_workload
+            ? std::launch::async
+            : std::launch::deferred;
 
         if (wrapped_layer_type_ == "LSTM" || wrapped_layer_type_ == "CuDNNLSTM")
         {
             assertion(inputs.size() == 1 || inputs.size() == 5,
                 "Invalid number of input tensors.");
 
-            tensor forward_state_h = inputs.size() == 5
-            ? inputs[1]
-            : is_stateful()
-                ? forward_state_h_.unsafe_get_just()
-                : tensor(tensor_shape(n_units_), static_cast<float_type>(0));
-
-            tensor forward_state_c = inputs.size() == 5
-            ? inputs[2]
-            : is_stateful()
-                ? forward_state_c_.unsafe_get_just()
-                : tensor(tensor_shape(n_units_), static_cast<float_type>(0));
-
-            tensor backward_state_h = inputs.size() == 5
-            ? inputs[3]
-            : is_stateful()
-                ? backward_state_h_.unsafe_get_just()
-                : tensor(tensor_shape(n_units_), static_cast<float_type>(0));
-
-            tensor backward_state_c = inputs.size() == 5
-            ? inputs[4]
-            : is_stateful()
-                ? backward_state_c_.unsafe_get_just()
-                : tensor(tensor_shape(n_units_), static_cast<float_type>(0));
+            // forward h, forward c, backward h, backward c
+            const tensors stored_states = is_stateful()
+                ? load_states(states, tensors(4, zero_state))
+                : tensors(4, zero_state);
+
+            tensor forward_state_h = inputs.size() == 5 ? inputs[1] : stored_states[0];
+            tensor forward_state_c = inputs.size() == 5 ? inputs[2] : stored_states[1];
+            tensor backward_state_h = inputs.size() == 5 ? inputs[3] : stored_states[2];
+            tensor backward_state_c = inputs.size() == 5 ? inputs[4] : stored_states[3];
 
+            auto backward = std::async(backward_launch_policy, [&]() -> tensors
+            {
+                return lstm_impl(input, backward_state_h, backward_state_c,
+                                 n_units_, return_sequences_, false, true,
+                                 backward_weights_, activation_, recurrent_activation_);
+            });
             result_forward = lstm_impl(input, forward_state_h, forward_state_c,
-                                       n_units_, use_bias_, return_sequences_, stateful_,
-                                       forward_weights_, forward_recurrent_weights_,
-                                       bias_forward_, activation_, recurrent_activation_);
-            result_backward = lstm_impl(input_reversed, backward_state_h, backward_state_c,
-                                        n_units_, use_bias_, return_sequences_, stateful_,
-                                        backward_weights_, backward_recurrent_weights_,
-                                        bias_backward_, activation_, recurrent_activation_);
+                                       n_units_, return_sequences_, false, false,
+                                       forward_weights_, activation_, recurrent_activation_);
+            result_backward = backward.get();
             if (is_stateful()) {
-                forward_state_h_ = forward_state_h;
-                forward_state_c_ = forward_state_c;
-                backward_state_h_ = backward_state_h;
-                backward_state_c_ = backward_state_c;
+                store_states(states, {forward_state_h, forward_state_c,
+                    backward_state_h, backward_state_c});
              }
         }
         else if (wrapped_layer_type_ == "GRU" || wrapped_layer_type_ == "CuDNNGRU")
@@ -154,75 +162,149 @@ protected:
             assertion(inputs.size() == 1 || inputs.size() == 3,
                 "Invalid number of input tensors.");
 
-            tensor forward_state_h = inputs.size() == 3
-            ? inputs[1]
-            : is_stateful()
-                ? forward_state_h_.unsafe_get_just()
-                : tensor(tensor_shape(n_units_), static_cast<float_type>(0));
-
-            tensor backward_state_h = inputs.size() == 3
-            ? inputs[2]
-            : is_stateful()
-                ? backward_state_h_.unsafe_get_just()
-                : tensor(tensor_shape(n_units_), static_cast<float_type>(0));
-
-            result_forward = gru_impl(input, forward_state_h, n_units_, use_bias_, reset_after_, return_sequences_, false,
-                                      forward_weights_, forward_recurrent_weights_,
-                                      bias_forward_, activation_, recurrent_activation_);
-            result_backward = gru_impl(input_reversed, backward_state_h, n_units_, use_bias_, reset_after_, return_sequences_, false,
-                                       backward_weights_, backward_recurrent_weights_,
-                                       bias_backward_, activation_, recurrent_activation_);
+            // forward h, backward h
+            const tensors stored_states = is_stateful()
+                ? load_states(states, tensors(2, zero_state))
+                : tensors(2, zero_state);
+
+            tensor forward_state_h = inputs.size() == 3 ? inputs[1] : stored_states[0];
+            tensor backward_state_h = inputs.size() == 3 ? inputs[2] : stored_states[1];
+
+            auto backward = std::async(backward_launch_policy, [&]() -> tensors
+            {
+                return gru_impl(input, backward_state_h, n_units_, reset_after_, return_sequences_, false, true,
+                                backward_weights_, activation_, recurrent_activation_);
+            });
+            result_forward = gru_impl(input, forward_state_h, n_units_, reset_after_, return_sequences_, false, false,
+                                      forward_weights_, activation_, recurrent_activation_);
+            result_backward = backward.get();
             if (is_stateful()) {
-                forward_state_h_ = forward_state_h;
-                backward_state_h_ = backward_state_h;
+                store_states(states, {forward_state_h, backward_state_h});
              }
         }
         else
             raise_error("layer '" + wrapped_layer_type_ + "' not yet implemented");
 
-        const tensor result_backward_reversed = reverse_time_series_in_tensor(result_backward.front());
+        return {merge_directions(result_forward.front(), result_backward.front())};
+    }
 
+    tensors_vec apply_batch_impl(const tensors_vec& inputs) const override final
+    {
+        // Samples providing their own initial states,
+        // as well as stateful layers, are processed one after another.
+        const bool single_inputs = fplus::all_by([](const tensors& sample_inputs)
+        {
+            return sample_inputs.size() == 1;
+        }, inputs);
+        if (is_stateful() || !single_inputs || inputs.empty())
+        {
+            return layer::apply_batch_impl(inputs);
+        }
+
+        const auto sequences = fplus::transform(
+            [](const tensors& sample_inputs) -> tensor
+            {
+                return sample_inputs.front();
+            }, inputs);
+        const tensors zero_states(sequences.size(),
+            tensor(tensor_shape(n_units_), static_cast<float_type>(0)));
+
+        tensors_vec results_forward;
+        tensors_vec results_backward;
+        if (wrapped_layer_type_ == "LSTM" || wrapped_layer_type_ == "CuDNNLSTM")
+        {
+            tensors forward_states_h = zero_states;
+            tensors forward_states_c = zero_states;
+            tensors backward_states_h = zero_states;
+            tensors backward_states_c = zero_states;
+            results_forward = lstm_impl_batch(sequences,
+                forward_states_h, forward_states_c,
+                n_units_, return_sequences_, false, false,
+                forward_weights_, activation_, recurrent_activation_);
+            results_backward = lstm_impl_batch(sequences,
+                backward_states_h, backward_states_c,
+                n_units_, return_sequences_, false, true,
+                backward_weights_, activation_, recurrent_activation_);
+        }
+        else if (wrapped_layer_type_ == "GRU" || wrapped_layer_type_ == "CuDNNGRU")
+        {
+            tensors forward_states_h = zero_states;
+            tensors backward_states_h = zero_states;
+            results_forward = gru_impl_batch(sequences, forward_states_h,
+                n_units_, reset_after_, return_sequences_, false, false,
+                forward_weights_, activation_, recurrent_activation_);
+            results_backward = gru_impl_batch(sequences, backward_states_h,
+                n_units_, reset_after_, return_sequences_, false, true,
+                backward_weights_, activation_, recurrent_activation_);
+        }
+        else
+            raise_error("layer '" + wrapped_layer_type_ + "' not yet implemented");
+
+        return fplus::zip_with(
+            [this](const tensors& forward, const tensors& backward) -> tensors
+            {
+                return {merge_directions(forward.front(), backward.front())};
+            }, results_forward, results_backward);
+    }
+
+    // The backward result is already aligned to the forward time order.
+    tensor merge_directions(const tensor& forward, const tensor& backward) const
+    {
+        assertion(forward.shape() == backward.shape(),
+            "shapes of forward and backward result differ");
+        const auto& forward_values = *forward.as_vector();
+        const auto& backward_values = *backward.as_vector();
         if (merge_mode_ == "concat")
         {
-            bidirectional_result = {concatenate_tensors_depth({result_forward.front(), result_backward_reversed})};
+            const std::size_t n_steps = forward_values.size() / n_units_;
+            float_vec concatenated(2 * forward_values.size());
+            for (std::size_t t = 0; t < n_steps; ++t)
+            {
+                std::copy_n(forward_values.cbegin() + static_cast<float_vec::const_iterator::difference_type>(t * n_units_),
+                    n_units_, concatenated.begin() + static_cast<float_vec::iterator::difference_type>(2 * t * n_units_));
+                std::copy_n(backward_values.cbegin() + static_cast<float_vec::const_iterator::difference_type>(t * n_units_),
+                    n_units_, concatenated.begin() + static_cast<float_vec::iterator::difference_type>((2 * t + 1) * n_units_));
+            }
+            const tensor_shape shape = forward.shape().rank() == 1
+                ? tensor_shape(2 * n_units_)
+                : tensor_shape(n_steps, 2 * n_units_);
+            return tensor(shape, std::move(concatenated));
         }
-        else if (merge_mode_ == "sum")
+        float_vec merged(forward_values.size());
+        if (merge_mode_ == "sum")
         {
-            bidirectional_result = {sum_tensors({result_forward.front(), result_backward_reversed})};
+            for (std::size_t i = 0; i < merged.size(); ++i)
+                merged[i] = forward_values[i] + backward_values[i];
         }
         else if (merge_mode_ == "mul")
         {
-            bidirectional_result = {multiply_tensors({result_forward.front(), result_backward_reversed})};
+            for (std::size_t i = 0; i < merged.size(); ++i)
+                merged[i] = forward_values[i] * backward_values[i];
         }
         else if (merge_mode_ == "ave")
         {
-            bidirectional_result = {average_tensors({result_forward.front(), result_backward_reversed})};
+            for (std::size_t i = 0; i < merged.size(); ++i)
+                merged[i] = (forward_values[i] + backward_values[i]) / 2;
         }
         else
             raise_error("merge mode '" + merge_mode_ + "' not valid");
-
-        return bidirectional_result;
+        return tensor(forward.shape(), std::move(merged));
     }
 
+    // Sequence length times number of units times inputs per unit
+    // from which on running both directions in parallel pays off.
+    static const std::size_t parallel_directions_min_workload = 1 << 16;
+
     const std::string merge_mode_;
     const std::size_t n_units_;
     const std::string activation_;
     const std::string recurrent_activation_;
     const std::string wrapped_layer_type_;
-    const bool use_bias_;
     const bool reset_after_;
     const bool return_sequences_;
     const bool stateful_;
-    const float_vec forward_weights_;
-    const float_vec forward_recurrent_weights_;
-    const float_vec bias_forward_;
-    const float_vec backward_weights_;
-    const float_vec backward_recurrent_weights_;
-    const float_vec bias_backward_;
-    mutable fplus::maybe<tensor> forward_state_h_;
-    mutable fplus::maybe<tensor> forward_state_c_;
-    mutable fplus::maybe<tensor> backward_state_h_;
-    mutable fplus::maybe<tensor> backward_state_c_;
+    const recurrent_weights forward_weights_;
+    const recurrent_weights backward_weights_;
 };
 
 } // namespace internal
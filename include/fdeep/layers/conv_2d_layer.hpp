@@ -16,6 +16,7 @@
 
 #include <cstddef>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace fdeep { namespace internal
@@ -28,10 +29,10 @@ public:
             const std::string& name, const tensor_shape& filter_shape,
             std::size_t k, const shape2& strides, padding p,
             const shape2& dilation_rate,
-            const float_vec& weights, const float_vec& bias)
+            const weights_storage& weights, const weights_storage& bias)
         : layer(name),
         filters_(generate_im2col_filter_matrix(
-            generate_filters(dilation_rate, filter_shape, k, weights, bias))),
+            dilation_rate, filter_shape, k, weights, bias)),
         strides_(strides),
         padding_(p)
     {
@@ -39,12 +40,33 @@ public:
         assertion(filter_shape.volume() > 0, "filter must have volume");
         assertion(strides.area() > 0, "invalid strides");
     }
+    // For weights stored otherwise (e.g., quantized), without dilation.
+    explicit conv_2d_layer(
+            const std::string& name, const tensor_shape& filter_shape,
+            std::size_t k, const shape2& strides, padding p,
+            const weight_matrix_ptr& weights)
+        : layer(name),
+        filters_({weights, filter_shape, k}),
+        strides_(strides),
+        padding_(p)
+    {
+        assertion(k > 0, "needs at least one filter");
+        assertion(filter_shape.volume() > 0, "filter must have volume");
+        assertion(strides.area() > 0, "invalid strides");
+        assertion(weights->n_in() == filter_shape.volume() &&
+            weights->n_out() == k, "invalid weight matrix size");
+    }
 protected:
     tensors apply_impl(const tensors& inputs) const override
     {
         const auto& input = single_tensor_from_tensors(inputs);
         return {convolve(strides_, padding_, filters_, input)};
     }
+    std::pair<tensor_shape, shared_float_vec> apply_slices_impl(
+        const tensor& input, const tensor_shape& slice_shape) const override
+    {
+        return convolve_slices(strides_, padding_, filters_, input, slice_shape);
+    }
     im2col_filter_matrix filters_;
     shape2 strides_;
     padding padding_;
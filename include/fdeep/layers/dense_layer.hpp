@@ -7,11 +7,16 @@
 #pragma once
 
 #include "fdeep/layers/layer.hpp"
+#include "fdeep/sparse_weights.hpp"
 #include "fdeep/tensor.hpp"
+#include "fdeep/weight_matrix.hpp"
+#include "fdeep/weights_storage.hpp"
 
 #include <fplus/fplus.hpp>
 
+#include <memory>
 #include <string>
+#include <utility>
 
 namespace fdeep { namespace internal
 {
@@ -20,23 +25,22 @@ namespace fdeep { namespace internal
 class dense_layer : public layer
 {
 public:
-    static RowMajorMatrixXf generate_params(std::size_t n_in,
-        const float_vec& weights, const float_vec& bias)
+    dense_layer(const std::string& name, std::size_t units,
+            const weights_storage& weights,
+            const weights_storage& bias) :
+        dense_layer(name, units,
+            create_float_weight_matrix(weights, bias, false,
+                accumulates_wider<dense_accumulator_type>(), false))
     {
-        assertion(weights.size() % bias.size() == 0, "invalid params");
-        return eigen_row_major_mat_from_values(n_in + 1, bias.size(),
-            fplus::append(weights, bias));
     }
     dense_layer(const std::string& name, std::size_t units,
-            const float_vec& weights,
-            const float_vec& bias) :
+            const weight_matrix_ptr& weights) :
         layer(name),
-        n_in_(weights.size() / bias.size()),
+        n_in_(weights->n_in()),
         n_out_(units),
-        params_(generate_params(n_in_, weights, bias))
+        weights_(weights)
     {
-        assertion(bias.size() == units, "invalid bias count");
-        assertion(weights.size() % units == 0, "invalid weight count");
+        assertion(weights->n_out() == units, "invalid number of units");
     }
 protected:
     tensors apply_impl(const tensors& inputs) const override
@@ -53,42 +57,32 @@ protected:
         // {
         //     input = flatten_tensor(input);
         // }
-        const auto input_parts = fplus::split_every(
-            input.shape().depth_, *input.as_vector());
-
-        const auto result_value_vectors = fplus::transform(
-            [this](const auto& input_part) -> float_vec
-            {
-                assertion(input_part.size() == n_in_,
-                    "Invalid input value count.");
-                const auto bias_padded_input = bias_pad_input(input_part);
-                const auto result = bias_padded_input * params_;
-                assertion(result.rows() == 1, "invalid result size.");
-                return *eigen_row_major_mat_to_values(result);
-            },
-            input_parts);
-
-        const auto result_values = fplus::concat(result_value_vectors);
-        assertion(result_values.size() % n_out_ == 0,
-            "Invalid number of output values.");
-
         return {tensor(change_tensor_shape_dimension_by_index(
                 input.shape(), 4, n_out_),
-            fplus::make_shared_ref<fdeep::float_vec>(result_values))};
+            apply_to_rows(input))};
+    }
+    std::pair<tensor_shape, shared_float_vec> apply_slices_impl(
+        const tensor& input, const tensor_shape& slice_shape) const override
+    {
+        return {change_tensor_shape_dimension_by_index(slice_shape, 4, n_out_),
+            apply_to_rows(input)};
     }
-    static RowMajorMatrixXf bias_pad_input(const float_vec& input)
+    // All depth rows of the input are multiplied with the weights
+    // in one single matrix product.
+    shared_float_vec apply_to_rows(const tensor& input) const
     {
-        RowMajorMatrixXf m(1, input.size() + 1);
-        for (std::size_t z = 0; z < input.size(); ++z)
-        {
-            m(0, static_cast<EigenIndex>(z)) = input[z];
-        }
-        m(0, static_cast<EigenIndex>(input.size())) = 1;
-        return m;
+        assertion(input.shape().depth_ == n_in_,
+            "Invalid input value count.");
+        const std::size_t rows = input.shape().volume() / n_in_;
+        shared_float_vec result_values = fplus::make_shared_ref<float_vec>();
+        result_values->resize(rows * n_out_);
+        weights_->apply(input.as_vector()->data(), rows,
+            result_values->data());
+        return result_values;
     }
     std::size_t n_in_;
     std::size_t n_out_;
-    RowMajorMatrixXf params_;
+    weight_matrix_ptr weights_;
 };
 
 } } // namespace fdeep, namespace internal
@@ -7,9 +7,11 @@
 #pragma once
 
 #include "fdeep/layers/layer.hpp"
+#include "fdeep/half_precision.hpp"
 
 #include <string>
 #include <functional>
+#include <utility>
 
 namespace fdeep
 {
@@ -27,8 +29,28 @@ class embedding_layer : public layer
         , input_dim_(input_dim)
         , output_dim_(output_dim)
         , weights_(weights)
+        , half_weights_()
+        , precision_(half_precision::float16)
     {}
 
+    // With the weights stored as half values,
+    // widened only for the looked-up vectors.
+    explicit embedding_layer(const std::string& name,
+                             std::size_t input_dim,
+                             std::size_t output_dim,
+                             half_vec&& weights,
+                             half_precision precision)
+        : layer(name)
+        , input_dim_(input_dim)
+        , output_dim_(output_dim)
+        , weights_()
+        , half_weights_(std::move(weights))
+        , precision_(precision)
+    {
+        assertion(half_weights_.size() == input_dim_ * output_dim_,
+            "invalid number of embedding weights");
+    }
+
   protected:
     tensors apply_impl(const tensors &inputs) const override final
     {
@@ -52,7 +74,15 @@ class embedding_layer : public layer
             {
                 std::size_t index = static_cast<std::size_t>(input.get(tensor_pos(i)));
                 assertion(index < input_dim_, "vocabulary item indices must all be strictly less than the value of input_dim");
-                it = std::copy_n(weights_.cbegin() + static_cast<float_vec::const_iterator::difference_type>(index * output_dim_), output_dim_, it);
+                if (!half_weights_.empty())
+                {
+                    widen_half(half_weights_.data() + index * output_dim_, output_dim_, precision_, output_vec.data() + i * output_dim_);
+                    it += static_cast<float_vec::iterator::difference_type>(output_dim_);
+                }
+                else
+                {
+                    it = std::copy_n(weights_.cbegin() + static_cast<float_vec::const_iterator::difference_type>(index * output_dim_), output_dim_, it);
+                }
             }
 
             results.push_back(tensor(tensor_shape(sequence_len, output_dim_), std::move(output_vec)));
@@ -63,6 +93,8 @@ class embedding_layer : public layer
     const std::size_t input_dim_;
     const std::size_t output_dim_;
     const float_vec weights_;
+    const half_vec half_weights_;
+    const half_precision precision_;
 };
 
 } // namespace internal
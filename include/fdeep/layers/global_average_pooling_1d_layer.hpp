@@ -36,7 +36,7 @@ protected:
         tensor out(tensor_shape(feature_count), 0);
         for (std::size_t z = 0; z < feature_count; ++z)
         {
-            float_type val = 0;
+            pooling_accumulator_type val = 0;
             for (std::size_t x = 0; x < step_count; ++x)
             {
                 if (channels_first_)
@@ -44,7 +44,7 @@ protected:
                 else
                     val += in.get(tensor_pos(x, z));
             }
-            out.set(tensor_pos(z), val / static_cast<float_type>(step_count));
+            out.set(tensor_pos(z), static_cast<float_type>(val / static_cast<pooling_accumulator_type>(step_count)));
         }
         return out;
     }
@@ -41,7 +41,7 @@ protected:
         tensor out(tensor_shape(feature_count), 0);
         for (std::size_t z = 0; z < feature_count; ++z)
         {
-            float_type val = 0;
+            pooling_accumulator_type val = 0;
             for (std::size_t y = 0; y < in_height; ++y)
             {
                 for (std::size_t x = 0; x < in_width; ++x)
@@ -52,7 +52,7 @@ protected:
                         val += in.get(tensor_pos(y, x, z));
                 }
             }
-            out.set(tensor_pos(z), val / static_cast<float_type>(in_height * in_width));
+            out.set(tensor_pos(z), static_cast<float_type>(val / static_cast<pooling_accumulator_type>(in_height * in_width)));
         }
         return out;
     }
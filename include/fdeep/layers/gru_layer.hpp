@@ -29,31 +29,38 @@ class gru_layer : public layer
                         const bool return_sequences,
                         const bool return_state,
                         const bool stateful,
-                        const float_vec& weights,
-                        const float_vec& recurrent_weights,
-                        const float_vec& bias)
+                        const weights_storage& weights,
+                        const weights_storage& recurrent_weights,
+                        const weights_storage& bias)
+        : gru_layer(name, n_units, activation, recurrent_activation,
+              reset_after, return_sequences, return_state, stateful,
+              create_gru_weights(n_units, use_bias,
+                  weights, recurrent_weights, bias))
+    {
+    }
+
+    explicit gru_layer(const std::string& name,
+                        std::size_t n_units,
+                        const std::string& activation,
+                        const std::string& recurrent_activation,
+                        const bool reset_after,
+                        const bool return_sequences,
+                        const bool return_state,
+                        const bool stateful,
+                        const recurrent_weights& weights)
         : layer(name),
           n_units_(n_units),
           activation_(activation),
           recurrent_activation_(recurrent_activation),
-          use_bias_(use_bias),
           reset_after_(reset_after),
           return_sequences_(return_sequences),
           return_state_(return_state),
           stateful_(stateful),
-          weights_(weights),
-          recurrent_weights_(recurrent_weights),
-          bias_(bias),
-          state_h_(stateful ? tensor(tensor_shape(n_units), static_cast<float_type>(0)) : fplus::nothing<tensor>())
-
+          weights_(weights)
     {
-    }
-
-    void reset_states() override
-    {
-        if (is_stateful()) {
-            state_h_ = tensor(tensor_shape(n_units_), static_cast<float_type>(0));
-        }
+        assertion(weights.W_->n_out() == 3 * n_units &&
+            weights.U_->n_in() == n_units && weights.U_->n_out() == 3 * n_units,
+            "invalid GRU weights");
     }
 
     bool is_stateful() const override
@@ -64,46 +71,76 @@ class gru_layer : public layer
   protected:
     tensors apply_impl(const tensors &inputs) const override final
     {
-        const auto input_shapes = fplus::transform(fplus_c_mem_fn_t(tensor, shape, tensor_shape), inputs);
+        state_dict states;
+        return apply_stateful_impl(inputs, states);
+    }
 
+    tensors apply_stateful_impl(const tensors &inputs,
+        state_dict& states) const override final
+    {
         // ensure that tensor shape is (1, 1, 1, seq_len, n_features)
-        assertion(inputs.front().shape().size_dim_5_ == 1
-                  && inputs.front().shape().size_dim_4_ == 1
-                  && inputs.front().shape().height_ == 1,
-                  "size_dim_5, size_dim_4 and height dimension must be 1, but shape is '" + show_tensor_shapes(input_shapes) + "'");
+        if (inputs.front().shape().size_dim_5_ != 1
+            || inputs.front().shape().size_dim_4_ != 1
+            || inputs.front().shape().height_ != 1)
+        {
+            const auto input_shapes = fplus::transform(fplus_c_mem_fn_t(tensor, shape, tensor_shape), inputs);
+            raise_error("size_dim_5, size_dim_4 and height dimension must be 1, but shape is '" + show_tensor_shapes(input_shapes) + "'");
+        }
 
         const auto input = inputs.front();
 
         assertion(inputs.size() == 1 || inputs.size() == 2,
                 "Invalid number of input tensors.");
 
+        const tensor zero_state(tensor_shape(n_units_), static_cast<float_type>(0));
         tensor state_h = inputs.size() == 2
             ? inputs[1]
             : is_stateful()
-                ? state_h_.unsafe_get_just()
-                : tensor(tensor_shape(n_units_), static_cast<float_type>(0));
+                ? load_states(states, {zero_state}).front()
+                : zero_state;
 
-        const auto result = gru_impl(input, state_h, n_units_, use_bias_,
-            reset_after_, return_sequences_, return_state_, weights_, recurrent_weights_,
-            bias_, activation_, recurrent_activation_);
+        const auto result = gru_impl(input, state_h, n_units_,
+            reset_after_, return_sequences_, return_state_, false, weights_,
+            activation_, recurrent_activation_);
         if (is_stateful()) {
-            state_h_ = state_h;
+            store_states(states, {state_h});
         }
         return result;
     }
 
+    tensors_vec apply_batch_impl(const tensors_vec& inputs) const override final
+    {
+        // Samples providing their own initial states,
+        // as well as stateful layers, are processed one after another.
+        const bool single_inputs = fplus::all_by([](const tensors& sample_inputs)
+        {
+            return sample_inputs.size() == 1;
+        }, inputs);
+        if (is_stateful() || !single_inputs || inputs.empty())
+        {
+            return layer::apply_batch_impl(inputs);
+        }
+
+        const auto sequences = fplus::transform(
+            [](const tensors& sample_inputs) -> tensor
+            {
+                return sample_inputs.front();
+            }, inputs);
+        tensors states_h(sequences.size(),
+            tensor(tensor_shape(n_units_), static_cast<float_type>(0)));
+        return gru_impl_batch(sequences, states_h, n_units_,
+            reset_after_, return_sequences_, return_state_, false, weights_,
+            activation_, recurrent_activation_);
+    }
+
     const std::size_t n_units_;
     const std::string activation_;
     const std::string recurrent_activation_;
-    const bool use_bias_;
     const bool reset_after_;
     const bool return_sequences_;
     const bool return_state_;
     const bool stateful_;
-    const float_vec weights_;
-    const float_vec recurrent_weights_;
-    const float_vec bias_;
-    mutable fplus::maybe<tensor> state_h_;
+    const recurrent_weights weights_;
 };
 
 } // namespace internal
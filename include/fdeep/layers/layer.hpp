@@ -15,6 +15,7 @@
 #include <cstddef>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace fdeep { namespace internal
@@ -52,15 +53,60 @@ public:
 
     virtual tensors apply(const tensors& input) const final
     {
-        const auto result = apply_impl(input);
+        state_dict states;
+        return apply(input, states);
+    }
+
+    // Stateful layers read their recurrent states from
+    // and write them back to the given dict.
+    virtual tensors apply(const tensors& input, state_dict& states) const final
+    {
+        const auto result = apply_stateful_impl(input, states);
         if (activation_ == nullptr)
             return result;
         else
             return apply_activation_layer(activation_, result);
     }
 
+    // Apply the layer to multiple independent samples at once.
+    virtual tensors_vec apply_batch(const tensors_vec& inputs) const final
+    {
+        const auto results = apply_batch_impl(inputs);
+        if (activation_ == nullptr)
+            return results;
+        else
+            return fplus::transform([this](const tensors& result) -> tensors
+            {
+                return apply_activation_layer(activation_, result);
+            }, results);
+    }
+
+    // Apply the layer to all slices of a tensor at once.
+    // The input consists of equally shaped slices
+    // stored one after another (e.g., the time steps of TimeDistributed).
+    // Returns the common output shape of one slice
+    // and the output values of all slices one after another.
+    virtual std::pair<tensor_shape, shared_float_vec> apply_slices(
+        const tensor& input, const tensor_shape& slice_shape) const final
+    {
+        assertion(slice_shape.volume() > 0 &&
+            input.shape().volume() % slice_shape.volume() == 0,
+            "invalid slice shape");
+        const auto result = apply_slices_impl(input, slice_shape);
+        if (activation_ == nullptr)
+            return result;
+        // Activations work element-wise or along the depth dimension,
+        // so they can be applied to all slices in one go.
+        const std::size_t depth = result.first.depth_;
+        const tensor all_slices(
+            tensor_shape(result.second->size() / depth, depth),
+            result.second);
+        return {result.first,
+            apply_activation_layer(activation_, {all_slices}).front().as_vector()};
+    }
+
     virtual tensor get_output(const layer_ptrs& layers,
-        output_dict& output_cache,
+        output_dict& output_cache, state_dict& states,
         std::size_t node_idx, std::size_t tensor_idx) const
     {
         const node_connection conn(name_, node_idx, tensor_idx);
@@ -69,7 +115,8 @@ public:
         {
             assertion(node_idx < nodes_.size(), "invalid node index");
             output_cache[conn.without_tensor_idx()] =
-                nodes_[node_idx].get_output(layers, output_cache, *this);
+                nodes_[node_idx].get_output(layers, output_cache, states,
+                    *this);
         }
 
         const auto& outputs = fplus::get_from_map_unsafe(
@@ -80,10 +127,30 @@ public:
         return outputs[tensor_idx];
     }
 
-    virtual void reset_states()
+    // Like get_output, but for multiple independent samples at once.
+    // Returns one tensor per sample.
+    virtual tensors get_output_batch(const layer_ptrs& layers,
+        output_batch_dict& output_cache,
+        std::size_t node_idx, std::size_t tensor_idx) const
     {
-        // Stateful layers should override that function,
-        // and take care to reset their internal states if appropriate.
+        const node_connection conn(name_, node_idx, tensor_idx);
+
+        if (!fplus::map_contains(output_cache, conn.without_tensor_idx()))
+        {
+            assertion(node_idx < nodes_.size(), "invalid node index");
+            output_cache[conn.without_tensor_idx()] =
+                nodes_[node_idx].get_output_batch(layers, output_cache, *this);
+        }
+
+        const auto& outputs = fplus::get_from_map_unsafe(
+            output_cache, conn.without_tensor_idx());
+
+        return fplus::transform([tensor_idx](const tensors& sample_outputs) -> tensor
+        {
+            assertion(tensor_idx < sample_outputs.size(),
+                "invalid tensor index");
+            return sample_outputs[tensor_idx];
+        }, outputs);
     }
 
     virtual bool is_stateful() const
@@ -92,25 +159,113 @@ public:
         // Stateful layers should override that function, with return true.
     }
 
+    // Creates everything a layer (or a layer contained in it)
+    // would otherwise only create when applied for the first time.
+    virtual void materialize() const
+    {
+    }
+
     std::string name_;
     nodes nodes_;
 
 protected:
     virtual tensors apply_impl(const tensors& input) const = 0;
+
+    // Stateful layers, and layers containing stateful layers,
+    // override this to get access to the recurrent states.
+    virtual tensors apply_stateful_impl(const tensors& input,
+        state_dict&) const
+    {
+        return apply_impl(input);
+    }
+
+    // Returns the states stored for this layer,
+    // or the given initial states if there are none yet.
+    tensors load_states(const state_dict& states,
+        const tensors& initial_states) const
+    {
+        const auto it = states.find(this);
+        return it == states.end() ? initial_states : it->second;
+    }
+
+    void store_states(state_dict& states, const tensors& layer_states) const
+    {
+        states[this] = layer_states;
+    }
+
+    // Layers that can process multiple samples more efficiently
+    // than one after another (e.g., recurrent layers) override this.
+    virtual tensors_vec apply_batch_impl(const tensors_vec& inputs) const
+    {
+        return fplus::transform([this](const tensors& input) -> tensors
+        {
+            return apply_impl(input);
+        }, inputs);
+    }
+
+    // Layers that can process all slices without splitting them up
+    // (e.g., dense or convolution layers) override this.
+    virtual std::pair<tensor_shape, shared_float_vec> apply_slices_impl(
+        const tensor& input, const tensor_shape& slice_shape) const
+    {
+        const std::size_t slice_volume = slice_shape.volume();
+        const std::size_t slice_count = input.shape().volume() / slice_volume;
+        const auto& values = *input.as_vector();
+        tensors_vec slices;
+        slices.reserve(slice_count);
+        for (std::size_t i = 0; i < slice_count; ++i)
+        {
+            const auto begin = values.begin() +
+                static_cast<std::ptrdiff_t>(i * slice_volume);
+            slices.push_back({tensor(slice_shape, float_vec(
+                begin, begin + static_cast<std::ptrdiff_t>(slice_volume)))});
+        }
+        const auto results = apply_batch_impl(slices);
+        const tensor_shape out_shape = results.front().front().shape();
+        shared_float_vec out_values = fplus::make_shared_ref<float_vec>();
+        out_values->reserve(slice_count * out_shape.volume());
+        for (const auto& result : results)
+        {
+            const auto& result_tensor = single_tensor_from_tensors(result);
+            assertion(result_tensor.shape() == out_shape,
+                "all slices must result in the same shape");
+            out_values->insert(out_values->end(),
+                result_tensor.as_vector()->begin(),
+                result_tensor.as_vector()->end());
+        }
+        return {out_shape, out_values};
+    }
     activation_layer_ptr activation_;
 };
 
 inline tensor get_layer_output(const layer_ptrs& layers,
     output_dict& output_cache,
+    state_dict& states,
+    const layer_ptr& layer,
+    std::size_t node_idx, std::size_t tensor_idx)
+{
+    return layer->get_output(layers, output_cache, states,
+        node_idx, tensor_idx);
+}
+
+inline tensors get_layer_output_batch(const layer_ptrs& layers,
+    output_batch_dict& output_cache,
     const layer_ptr& layer,
     std::size_t node_idx, std::size_t tensor_idx)
 {
-    return layer->get_output(layers, output_cache, node_idx, tensor_idx);
+    return layer->get_output_batch(layers, output_cache, node_idx, tensor_idx);
+}
+
+inline tensors apply_layer(const layer& layer, const tensors& inputs,
+    state_dict& states)
+{
+    return layer.apply(inputs, states);
 }
 
-inline tensors apply_layer(const layer& layer, const tensors& inputs)
+inline tensors_vec apply_layer_batch(const layer& layer,
+    const tensors_vec& inputs)
 {
-    return layer.apply(inputs);
+    return layer.apply_batch(inputs);
 }
 
 inline layer_ptr get_layer(const layer_ptrs& layers,
@@ -0,0 +1,87 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/layers/layer.hpp"
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace fdeep { namespace internal
+{
+
+// Stands in for a layer, which is only created
+// (i.e., its weights read and transformed)
+// when it is applied, or materialized, for the first time.
+// Creation happens at most once, even if multiple threads
+// apply the layer at the same time.
+// The activation and the nodes belong to the lazy layer,
+// not to the created one.
+class lazy_layer : public layer
+{
+public:
+    explicit lazy_layer(const std::string& name, bool stateful,
+        const std::function<layer_ptr()>& create_layer)
+        : layer(name),
+        stateful_(stateful),
+        create_layer_(create_layer),
+        created_flag_(),
+        layer_()
+    {
+    }
+    void materialize() const override
+    {
+        std::call_once(created_flag_, [this]()
+        {
+            layer_ = create_layer_();
+            layer_->materialize();
+            // Frees what the creation needed.
+            create_layer_ = nullptr;
+        });
+    }
+    // Known without creating the layer,
+    // because predict asks for it on every call.
+    bool is_stateful() const override
+    {
+        return stateful_;
+    }
+
+protected:
+    const layer& created_layer() const
+    {
+        materialize();
+        return *layer_;
+    }
+    tensors apply_impl(const tensors& input) const override
+    {
+        return created_layer().apply(input);
+    }
+    tensors apply_stateful_impl(const tensors& input,
+        state_dict& states) const override
+    {
+        return created_layer().apply(input, states);
+    }
+    tensors_vec apply_batch_impl(const tensors_vec& inputs) const override
+    {
+        return created_layer().apply_batch(inputs);
+    }
+    std::pair<tensor_shape, shared_float_vec> apply_slices_impl(
+        const tensor& input, const tensor_shape& slice_shape) const override
+    {
+        return created_layer().apply_slices(input, slice_shape);
+    }
+    bool stateful_;
+    mutable std::function<layer_ptr()> create_layer_;
+    mutable std::once_flag created_flag_;
+    mutable layer_ptr layer_;
+};
+
+} } // namespace fdeep, namespace internal
@@ -38,19 +38,23 @@ public:
     }
 
     tensor get_output(const layer_ptrs& layers, output_dict& output_cache,
+        state_dict& states,
         std::size_t node_idx, std::size_t tensor_idx) const override
     {
         // https://stackoverflow.com/questions/46011749/understanding-keras-model-architecture-node-index-of-nested-model
         node_idx = node_idx - 1;
         assertion(node_idx < nodes_.size(), "invalid node index");
-        return layer::get_output(layers, output_cache, node_idx, tensor_idx);
+        return layer::get_output(layers, output_cache, states,
+            node_idx, tensor_idx);
     }
-    void reset_states() override
+    tensors get_output_batch(const layer_ptrs& layers,
+        output_batch_dict& output_cache,
+        std::size_t node_idx, std::size_t tensor_idx) const override
     {
-        for (const auto& single_layer: layers_)
-        {
-            single_layer->reset_states();
-        }
+        node_idx = node_idx - 1;
+        assertion(node_idx < nodes_.size(), "invalid node index");
+        return layer::get_output_batch(layers, output_cache,
+            node_idx, tensor_idx);
     }
     bool is_stateful() const override
     {
@@ -58,16 +62,31 @@ public:
             return single_layer->is_stateful();
         }, layers_);
     }
+    void materialize() const override
+    {
+        for (const auto& single_layer : layers_)
+        {
+            single_layer->materialize();
+        }
+    }
 
 protected:
     tensors apply_impl(const tensors& inputs) const override
+    {
+        state_dict states;
+        return apply_stateful_impl(inputs, states);
+    }
+    tensors apply_stateful_impl(const tensors& inputs,
+        state_dict& states) const override
     {
         output_dict output_cache;
 
-        assertion(inputs.size() == input_connections_.size(),
-            "invalid number of input tensors for this model: " +
-            fplus::show(input_connections_.size()) + " required but " +
-            fplus::show(inputs.size()) + " provided");
+        if (inputs.size() != input_connections_.size())
+        {
+            raise_error("invalid number of input tensors for this model: " +
+                fplus::show(input_connections_.size()) + " required but " +
+                fplus::show(inputs.size()) + " provided");
+        }
 
         for (std::size_t i = 0; i < inputs.size(); ++i)
         {
@@ -75,14 +94,55 @@ protected:
                 {inputs[i]};
         }
 
-        const auto get_output = [this, &output_cache]
+        const auto get_output = [this, &output_cache, &states]
             (const node_connection& conn) -> tensor
         {
             return get_layer(layers_, conn.layer_id_)->get_output(
-                layers_, output_cache, conn.node_idx_, conn.tensor_idx_);
+                layers_, output_cache, states,
+                conn.node_idx_, conn.tensor_idx_);
         };
         return fplus::transform(get_output, output_connections_);
     }
+    tensors_vec apply_batch_impl(const tensors_vec& inputs) const override
+    {
+        output_batch_dict output_cache;
+
+        for (const auto& sample_inputs : inputs)
+        {
+            assertion(sample_inputs.size() == input_connections_.size(),
+                "invalid number of input tensors for this model: " +
+                fplus::show(input_connections_.size()) + " required but " +
+                fplus::show(sample_inputs.size()) + " provided");
+        }
+
+        for (std::size_t i = 0; i < input_connections_.size(); ++i)
+        {
+            output_cache[input_connections_[i].without_tensor_idx()] =
+                fplus::transform([i](const tensors& sample_inputs) -> tensors
+                {
+                    return {sample_inputs[i]};
+                }, inputs);
+        }
+
+        const auto get_output = [this, &output_cache]
+            (const node_connection& conn) -> tensors
+        {
+            return get_layer(layers_, conn.layer_id_)->get_output_batch(
+                layers_, output_cache, conn.node_idx_, conn.tensor_idx_);
+        };
+        const auto outputs_per_connection =
+            fplus::transform(get_output, output_connections_);
+
+        tensors_vec outputs_per_sample(inputs.size());
+        for (const auto& connection_outputs : outputs_per_connection)
+        {
+            for (std::size_t i = 0; i < inputs.size(); ++i)
+            {
+                outputs_per_sample[i].push_back(connection_outputs[i]);
+            }
+        }
+        return outputs_per_sample;
+    }
     layer_ptrs layers_;
     node_connections input_connections_;
     node_connections output_connections_;
@@ -8,6 +8,8 @@
 
 #include "fdeep/layers/activation_layer.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <string>
 
 namespace fdeep { namespace internal
@@ -23,33 +25,35 @@ public:
 protected:
     tensor transform_input(const tensor& input) const override
     {
-        // Get unnormalized values of exponent function.
-        const auto ex = [](float_type x) -> float_type
-        {
-            return std::exp(x);
-        };
-        const float_type m = input.get(tensor_max_pos(input));
-        const auto inp_shifted = subtract_tensor(input, tensor(input.shape(), m));
-        auto output = transform_tensor(ex, inp_shifted);
+        tensor output(input.shape(), static_cast<float_type>(0));
 
         // Softmax function is applied along channel dimension.
         for (size_t y = 0; y < input.shape().height_; ++y)
         {
             for (size_t x = 0; x < input.shape().width_; ++x)
             {
+                // Shift the values of each pixel by their own maximum,
+                // so pixels (or time steps) with very different magnitudes
+                // do not influence each other's numerical stability.
+                float_type m = input.get_ignore_rank(tensor_pos(y, x, 0));
+                for (size_t z_class = 1; z_class < input.shape().depth_; ++z_class)
+                {
+                    m = std::max(m, input.get_ignore_rank(tensor_pos(y, x, z_class)));
+                }
                 // Get the sum of unnormalized values for one pixel.
                 // We are not using Kahan summation, since the number
                 // of object classes is usually quite small.
-                float_type sum_shifted = 0.0f;
+                softmax_accumulator_type sum_shifted = 0.0f;
                 for (size_t z_class = 0; z_class < input.shape().depth_; ++z_class)
                 {
-                    sum_shifted += output.get_ignore_rank(tensor_pos(y, x, z_class));
+                    sum_shifted += static_cast<softmax_accumulator_type>(
+                        std::exp(input.get_ignore_rank(tensor_pos(y, x, z_class)) - m));
                 }
                 // Divide the unnormalized values of each pixel by the stacks sum.
-                const auto log_sum_shifted = std::log(sum_shifted);
+                const auto log_sum_shifted = static_cast<float_type>(std::log(sum_shifted));
                 for (size_t z_class = 0; z_class < input.shape().depth_; ++z_class)
                 {
-                    const auto result = std::exp(inp_shifted.get_ignore_rank(tensor_pos(y, x, z_class)) - log_sum_shifted);
+                    const auto result = std::exp(input.get_ignore_rank(tensor_pos(y, x, z_class)) - m - log_sum_shifted);
                     output.set_ignore_rank(tensor_pos(y, x, z_class), std::isinf(result) ? static_cast<float_type>(0) : result);
                 }
             }
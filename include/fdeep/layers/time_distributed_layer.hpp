@@ -34,74 +34,56 @@ public:
     {
         assertion(td_output_len_ > 1, "Wrong input dimension");
     }
+    void materialize() const override
+    {
+        inner_layer_->materialize();
+    }
 
 protected:
     tensors apply_impl(const tensors& inputs) const override final
     {
         const auto& input = single_tensor_from_tensors(inputs);
-        tensors result_time_step = {};
         std::size_t len_series = 0;
-        tensors slices = {};
-        std::int32_t concat_axis;
 
+        // The time dimension is always the outermost one,
+        // so the time steps are stored one after another
+        // and can be handed over to the inner layer without copying.
         if (td_input_len_ == 2)
-        {
             len_series = input.shape().width_;
-            slices = tensor_to_tensors_width_slices(input);
-        }
         else if(td_input_len_ == 3)
-        {
             len_series = input.shape().height_;
-            slices = tensor_to_tensors_height_slices(input);
-        }
         else if(td_input_len_ == 4)
-        {
             len_series = input.shape().size_dim_4_;
-            slices = tensor_to_tensors_dim4_slices(input);
-        }
         else if(td_input_len_ == 5)
-        {
             len_series = input.shape().size_dim_5_;
-            slices = tensor_to_tensors_dim5_slices(input);
-        }
         else
             raise_error("invalid input dim for TimeDistributed");
 
+        const auto slice_shape = change_tensor_shape_dimension_by_index(
+            input.shape(), 5 - td_input_len_, 1);
+
+        const auto result = inner_layer_->apply_slices(input, slice_shape);
+
+        // The results of the time steps are stored one after another too,
+        // i.e., they are already concatenated along the time dimension.
+        const auto& slice_out_shape = result.first;
+        tensor_shape out_shape = slice_out_shape;
         if (td_output_len_ == 2)
-            concat_axis = 2;
+            out_shape = tensor_shape(len_series, slice_out_shape.depth_);
         else if (td_output_len_ == 3)
-            concat_axis = 1;
+            out_shape = tensor_shape(len_series,
+                slice_out_shape.width_, slice_out_shape.depth_);
         else if (td_output_len_ == 4)
-            concat_axis = 3;
+            out_shape = tensor_shape(len_series, slice_out_shape.height_,
+                slice_out_shape.width_, slice_out_shape.depth_);
         else if (td_output_len_ == 5)
-            concat_axis = 4;
+            out_shape = tensor_shape(len_series, slice_out_shape.size_dim_4_,
+                slice_out_shape.height_, slice_out_shape.width_,
+                slice_out_shape.depth_);
         else
             raise_error("invalid output dim for TimeDistributed");
 
-        for (std::size_t i = 0; i < len_series; ++i)
-        {
-            const auto curr_result = inner_layer_->apply({slices[i]});
-            result_time_step.push_back(curr_result.front());
-        }
-
-        if (concat_axis == 1)
-        {
-            return {concatenate_tensors_height(result_time_step)};
-        }
-        if (concat_axis == 2)
-        {
-            return {concatenate_tensors_width(result_time_step)};
-        }
-        if (concat_axis == 3)
-        {
-            return {concatenate_tensors_dim4(result_time_step)};
-        }
-        if (concat_axis == 4)
-        {
-            return {concatenate_tensors_dim5(result_time_step)};
-        }
-        raise_error("Invalid concat_axis in time_distributed_layer.");
-        return {};
+        return {tensor(out_shape, result.second)};
     }
 
     const layer_ptr inner_layer_;
@@ -0,0 +1,65 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/weight_matrix.hpp"
+#include "fdeep/weights_storage.hpp"
+
+#include <cstddef>
+#include <memory>
+
+namespace fdeep { namespace internal
+{
+
+// Low-rank weights (see convert_model.py --low-rank):
+// W (n_in, n_out) is stored as the product of U (n_in, rank)
+// and V (rank, n_out), a truncated singular value decomposition,
+// so a product with it needs rank * (n_in + n_out) instead of
+// n_in * n_out multiplications (and weights to be read).
+class low_rank_weight_matrix : public weight_matrix
+{
+public:
+    // U and V are given row-major, like the kernels of dense layers.
+    low_rank_weight_matrix(const weights_storage& u, const weights_storage& v,
+        const weights_storage& bias) :
+        weight_matrix(v.size() == 0 ? 0 : u.size() * bias.size() / v.size(),
+            bias.size()),
+        rank_(checked_rank(u, v, bias)),
+        u_(u, weights_storage(float_vec(rank_, 0)), false),
+        v_(v, bias, false)
+    {
+    }
+    void apply_columns(const float_type* in, std::size_t rows,
+        std::size_t first_col, std::size_t n_cols,
+        float_type* out) const override
+    {
+        check_columns(first_col, n_cols);
+        float_vec projected(rows * rank_);
+        u_.apply(in, rows, projected.data());
+        v_.apply_columns(projected.data(), rows, first_col, n_cols, out);
+    }
+    std::size_t rank() const
+    {
+        return rank_;
+    }
+private:
+    static std::size_t checked_rank(const weights_storage& u,
+        const weights_storage& v, const weights_storage& bias)
+    {
+        const std::size_t rank = bias.size() == 0 ? 0 : v.size() / bias.size();
+        assertion(rank > 0 && v.size() == rank * bias.size() &&
+            u.size() % rank == 0, "invalid low-rank weights");
+        return rank;
+    }
+    std::size_t rank_;
+    float_weight_matrix u_;
+    float_weight_matrix v_;
+};
+
+} } // namespace fdeep, namespace internal
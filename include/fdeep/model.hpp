@@ -8,16 +8,77 @@
 
 #include "fdeep/import_model.hpp"
 #include "fdeep/common.hpp"
+#include "fdeep/dead_channels.hpp"
 #include "fdeep/layers/layer.hpp"
+#include "fdeep/model_cache.hpp"
 #include "fdeep/tensor.hpp"
 
 #include <algorithm>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
 #include <string>
 #include <vector>
 
 namespace fdeep
 {
 
+class model;
+
+namespace internal
+{
+// When to run the test cases contained in a model file.
+enum class verification_mode { none, before_returning, in_background };
+
+inline verification_mode verify_before_returning(bool verify)
+{
+    return verify ? verification_mode::before_returning : verification_mode::none;
+}
+
+static const std::size_t all_test_cases =
+    std::numeric_limits<std::size_t>::max();
+
+model read_model_from_json(nlohmann::json& json_data,
+    const std::shared_ptr<blob_table>& blobs,
+    verification_mode verify,
+    std::size_t max_test_cases,
+    const std::function<void(std::string)>& logger,
+    float_type verify_epsilon,
+    const layer_creators& custom_layer_creators,
+    const std::shared_ptr<const mapped_file>& weights_file,
+    bool lazy_layers,
+    bool remove_dead_channels);
+}
+
+// Recurrent states of stateful layers for one input stream.
+// Create one per stream with model::create_session.
+// Multiple sessions of the same model are independent of each other,
+// and can be used from different threads simultaneously.
+class model_session
+{
+public:
+    model_session(const model_session&) = default;
+    model_session& operator=(const model_session&) = default;
+    model_session(model_session&&) = default;
+    model_session& operator=(model_session&&) = default;
+
+    void reset_states()
+    {
+        states_.clear();
+    }
+
+private:
+    explicit model_session(const internal::layer* model_layer) :
+        model_layer_(model_layer), states_(), validated_frame_size_(0) {}
+
+    friend class model;
+    const internal::layer* model_layer_;
+    internal::state_dict states_;
+    std::size_t validated_frame_size_;
+};
+
 class model
 {
 public:
@@ -32,9 +93,53 @@ public:
     }
 
     // A single forward pass, supporting stateful models.
+    // The recurrent states are kept in the model itself,
+    // so it can only serve one input stream at a time.
     tensors predict_stateful(const tensors& inputs)
     {
-        return predict_impl(inputs);
+        return predict_stateful(default_session_, inputs);
+    }
+
+    // A single forward pass, supporting stateful models.
+    // The recurrent states are read from and written to the given session.
+    // The weights are shared, so one model can serve many input streams,
+    // also concurrently, as long as each thread uses its own session.
+    tensors predict_stateful(model_session& session,
+        const tensors& inputs) const
+    {
+        internal::assertion(session.model_layer_ == model_layer_.get(),
+            "Session was created by a different model.");
+        return predict_impl(inputs, session.states_);
+    }
+
+    // Streaming inference for models with one sequence input.
+    // Feeds a single time step (frame) through the model,
+    // continuing with the recurrent states stored in the session.
+    // The frame holds the features of one time step,
+    // i.e., its shape is (n_features) or (1, n_features).
+    // Inputs and outputs are only validated on the first step
+    // of a session, and whenever the frame size changes.
+    tensors step(model_session& session, const tensor& frame) const
+    {
+        internal::assertion(session.model_layer_ == model_layer_.get(),
+            "Session was created by a different model.");
+        const std::size_t frame_size = frame.shape().volume();
+        // Shares the values of the frame instead of copying them.
+        const tensors inputs = {
+            tensor(tensor_shape(1, frame_size), frame.as_vector())};
+        if (session.validated_frame_size_ == frame_size)
+        {
+            return model_layer_->apply(inputs, session.states_);
+        }
+        const auto outputs = predict_impl(inputs, session.states_);
+        session.validated_frame_size_ = frame_size;
+        return outputs;
+    }
+
+    // Creates a session with all recurrent states set to zero.
+    model_session create_session() const
+    {
+        return model_session(model_layer_.get());
     }
 
     // Forward pass multiple data.
@@ -59,6 +164,34 @@ public:
         }
     }
 
+    // Forward pass multiple data in one go.
+    // In contrast to predict_multi, all samples are passed
+    // through the model together, layer by layer.
+    // Recurrent layers (LSTM, GRU) use this to advance all sequences
+    // in lockstep, with one matrix-matrix product per time step
+    // instead of one vector-matrix product per sequence.
+    // The sequences are allowed to differ in length.
+    std::vector<tensors> predict_batch(
+        const std::vector<tensors>& inputs_vec) const
+    {
+        internal::assertion(!is_stateful(),
+            "Batch prediction is not supported on stateful models.");
+        if (inputs_vec.empty())
+        {
+            return {};
+        }
+        for (const auto& inputs : inputs_vec)
+        {
+            check_input_shapes(inputs);
+        }
+        const auto outputs_vec = model_layer_->apply_batch(inputs_vec);
+        for (const auto& outputs : outputs_vec)
+        {
+            check_output_shapes(outputs);
+        }
+        return outputs_vec;
+    }
+
     // Convenience wrapper around predict for models with
     // single tensor outputs of shape (1, 1, z).
     // Suitable for classification models with more than one output neuron.
@@ -162,9 +295,10 @@ public:
         return hash_;
     }
 
+    // Resets the states used by predict_stateful without a session.
     void reset_states()
     {
-        model_layer_->reset_states();
+        default_session_.reset_states();
     }
 
     bool is_stateful() const
@@ -172,41 +306,81 @@ public:
         return model_layer_->is_stateful();
     }
 
+    // Creates all layers of a model loaded with load_model_binary_lazy now,
+    // instead of when they are used for the first time,
+    // e.g., to warm up a server before it takes requests.
+    // Does nothing for models loaded otherwise.
+    void materialize_layers() const
+    {
+        model_layer_->materialize();
+    }
+
+    // Outcome of running the test cases in the background
+    // (see load_model_verified_in_background).
+    // get() waits for them to finish, and throws if one of them failed.
+    // Not valid (see std::shared_future::valid) for models loaded otherwise.
+    const std::shared_future<void>& verification() const
+    {
+        return verification_;
+    }
+
 private:
     model(const internal::layer_ptr& model_layer,
         const std::vector<tensor_shape_variable>& input_shapes,
         const std::vector<tensor_shape_variable>& output_shapes,
-        const std::string& hash) :
+        const std::string& hash,
+        const std::shared_ptr<const internal::mapped_file>& weights_file) :
             input_shapes_(input_shapes),
             output_shapes_(output_shapes),
             model_layer_(model_layer),
-            hash_(hash) {}
-
-    friend model read_model(std::istream&, bool,
+            hash_(hash),
+            default_session_(model_layer.get()),
+            weights_file_(weights_file),
+            verification_() {}
+
+    friend model internal::read_model_from_json(nlohmann::json&,
+        const std::shared_ptr<internal::blob_table>&,
+        internal::verification_mode, std::size_t,
         const std::function<void(std::string)>&, float_type,
-        const internal::layer_creators&);
+        const internal::layer_creators&,
+        const std::shared_ptr<const internal::mapped_file>&, bool, bool);
 
-    tensors predict_impl(const tensors& inputs) const {
+    void check_input_shapes(const tensors& inputs) const
+    {
         const auto input_shapes = fplus::transform(
             fplus_c_mem_fn_t(tensor, shape, tensor_shape),
             inputs);
-        internal::assertion(input_shapes
-            == get_input_shapes(),
-            std::string("Invalid inputs shape.\n") +
+        if (!(input_shapes == get_input_shapes()))
+        {
+            internal::raise_error(std::string("Invalid inputs shape.\n") +
                 "The model takes " + show_tensor_shapes_variable(get_input_shapes()) +
                 " but provided was: " + show_tensor_shapes(input_shapes));
+        }
+    }
 
-        const auto outputs = model_layer_->apply(inputs);
-
+    void check_output_shapes(const tensors& outputs) const
+    {
         const auto output_shapes = fplus::transform(
             fplus_c_mem_fn_t(tensor, shape, tensor_shape),
             outputs);
-        internal::assertion(output_shapes
-            == get_output_shapes(),
-            std::string("Invalid outputs shape.\n") +
+        if (!(output_shapes == get_output_shapes()))
+        {
+            internal::raise_error(std::string("Invalid outputs shape.\n") +
                 "The model should return " + show_tensor_shapes_variable(get_output_shapes()) +
                 " but actually returned: " + show_tensor_shapes(output_shapes));
+        }
+    }
 
+    tensors predict_impl(const tensors& inputs) const {
+        internal::state_dict states;
+        return predict_impl(inputs, states);
+    }
+
+    tensors predict_impl(const tensors& inputs,
+        internal::state_dict& states) const {
+        check_input_shapes(inputs);
+        const auto outputs = model_layer_->apply(inputs, states);
+        check_output_shapes(outputs);
         return outputs;
     }
 
@@ -240,6 +414,10 @@ private:
     std::vector<tensor_shape_variable> output_shapes_;
     internal::layer_ptr model_layer_;
     std::string hash_;
+    model_session default_session_;
+    // Binary model file the layers borrow their weights from, if any.
+    std::shared_ptr<const internal::mapped_file> weights_file_;
+    std::shared_future<void> verification_;
 };
 
 // Write an std::string to std::cout.
@@ -248,124 +426,556 @@ inline void cout_logger(const std::string& str)
     std::cout << str << std::flush;
 }
 
-// Load and construct an fdeep::model from an istream
-// providing the exported json content.
-// Throws an exception if a problem occurs.
-inline model read_model(std::istream& model_file_stream,
-    bool verify = true,
-    const std::function<void(std::string)>& logger = cout_logger,
-    float_type verify_epsilon = static_cast<float_type>(0.0001),
-    const internal::layer_creators& custom_layer_creators = internal::layer_creators())
+namespace internal
+{
+
+// Logs the loading steps of a model together with their durations.
+class loading_logger
 {
-    const auto log = [&logger](const std::string& msg)
+public:
+    explicit loading_logger(const std::function<void(std::string)>& logger) :
+        logger_(logger), stopwatch_()
+    {
+    }
+    void log(const std::string& msg)
     {
-        if (logger)
+        if (logger_)
         {
-            logger(msg + "\n");
+            logger_(msg + "\n");
         }
-    };
-
-    fplus::stopwatch stopwatch;
-
-    const auto log_sol = [&stopwatch, &logger](const std::string& msg)
+    }
+    void log_start(const std::string& msg)
     {
-        stopwatch.reset();
-        if (logger)
+        stopwatch_.reset();
+        if (logger_)
         {
-            logger(msg + " ... ");
+            logger_(msg + " ... ");
         }
-    };
+    }
+    void log_duration()
+    {
+        if (logger_)
+        {
+            logger_("done. elapsed time: " +
+                fplus::show_float(0, 6, stopwatch_.elapsed()) + " s\n");
+        }
+        stopwatch_.reset();
+    }
+private:
+    const std::function<void(std::string)>& logger_;
+    fplus::stopwatch stopwatch_;
+};
 
-    const auto log_duration = [&stopwatch, &logger]()
+// Run the test cases one after another, logging each one if a logger is given.
+// Throws an exception if the outputs do not match.
+inline void run_test_cases(const model& tested_model, const test_cases& tests,
+    float_type verify_epsilon, loading_logger* log)
+{
+    // Stateful models carry their states from one test to the next.
+    auto session = tested_model.create_session();
+    for (std::size_t i = 0; i < tests.size(); ++i)
     {
-        if (logger)
+        if (log)
+        {
+            log->log_start("Running test " + fplus::show(i + 1) +
+                " of " + fplus::show(tests.size()));
+        }
+        const auto output = tested_model.predict_stateful(
+            session, tests[i].input_);
+        if (log)
         {
-            logger("done. elapsed time: " +
-                fplus::show_float(0, 6, stopwatch.elapsed()) + " s\n");
+            log->log_duration();
         }
-        stopwatch.reset();
-    };
+        check_test_outputs(verify_epsilon, output, tests[i].output_);
+    }
+}
+
+// Test cases can be stored in a separate file in the binary format
+// (see convert_model.py --tests-sidecar) instead of in the model itself,
+// so they are only read if the model is verified.
+// The model refers to this file by its path relative to the model file.
+inline void resolve_tests_file_path(nlohmann::json& json_data,
+    const std::string& model_file_path)
+{
+    const auto it = json_data.find("tests_file");
+    if (it == json_data.end())
+    {
+        return;
+    }
+    const std::string tests_file_path = *it;
+    const auto dir_end = model_file_path.find_last_of("/\\");
+    const bool is_absolute = !tests_file_path.empty() &&
+        (tests_file_path.front() == '/' || tests_file_path.front() == '\\' ||
+            tests_file_path.find(':') != std::string::npos);
+    if (dir_end != std::string::npos && !is_absolute)
+    {
+        *it = model_file_path.substr(0, dir_end + 1) + tests_file_path;
+    }
+}
+
+inline test_cases load_test_cases_file(const std::string& path)
+{
+    const mapped_file file(path);
+    const auto layout = parse_binary_model_header(file.data(), file.size());
+    nlohmann::json json_data = nlohmann::json::parse(
+        layout.metadata_begin_, layout.metadata_end_);
+    blob_table blobs;
+    resolve_blobs(json_data, layout, false, blobs);
+    return load_test_cases(json_data["tests"], blobs);
+}
 
-    log_sol("Loading json");
+// The test cases of a model file (in the json or the binary format),
+// embedded or in a separate file, without constructing the model,
+// e.g., to run them on other variants of it.
+inline test_cases load_model_file_test_cases(const std::string& file_path)
+{
     nlohmann::json json_data;
-    model_file_stream >> json_data;
-    log_duration();
+    const mapped_file file(file_path);
+    if (file.size() >= binary_model_header_size &&
+        std::memcmp(file.data(), binary_model_magic, 8) == 0)
+    {
+        const auto layout = parse_binary_model_header(file.data(), file.size());
+        json_data = nlohmann::json::parse(
+            layout.metadata_begin_, layout.metadata_end_);
+        blob_table blobs;
+        resolve_blobs(json_data, layout, false, blobs);
+        if (json_data["tests"].is_array())
+        {
+            return load_test_cases(json_data["tests"], blobs);
+        }
+    }
+    else
+    {
+        std::ifstream in_stream(file_path);
+        assertion(in_stream.good(), "Can not open " + file_path);
+        // The parser owns the decoded values of the test cases.
+        json_model_parser parser(json_data, true, nullptr);
+        parser.parse(in_stream);
+        if (json_data["tests"].is_array())
+        {
+            return load_test_cases(json_data["tests"], *parser.blobs());
+        }
+    }
+    resolve_tests_file_path(json_data, file_path);
+    const auto it_tests_file = json_data.find("tests_file");
+    if (it_tests_file == json_data.end())
+    {
+        return {};
+    }
+    return load_test_cases_file(*it_tests_file);
+}
+
+// Construct an fdeep::model from the already parsed json content
+// and run (up to max_test_cases of) the contained test cases if requested.
+// The arrays in the json content can refer to the given blob table,
+// to which the weights of layers without their dead channels are added.
+// The model keeps the given file alive,
+// in case its layers borrow their weights from it,
+// or, with lazy_layers, create their layers from it later.
+inline model read_model_from_json(nlohmann::json& json_data,
+    const std::shared_ptr<blob_table>& blobs,
+    verification_mode verify,
+    std::size_t max_test_cases,
+    const std::function<void(std::string)>& logger,
+    float_type verify_epsilon,
+    const layer_creators& custom_layer_creators,
+    const std::shared_ptr<const mapped_file>& weights_file,
+    bool lazy_layers,
+    bool remove_dead_channels)
+{
+    loading_logger log(logger);
 
     const std::string image_data_format = json_data["image_data_format"];
-    internal::assertion(image_data_format == "channels_last",
+    assertion(image_data_format == "channels_last",
         "only channels_last data format supported");
 
-    const std::function<nlohmann::json(
-            const std::string&, const std::string&)>
-        get_param = [&json_data]
+    // Lazy layers only read their weights when used.
+    if (remove_dead_channels && !lazy_layers)
+    {
+        const std::size_t removed_channels = eliminate_dead_channels(
+            json_data["architecture"], json_data["trainable_params"], blobs);
+        if (removed_channels > 0)
+        {
+            log.log("Removed " + fplus::show(removed_channels) +
+                " dead channel(s)");
+        }
+    }
+
+    // The layers are created in parallel, so the parameters are only read.
+    const nlohmann::json& params = json_data["trainable_params"];
+    const get_param_f get_param([&params]
         (const std::string& layer_name, const std::string& param_name)
         -> nlohmann::json
     {
-        return json_data["trainable_params"][layer_name][param_name];
-    };
-
-    log_sol("Building model");
-    model full_model(internal::create_model_layer(
+        return get_layer_param(params, layer_name, param_name);
+    }, blobs);
+    // The parameters only refer to the weights in the file.
+    assertion(!lazy_layers || weights_file,
+        "lazy layers need the weights file");
+    const layer_creators creators = lazy_layers
+        ? lazy_layer_creators(custom_layer_creators,
+            std::make_shared<const nlohmann::json>(params), blobs)
+        : custom_layer_creators;
+
+    log.log_start("Building model");
+    model full_model(create_model_layer(
         get_param, json_data["architecture"],
         json_data["architecture"]["config"]["name"],
-        custom_layer_creators),
-        internal::create_tensor_shapes_variable(json_data["input_shapes"]),
-        internal::create_tensor_shapes_variable(json_data["output_shapes"]),
-        internal::json_object_get<std::string, std::string>(
-            json_data, "hash", ""));
-    log_duration();
-
-    if (verify)
+        creators, true),
+        create_tensor_shapes_variable(json_data["input_shapes"]),
+        create_tensor_shapes_variable(json_data["output_shapes"]),
+        json_object_get<std::string, std::string>(
+            json_data, "hash", ""),
+        weights_file);
+    log.log_duration();
+
+    if (verify != verification_mode::none)
     {
-        if (!json_data["tests"].is_array())
+        const bool tests_embedded = json_data["tests"].is_array();
+        const auto it_tests_file = json_data.find("tests_file");
+        if (!tests_embedded && it_tests_file == json_data.end())
         {
-            log("No test cases available");
+            log.log("No test cases available");
         }
         else
         {
-            const auto tests = internal::load_test_cases(json_data["tests"]);
+            if (!tests_embedded)
+            {
+                log.log_start("Loading test cases from " +
+                    it_tests_file->get<std::string>());
+            }
+            const auto tests = fplus::take(max_test_cases, tests_embedded
+                ? load_test_cases(json_data["tests"], *blobs)
+                : load_test_cases_file(*it_tests_file));
+            if (!tests_embedded)
+            {
+                log.log_duration();
+            }
             json_data = {}; // free RAM
-            for (std::size_t i = 0; i < tests.size(); ++i)
+            if (verify == verification_mode::in_background)
+            {
+                // The copy does not refer to the future,
+                // so the task does not keep itself alive.
+                // The logger might not outlive the task, so it is not used.
+                const model tested_model = full_model;
+                log.log("Running " + fplus::show(tests.size()) +
+                    " test(s) in the background");
+                full_model.verification_ = std::async(std::launch::async,
+                    [tested_model, tests, verify_epsilon]()
+                {
+                    run_test_cases(tested_model, tests, verify_epsilon, nullptr);
+                }).share();
+            }
+            else
             {
-                log_sol("Running test " + fplus::show(i + 1) +
-                    " of " + fplus::show(tests.size()));
-                const auto output = full_model.predict_impl(tests[i].input_);
-                log_duration();
-                check_test_outputs(verify_epsilon, output, tests[i].output_);
+                run_test_cases(full_model, tests, verify_epsilon, &log);
             }
         }
-        full_model.reset_states();
     }
 
     return full_model;
 }
 
+// Parse the json content and construct an fdeep::model from it.
+// A separate test cases file is looked up next to the model file,
+// if its path is given, otherwise relative to the working directory.
+// If a cache file path is given, the parsed model is also written to it,
+// in the binary format. Failing to do so is not an error.
+// If a weights pool is given, the model shares weights
+// with the other models loaded using it, where they are identical.
+inline model read_model(std::istream& model_file_stream,
+    const std::string& model_file_path,
+    const std::string& cache_file_path,
+    verification_mode verify,
+    std::size_t max_test_cases,
+    const std::function<void(std::string)>& logger,
+    float_type verify_epsilon,
+    const layer_creators& custom_layer_creators,
+    weights_pool* pool,
+    bool remove_dead_channels)
+{
+    loading_logger log(logger);
+    log.log_start("Loading json");
+    nlohmann::json json_data;
+    // Decodes the weights while parsing, and frees them with the parser,
+    // unless the layers have taken them over.
+    // A cache entry keeps the test cases, because later loads
+    // from it might verify the model, even if this one does not.
+    json_model_parser parser(json_data,
+        verify != verification_mode::none || !cache_file_path.empty(),
+        pool);
+    parser.parse(model_file_stream);
+    log.log_duration();
+
+    if (!cache_file_path.empty())
+    {
+        log.log_start("Writing " + cache_file_path);
+        try
+        {
+            write_binary_model(cache_file_path, json_data, *parser.blobs());
+            log.log_duration();
+        }
+        catch (const std::exception& e)
+        {
+            log.log(std::string("failed: ") + e.what());
+        }
+    }
+
+    // After writing the cache, which refers to the tests file
+    // relative to the model file as well.
+    resolve_tests_file_path(json_data, model_file_path);
+    return read_model_from_json(json_data, parser.blobs(),
+        verify, max_test_cases, logger,
+        verify_epsilon, custom_layer_creators, nullptr, false,
+        remove_dead_channels);
+}
+
+} // namespace internal
+
+// Load and construct an fdeep::model from an istream
+// providing the exported json content.
+// Unless remove_dead_channels is false, output channels of layers
+// with a constant value are removed from the model (see FAQ.md),
+// so its weights are no longer exactly the exported ones.
+// Throws an exception if a problem occurs.
+inline model read_model(std::istream& model_file_stream,
+    bool verify = true,
+    const std::function<void(std::string)>& logger = cout_logger,
+    float_type verify_epsilon = static_cast<float_type>(0.0001),
+    const internal::layer_creators& custom_layer_creators = internal::layer_creators(),
+    bool remove_dead_channels = true)
+{
+    return internal::read_model(model_file_stream, "", "",
+        internal::verify_before_returning(verify), internal::all_test_cases,
+        logger, verify_epsilon, custom_layer_creators, nullptr,
+        remove_dead_channels);
+}
+
 inline model read_model_from_string(const std::string& content,
     bool verify = true,
     const std::function<void(std::string)>& logger = cout_logger,
     float_type verify_epsilon = static_cast<float_type>(0.0001),
     const internal::layer_creators& custom_layer_creators =
-        internal::layer_creators())
+        internal::layer_creators(),
+    bool remove_dead_channels = true)
 {
     std::istringstream content_stream(content);
     return read_model(content_stream, verify, logger, verify_epsilon,
-        custom_layer_creators);
+        custom_layer_creators, remove_dead_channels);
 }
 
 // Load and construct an fdeep::model from file.
+// See read_model for remove_dead_channels.
 // Throws an exception if a problem occurs.
 inline model load_model(const std::string& file_path,
+    bool verify = true,
+    const std::function<void(std::string)>& logger = cout_logger,
+    float_type verify_epsilon = static_cast<float_type>(0.0001),
+    const internal::layer_creators& custom_layer_creators =
+        internal::layer_creators(),
+    bool remove_dead_channels = true)
+{
+    fplus::stopwatch stopwatch;
+    std::ifstream in_stream(file_path);
+    internal::assertion(in_stream.good(), "Can not open " + file_path);
+    const auto model = internal::read_model(in_stream, file_path, "",
+        internal::verify_before_returning(verify), internal::all_test_cases,
+        logger, verify_epsilon, custom_layer_creators, nullptr,
+        remove_dead_channels);
+    if (logger)
+    {
+        const std::string additional_action = verify ? ", testing" : "";
+        logger("Loading, constructing" + additional_action +
+            " of " + file_path + " took " +
+            fplus::show_float(0, 6, stopwatch.elapsed()) + " s overall.\n");
+    }
+    return model;
+}
+
+// Like load_model, but returns without running the test cases.
+// Instead, (up to max_test_cases of) them are run on a background thread,
+// using a separate copy of the model, and the outcome is available
+// via model::verification(), e.g.:
+//     const auto model = fdeep::load_model_verified_in_background(path);
+//     ... // start serving
+//     model.verification().get(); // throws if a test failed
+// The model can be used for predictions in the meantime.
+// Throws an exception if a problem occurs while loading.
+inline model load_model_verified_in_background(const std::string& file_path,
+    std::size_t max_test_cases = internal::all_test_cases,
+    const std::function<void(std::string)>& logger = cout_logger,
+    float_type verify_epsilon = static_cast<float_type>(0.0001),
+    const internal::layer_creators& custom_layer_creators =
+        internal::layer_creators(),
+    bool remove_dead_channels = true)
+{
+    std::ifstream in_stream(file_path);
+    internal::assertion(in_stream.good(), "Can not open " + file_path);
+    return internal::read_model(in_stream, file_path, "",
+        internal::verification_mode::in_background, max_test_cases,
+        logger, verify_epsilon, custom_layer_creators, nullptr,
+        remove_dead_channels);
+}
+
+namespace internal
+{
+
+// A separate test cases file is looked up next to the model file
+// the binary file was created from.
+inline model load_model_binary(const std::string& file_path,
+    const std::string& model_file_path,
+    bool share_weights,
+    bool lazy_layers,
+    bool verify,
+    const std::function<void(std::string)>& logger,
+    float_type verify_epsilon,
+    const layer_creators& custom_layer_creators,
+    bool remove_dead_channels)
+{
+    assertion(std::numeric_limits<float>::is_iec559,
+        "The floating-point format of your system is not supported.");
+    fplus::stopwatch stopwatch;
+    loading_logger log(logger);
+    log.log_start("Mapping binary model");
+    const auto file = std::make_shared<const mapped_file>(file_path);
+    const auto layout = parse_binary_model_header(file->data(), file->size());
+    nlohmann::json json_data = nlohmann::json::parse(
+        layout.metadata_begin_, layout.metadata_end_);
+    const auto blobs = std::make_shared<blob_table>();
+    resolve_blobs(json_data, layout, share_weights, *blobs);
+    resolve_tests_file_path(json_data, model_file_path);
+    log.log_duration();
+
+    const auto model = read_model_from_json(json_data, blobs,
+        verify_before_returning(verify), all_test_cases,
+        logger, verify_epsilon, custom_layer_creators,
+        share_weights || lazy_layers ? file : nullptr, lazy_layers,
+        remove_dead_channels);
+    if (logger)
+    {
+        const std::string additional_action = verify ? ", testing" : "";
+        logger("Loading, constructing" + additional_action +
+            " of " + file_path + " took " +
+            fplus::show_float(0, 6, stopwatch.elapsed()) + " s overall.\n");
+    }
+    return model;
+}
+
+} // namespace internal
+
+// Load and construct an fdeep::model from a file in the binary format
+// (see convert_model.py --binary).
+// The file is memory-mapped, and only the small metadata part is parsed,
+// so the weights are read directly from the mapping without decoding.
+// The layers copy their weights, so the file is no longer needed afterwards.
+// See read_model for remove_dead_channels.
+// Throws an exception if a problem occurs.
+inline model load_model_binary(const std::string& file_path,
+    bool verify = true,
+    const std::function<void(std::string)>& logger = cout_logger,
+    float_type verify_epsilon = static_cast<float_type>(0.0001),
+    const internal::layer_creators& custom_layer_creators =
+        internal::layer_creators(),
+    bool remove_dead_channels = true)
+{
+    return internal::load_model_binary(file_path, file_path, false, false,
+        verify, logger, verify_epsilon, custom_layer_creators,
+        remove_dead_channels);
+}
+
+// Like load_model_binary, but the weights of dense, convolution
+// and recurrent layers are not copied. Instead, the layers use them
+// in place, i.e., directly from the read-only shared file mapping,
+// which is kept alive as long as the model (or a copy of it) exists.
+// Processes loading the same file share one physical copy
+// of these weights (in the page cache of the operating system).
+// The file must not be modified while it is in use.
+// Throws an exception if a problem occurs.
+inline model load_model_binary_mapped(const std::string& file_path,
+    bool verify = true,
+    const std::function<void(std::string)>& logger = cout_logger,
+    float_type verify_epsilon = static_cast<float_type>(0.0001),
+    const internal::layer_creators& custom_layer_creators =
+        internal::layer_creators(),
+    bool remove_dead_channels = true)
+{
+    return internal::load_model_binary(file_path, file_path, true, false,
+        verify, logger, verify_epsilon, custom_layer_creators,
+        remove_dead_channels);
+}
+
+// Like load_model_binary_mapped, but the layers with weights
+// are only created when they are used for the first time,
+// so neither the time nor the memory needed for them is spent
+// on parts of the model that are never used
+// (e.g., auxiliary outputs that are rarely requested).
+// Layers are created at most once,
+// also when the model is used from multiple threads.
+// Verification uses (and thus creates) all layers the test cases need.
+// See model::materialize_layers to create all layers at once.
+// Throws an exception if a problem occurs.
+inline model load_model_binary_lazy(const std::string& file_path,
     bool verify = true,
     const std::function<void(std::string)>& logger = cout_logger,
     float_type verify_epsilon = static_cast<float_type>(0.0001),
     const internal::layer_creators& custom_layer_creators =
         internal::layer_creators())
+{
+    return internal::load_model_binary(file_path, file_path, true, true,
+        verify, logger, verify_epsilon, custom_layer_creators, false);
+}
+
+// Like load_model, but keeps a copy of the model in the binary format
+// in the given (existing) cache directory, and loads it from there
+// (see load_model_binary_mapped) when the same model file is loaded again,
+// e.g., on the next start of the process.
+// This skips parsing the json content and decoding the weights,
+// and lets processes loading the same model share its weights.
+// Cache entries are identified by the content of the model file,
+// the binary format version and the float type.
+// The embedded test cases are always cached,
+// so they are run from the cache entry if verify is true.
+// Outdated entries are not removed.
+// If the cache can not be read or written, the model is loaded normally.
+// Throws an exception if a problem occurs.
+inline model load_model_cached(const std::string& file_path,
+    const std::string& cache_dir,
+    bool verify = true,
+    const std::function<void(std::string)>& logger = cout_logger,
+    float_type verify_epsilon = static_cast<float_type>(0.0001),
+    const internal::layer_creators& custom_layer_creators =
+        internal::layer_creators(),
+    bool remove_dead_channels = true)
 {
     fplus::stopwatch stopwatch;
+    internal::loading_logger log(logger);
+    log.log_start("Looking up " + file_path + " in model cache");
+    const std::string cache_file_path = cache_dir + "/" +
+        internal::model_cache_key(internal::mapped_file(file_path)) +
+        ".fdeepbin";
+    const bool cached = std::ifstream(cache_file_path).good();
+    log.log_duration();
+
+    if (cached)
+    {
+        try
+        {
+            return internal::load_model_binary(cache_file_path, file_path,
+                true, false, verify, logger, verify_epsilon, custom_layer_creators,
+                remove_dead_channels);
+        }
+        catch (const std::exception& e)
+        {
+            log.log("Can not use " + cache_file_path + ": " + e.what());
+        }
+    }
+
     std::ifstream in_stream(file_path);
     internal::assertion(in_stream.good(), "Can not open " + file_path);
-    const auto model = read_model(in_stream, verify, logger, verify_epsilon,
-    custom_layer_creators);
+    const auto model = internal::read_model(in_stream, file_path, cache_file_path,
+        internal::verify_before_returning(verify), internal::all_test_cases,
+        logger, verify_epsilon, custom_layer_creators, nullptr,
+        remove_dead_channels);
     if (logger)
     {
         const std::string additional_action = verify ? ", testing" : "";
@@ -0,0 +1,153 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/binary_model.hpp"
+#include "fdeep/json_model_parser.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace fdeep { namespace internal
+{
+
+// Identifies a JSON model file by its content,
+// along with everything else the cached binary model depends on,
+// i.e., the binary format version and the float type.
+// The model hash is only known after parsing the JSON,
+// which is exactly the work the cache is meant to avoid.
+inline std::string model_cache_key(const mapped_file& file)
+{
+    std::ostringstream key;
+    key << std::hex << hash_binary_data(file.data(), file.size()) << "_v" << std::dec << binary_model_version <<
+        "_f" << sizeof(float_type);
+    return key.str();
+}
+
+typedef std::vector<std::pair<std::size_t, const float_vec*>> float_blobs;
+
+// Replaces the references to decoded float arrays (see json_model_parser)
+// by references to blobs, as described in binary_model.hpp,
+// and collects the arrays along with their blob offsets.
+inline nlohmann::json extract_float_blobs(const nlohmann::json& data,
+    const blob_table& decoded, float_blobs& blobs, std::size_t& blobs_size)
+{
+    if (is_blob_reference(data))
+    {
+        const model_blob& blob = decoded.get_floats(data);
+        assertion(blob.decoded_ != nullptr, "float values not decoded");
+        const float_vec& values = *blob.decoded_;
+        const std::size_t offset = align_binary_model_offset(blobs_size);
+        blobs.emplace_back(offset, &values);
+        blobs_size = offset + values.size() * sizeof(float);
+        return {{"blob_offset", offset}, {"blob_count", values.size()}};
+    }
+    if (data.is_object())
+    {
+        nlohmann::json result = nlohmann::json::object();
+        for (auto it = data.begin(); it != data.end(); ++it)
+        {
+            result[it.key()] = extract_float_blobs(
+                it.value(), decoded, blobs, blobs_size);
+        }
+        return result;
+    }
+    if (data.is_array())
+    {
+        nlohmann::json result = nlohmann::json::array();
+        for (const auto& element : data)
+        {
+            result.push_back(extract_float_blobs(
+                element, decoded, blobs, blobs_size));
+        }
+        return result;
+    }
+    return data;
+}
+
+inline void write_float_blob(std::ostream& stream, const float_vec& values)
+{
+    if (std::is_same<float_type, float>::value)
+    {
+        stream.write(reinterpret_cast<const char*>(values.data()),
+            static_cast<std::streamsize>(values.size() * sizeof(float)));
+        return;
+    }
+    const std::vector<float> converted(values.begin(), values.end());
+    stream.write(reinterpret_cast<const char*>(converted.data()),
+        static_cast<std::streamsize>(converted.size() * sizeof(float)));
+}
+
+// Writes a model, as parsed by the json_model_parser
+// (along with the blob table of the parser),
+// to a file in the binary format.
+// The file is written under a temporary name first and then renamed,
+// so concurrent readers never see an incomplete file.
+inline void write_binary_model(const std::string& path,
+    const nlohmann::json& json_data, const blob_table& decoded)
+{
+    float_blobs blobs;
+    std::size_t blobs_size = 0;
+    const std::string metadata =
+        extract_float_blobs(json_data, decoded, blobs, blobs_size).dump();
+    const std::size_t blobs_offset = align_binary_model_offset(
+        binary_model_header_size + metadata.size());
+
+    const std::string tmp_path =
+        path + ".tmp" + std::to_string(std::random_device()());
+    {
+        std::ofstream stream(tmp_path, std::ios::binary);
+        assertion(stream.good(), "Can not create " + tmp_path);
+        const auto write_value = [&stream](const auto& value)
+        {
+            stream.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        };
+        stream.write(binary_model_magic, 8);
+        write_value(binary_model_version);
+        write_value(binary_model_byte_order_mark);
+        write_value(static_cast<std::uint32_t>(binary_model_blob_alignment));
+        write_value(static_cast<std::uint32_t>(0));
+        write_value(static_cast<std::uint64_t>(metadata.size()));
+        write_value(static_cast<std::uint64_t>(blobs_offset));
+        stream.write(metadata.data(),
+            static_cast<std::streamsize>(metadata.size()));
+        std::size_t position = binary_model_header_size + metadata.size();
+        for (const auto& blob : blobs)
+        {
+            const std::size_t blob_position = blobs_offset + blob.first;
+            stream.write(std::string(blob_position - position, '\0').data(),
+                static_cast<std::streamsize>(blob_position - position));
+            write_float_blob(stream, *blob.second);
+            position = blob_position + blob.second->size() * sizeof(float);
+        }
+        stream.close();
+        if (!stream.good())
+        {
+            std::remove(tmp_path.c_str());
+            raise_error("Can not write " + tmp_path);
+        }
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp_path.c_str());
+        raise_error("Can not rename " + tmp_path + " to " + path);
+    }
+}
+
+} } // namespace fdeep, namespace internal
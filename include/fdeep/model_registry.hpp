@@ -0,0 +1,141 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/model.hpp"
+#include "fdeep/weights_pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fdeep
+{
+
+// Holds the current version of a model in a long-running service,
+// and replaces it with a new version while predictions are running, e.g.:
+//     fdeep::model_registry registry;
+//     registry.load_in_background("model.json").get();
+//     ...
+//     registry.get()->predict(inputs); // in any thread
+//     ...
+//     registry.load_in_background("model.json"); // after an update
+// Replacing the model is atomic.
+// Callers keep using the model they got, so requests in flight
+// finish on the old version, which is freed afterwards.
+// Float32 weights of the json file that are identical in both versions
+// are shared between them (for dense, convolution and recurrent layers
+// using them as they are), so the unchanged layers do not need memory
+// twice during the swap. Other weight formats are not shared (see FAQ.md).
+class model_registry
+{
+public:
+    explicit model_registry(
+        const std::function<void(std::string)>& logger = cout_logger,
+        float_type verify_epsilon = static_cast<float_type>(0.0001),
+        const internal::layer_creators& custom_layer_creators =
+            internal::layer_creators()) :
+        logger_(logger),
+        verify_epsilon_(verify_epsilon),
+        custom_layer_creators_(custom_layer_creators),
+        pool_(std::make_shared<internal::weights_pool>()),
+        current_(),
+        mutex_(),
+        requested_version_(0),
+        current_version_(0),
+        loads_()
+    {
+    }
+    model_registry(const model_registry&) = delete;
+    model_registry& operator=(const model_registry&) = delete;
+
+    // Waits for the models still being loaded.
+    ~model_registry()
+    {
+        for (const auto& load : loads_)
+        {
+            load.wait();
+        }
+    }
+
+    // The current model, or nullptr if none has been set yet.
+    std::shared_ptr<const model> get() const
+    {
+        return std::atomic_load(&current_);
+    }
+
+    // Replaces the current model with one loaded otherwise.
+    void set(const model& new_model)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        install(std::make_shared<const model>(new_model), ++requested_version_);
+    }
+
+    // Loads a model from a json file (see load_model) in the background,
+    // and replaces the current model with it when done,
+    // unless a model requested later has been set in the meantime.
+    // The returned future throws if loading or verification failed,
+    // in which case the current model is kept.
+    std::shared_future<void> load_in_background(const std::string& file_path,
+        bool verify = true, bool remove_dead_channels = true)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const std::size_t version = ++requested_version_;
+        loads_.erase(std::remove_if(loads_.begin(), loads_.end(),
+            [](const std::shared_future<void>& load)
+            {
+                return load.wait_for(std::chrono::seconds(0)) ==
+                    std::future_status::ready;
+            }), loads_.end());
+        loads_.push_back(std::async(std::launch::async,
+            [this, file_path, verify, remove_dead_channels, version]()
+        {
+            std::ifstream in_stream(file_path);
+            internal::assertion(in_stream.good(), "Can not open " + file_path);
+            const auto new_model = std::make_shared<const model>(
+                internal::read_model(in_stream, file_path, "",
+                    internal::verify_before_returning(verify),
+                    internal::all_test_cases, logger_, verify_epsilon_,
+                    custom_layer_creators_, pool_.get(), remove_dead_channels));
+            std::lock_guard<std::mutex> install_lock(mutex_);
+            install(new_model, version);
+        }).share());
+        return loads_.back();
+    }
+
+private:
+    void install(const std::shared_ptr<const model>& new_model,
+        std::size_t version)
+    {
+        if (version > current_version_)
+        {
+            std::atomic_store(&current_, new_model);
+            current_version_ = version;
+        }
+    }
+
+    const std::function<void(std::string)> logger_;
+    const float_type verify_epsilon_;
+    const internal::layer_creators custom_layer_creators_;
+    const std::shared_ptr<internal::weights_pool> pool_;
+    std::shared_ptr<const model> current_;
+    std::mutex mutex_;
+    std::size_t requested_version_;
+    std::size_t current_version_;
+    std::vector<std::shared_future<void>> loads_;
+};
+
+} // namespace fdeep
@@ -37,12 +37,28 @@ using node_connections = std::vector<node_connection>;
 using output_dict = std::map<std::pair<std::string, std::size_t>, tensors>;
 
 class layer;
+
+// Recurrent states of stateful layers.
+// They are kept outside of the layers,
+// so one model can be used for multiple independent input streams.
+using state_dict = std::map<const layer*, tensors>;
+
+// Outputs of multiple samples, indexed by sample first.
+using output_batch_dict =
+    std::map<std::pair<std::string, std::size_t>, tensors_vec>;
+
 typedef std::shared_ptr<layer> layer_ptr;
 typedef std::vector<layer_ptr> layer_ptrs;
 layer_ptr get_layer(const layer_ptrs& layers, const std::string& layer_id);
 tensor get_layer_output(const layer_ptrs& layers, output_dict& output_cache,
+    state_dict& states,
+    const layer_ptr& layer, std::size_t node_idx, std::size_t tensor_idx);
+tensors get_layer_output_batch(const layer_ptrs& layers,
+    output_batch_dict& output_cache,
     const layer_ptr& layer, std::size_t node_idx, std::size_t tensor_idx);
-tensors apply_layer(const layer& layer, const tensors& inputs);
+tensors apply_layer(const layer& layer, const tensors& inputs,
+    state_dict& states);
+tensors_vec apply_layer_batch(const layer& layer, const tensors_vec& inputs);
 
 class node
 {
@@ -52,17 +68,46 @@ public:
     {
     }
     tensors get_output(const layer_ptrs& layers, output_dict& output_cache,
-        const layer& layer) const
+        state_dict& states, const layer& layer) const
     {
-        const auto get_input = [&output_cache, &layers]
+        const auto get_input = [&output_cache, &states, &layers]
             (const node_connection& conn) -> tensor
         {
-            return get_layer_output(layers, output_cache,
+            return get_layer_output(layers, output_cache, states,
                 get_layer(layers, conn.layer_id_),
                 conn.node_idx_, conn.tensor_idx_);
         };
         return apply_layer(layer,
-            fplus::transform(get_input, inbound_connections_));
+            fplus::transform(get_input, inbound_connections_), states);
+    }
+    tensors_vec get_output_batch(const layer_ptrs& layers,
+        output_batch_dict& output_cache,
+        const layer& layer) const
+    {
+        const auto get_input = [&output_cache, &layers]
+            (const node_connection& conn) -> tensors
+        {
+            return get_layer_output_batch(layers, output_cache,
+                get_layer(layers, conn.layer_id_),
+                conn.node_idx_, conn.tensor_idx_);
+        };
+        // Inputs are collected per connection,
+        // but the layer needs them per sample.
+        const auto inputs_per_connection =
+            fplus::transform(get_input, inbound_connections_);
+        assertion(!inputs_per_connection.empty(), "node without inputs");
+        const std::size_t batch_size = inputs_per_connection.front().size();
+        tensors_vec inputs_per_sample(batch_size);
+        for (const auto& connection_inputs : inputs_per_connection)
+        {
+            assertion(connection_inputs.size() == batch_size,
+                "invalid batch size");
+            for (std::size_t i = 0; i < batch_size; ++i)
+            {
+                inputs_per_sample[i].push_back(connection_inputs[i]);
+            }
+        }
+        return apply_layer_batch(layer, inputs_per_sample);
     }
 private:
     node_connections inbound_connections_;
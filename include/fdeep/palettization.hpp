@@ -0,0 +1,210 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/half_precision.hpp"
+#include "fdeep/weight_matrix.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace fdeep { namespace internal
+{
+
+// Palettized weights (see convert_model.py --palettize-4bit):
+// The weights of a layer are clustered into up to 16 values (the palette),
+// and each weight is stored as the 4-bit index of its palette entry,
+// two per byte (the first one in the lower half).
+// This needs an eighth of the memory (and memory bandwidth) of floats.
+static const std::size_t palette_size = 16;
+
+inline std::size_t palette_row_bytes(std::size_t n)
+{
+    return (n + 1) / 2;
+}
+
+inline std::uint8_t palette_index(const std::uint8_t* packed, std::size_t i)
+{
+    return static_cast<std::uint8_t>((packed[i / 2] >> (4 * (i % 2))) & 0xf);
+}
+
+#if defined(__AVX2__)
+// The palette, as two registers with 8 entries each.
+struct palette_registers
+{
+    __m256 low_;
+    __m256 high_;
+};
+
+inline palette_registers load_palette_registers(const float* palette)
+{
+    return {_mm256_loadu_ps(palette), _mm256_loadu_ps(palette + 8)};
+}
+
+// Looks up the palette values of 8 indices, read from 4 bytes.
+inline __m256 lookup_palette_8(const palette_registers& palette,
+    const std::uint8_t* packed)
+{
+    // Broadcasting from memory avoids a transfer from a general register.
+    float bits;
+    std::memcpy(&bits, packed, sizeof(bits));
+    // The permutations only use the lower bits of the shifted values,
+    // so the higher indices in them do not need to be masked out.
+    const __m256i indices = _mm256_srlv_epi32(
+        _mm256_castps_si256(_mm256_broadcast_ss(&bits)),
+        _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28));
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+    return _mm256_permutex2var_ps(palette.low_, indices, palette.high_);
+#else
+    // permutevar8x32 uses the lower 3 bits of the indices,
+    // bit 3 selects one of the two results.
+    return _mm256_blendv_ps(
+        _mm256_permutevar8x32_ps(palette.low_, indices),
+        _mm256_permutevar8x32_ps(palette.high_, indices),
+        _mm256_castsi256_ps(_mm256_slli_epi32(indices, 28)));
+#endif
+}
+#endif
+
+inline void decode_palette_row(const std::uint8_t* packed, std::size_t n,
+    const float_vec& palette, float_type* dest)
+{
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    if (std::is_same<float_type, float>::value)
+    {
+        const palette_registers registers = load_palette_registers(
+            reinterpret_cast<const float*>(palette.data()));
+        float* dest_float = reinterpret_cast<float*>(dest);
+        for (; i + 8 <= n; i += 8)
+        {
+            _mm256_storeu_ps(dest_float + i,
+                lookup_palette_8(registers, packed + i / 2));
+        }
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        dest[i] = palette[palette_index(packed, i)];
+    }
+}
+
+// Dot products of one input row with four rows of palette indices,
+// looked up in registers, so the weights are read only once.
+inline void dot_palette_x4(const float_type* a,
+    const std::uint8_t* const* w, std::size_t n,
+    const float_vec& palette, float_type* dest)
+{
+    std::size_t i = 0;
+    float_type sums[4] = {0, 0, 0, 0};
+#if defined(__AVX2__)
+    if (std::is_same<float_type, float>::value)
+    {
+        const float* a_float = reinterpret_cast<const float*>(a);
+        const palette_registers registers = load_palette_registers(
+            reinterpret_cast<const float*>(palette.data()));
+        // Two accumulators per row, to hide the latency of the additions.
+        __m256 acc[8];
+        for (std::size_t k = 0; k < 8; ++k)
+        {
+            acc[k] = _mm256_setzero_ps();
+        }
+        for (; i + 16 <= n; i += 16)
+        {
+            const __m256 a_i = _mm256_loadu_ps(a_float + i);
+            const __m256 a_i_8 = _mm256_loadu_ps(a_float + i + 8);
+            for (std::size_t k = 0; k < 4; ++k)
+            {
+                acc[k] = multiply_add_float(a_i,
+                    lookup_palette_8(registers, w[k] + i / 2), acc[k]);
+                acc[k + 4] = multiply_add_float(a_i_8,
+                    lookup_palette_8(registers, w[k] + i / 2 + 4), acc[k + 4]);
+            }
+        }
+        for (std::size_t k = 0; k < 4; ++k)
+        {
+            sums[k] = static_cast<float_type>(horizontal_sum_float(
+                _mm256_add_ps(acc[k], acc[k + 4])));
+        }
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        for (std::size_t k = 0; k < 4; ++k)
+        {
+            sums[k] += a[i] * palette[palette_index(w[k], i)];
+        }
+    }
+    std::copy_n(sums, 4, dest);
+}
+
+// Stores W transposed, i.e., one row per output channel,
+// as palette indices (see apply_compact_weight_rows).
+class palette_weight_matrix : public weight_matrix
+{
+public:
+    // The indices are given as (n_out, n_in), with each row packed
+    // into palette_row_bytes(n_in) bytes.
+    palette_weight_matrix(std::vector<std::uint8_t>&& packed_indices,
+        std::size_t n_in, const float_vec& palette, const float_vec& bias) :
+        weight_matrix(n_in, bias.size()),
+        row_bytes_(palette_row_bytes(n_in)),
+        packed_indices_(std::move(packed_indices)),
+        palette_(palette),
+        bias_(bias)
+    {
+        assertion(packed_indices_.size() == n_out() * row_bytes_,
+            "invalid number of palette indices");
+        assertion(!palette_.empty() && palette_.size() <= palette_size,
+            "invalid palette size");
+        // Unused entries are never looked up,
+        // but the kernels always load all of them.
+        palette_.resize(palette_size, 0);
+    }
+    void apply_columns(const float_type* in, std::size_t rows,
+        std::size_t first_col, std::size_t n_cols,
+        float_type* out) const override
+    {
+        check_columns(first_col, n_cols);
+        apply_compact_weight_rows(n_in(), bias_, in, rows, first_col, n_cols, out,
+            [this](std::size_t j, std::size_t count, float_type* dest)
+            {
+                for (std::size_t k = 0; k < count; ++k)
+                {
+                    decode_palette_row(row(j + k), n_in(), palette_,
+                        dest + k * n_in());
+                }
+            },
+            [this](const float_type* in_row, const std::size_t* js, float_type* dest)
+            {
+                const std::uint8_t* w[4] = {
+                    row(js[0]), row(js[1]), row(js[2]), row(js[3])};
+                dot_palette_x4(in_row, w, n_in(), palette_, dest);
+            });
+    }
+private:
+    const std::uint8_t* row(std::size_t j) const
+    {
+        return packed_indices_.data() + j * row_bytes_;
+    }
+    std::size_t row_bytes_;
+    std::vector<std::uint8_t> packed_indices_;
+    float_vec palette_;
+    float_vec bias_;
+};
+
+} } // namespace fdeep, namespace internal
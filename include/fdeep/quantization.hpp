@@ -0,0 +1,230 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/weight_matrix.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace fdeep { namespace internal
+{
+
+// Symmetric int8 quantization: value = scale * q, with q in [-127, 127].
+// Weights have one scale per output channel (see convert_model.py),
+// inputs one per row, determined when it is multiplied
+// (dynamic quantization), so no calibration is needed for them.
+
+// Quantized rows are padded with zeros to a multiple of this length,
+// so the kernels can process them in whole SIMD registers.
+static const std::size_t int8_row_alignment = 32;
+
+inline std::size_t int8_padded_size(std::size_t n)
+{
+    return (n + int8_row_alignment - 1) / int8_row_alignment *
+        int8_row_alignment;
+}
+
+inline std::int8_t quantize_int8(float_type value, float_type inv_scale)
+{
+    const float_type scaled = value * inv_scale;
+    return static_cast<std::int8_t>(static_cast<int>(
+        scaled + (scaled < 0 ? static_cast<float_type>(-0.5)
+                             : static_cast<float_type>(0.5))));
+}
+
+// Quantizes n values into dest, which has room for the padded size.
+// Returns the scale.
+inline float_type quantize_int8_row(const float_type* values, std::size_t n,
+    std::int8_t* dest)
+{
+    float_type max_abs = 0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        max_abs = std::max(max_abs, std::abs(values[i]));
+    }
+    std::fill(dest + n, dest + int8_padded_size(n), static_cast<std::int8_t>(0));
+    if (max_abs == 0)
+    {
+        std::fill(dest, dest + n, static_cast<std::int8_t>(0));
+        return 0;
+    }
+    const float_type inv_scale = static_cast<float_type>(127) / max_abs;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        dest[i] = quantize_int8(values[i], inv_scale);
+    }
+    return max_abs / static_cast<float_type>(127);
+}
+
+#if defined(__AVX2__)
+// Products of int8 values can only be accumulated in 8-bit SIMD registers
+// (maddubs, dpbusd) if one factor is unsigned,
+// so the sign of the input values is moved to the weights:
+// a * w = |a| * (sign(a) * w).
+// With both in [-127, 127], the pairwise sums of maddubs can not saturate.
+inline __m256i multiply_add_int8(__m256i acc, __m256i abs_a, __m256i a,
+    __m256i w)
+{
+    const __m256i signed_w = _mm256_sign_epi8(w, a);
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+    return _mm256_dpbusd_epi32(acc, abs_a, signed_w);
+#elif defined(__AVXVNNI__)
+    return _mm256_dpbusd_avx_epi32(acc, abs_a, signed_w);
+#else
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(
+        _mm256_maddubs_epi16(abs_a, signed_w), _mm256_set1_epi16(1)));
+#endif
+}
+
+inline std::int32_t horizontal_sum_int32(__m256i values)
+{
+    const __m128i sum_4 = _mm_add_epi32(_mm256_castsi256_si128(values),
+        _mm256_extracti128_si256(values, 1));
+    const __m128i sum_2 = _mm_add_epi32(sum_4,
+        _mm_shuffle_epi32(sum_4, _MM_SHUFFLE(1, 0, 3, 2)));
+    const __m128i sum_1 = _mm_add_epi32(sum_2,
+        _mm_shuffle_epi32(sum_2, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum_1);
+}
+#endif
+
+// Dot products of one padded input row with four padded weight rows.
+inline void dot_int8_x4(const std::int8_t* a, const std::int8_t* const* w,
+    std::size_t padded_size, std::int32_t* dest)
+{
+#if defined(__AVX2__)
+    __m256i acc[4] = {_mm256_setzero_si256(), _mm256_setzero_si256(),
+        _mm256_setzero_si256(), _mm256_setzero_si256()};
+    for (std::size_t i = 0; i < padded_size; i += 32)
+    {
+        const __m256i a_i = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(a + i));
+        const __m256i abs_a_i = _mm256_sign_epi8(a_i, a_i);
+        for (std::size_t k = 0; k < 4; ++k)
+        {
+            acc[k] = multiply_add_int8(acc[k], abs_a_i, a_i,
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w[k] + i)));
+        }
+    }
+    for (std::size_t k = 0; k < 4; ++k)
+    {
+        dest[k] = horizontal_sum_int32(acc[k]);
+    }
+#else
+    for (std::size_t k = 0; k < 4; ++k)
+    {
+        std::int32_t acc = 0;
+        for (std::size_t i = 0; i < padded_size; ++i)
+        {
+            acc += static_cast<std::int32_t>(a[i]) *
+                static_cast<std::int32_t>(w[k][i]);
+        }
+        dest[k] = acc;
+    }
+#endif
+}
+
+// Stores W transposed, i.e., one row per output channel,
+// quantized to int8 with one scale per row.
+// The products are accumulated in int32,
+// and scaled back (plus bias) per output value.
+class int8_weight_matrix : public weight_matrix
+{
+public:
+    // The values are given as (n_out, n_in) row-major.
+    int8_weight_matrix(const std::vector<std::int8_t>& values,
+        const float_vec& scales, const float_vec& bias) :
+        weight_matrix(values.size() / bias.size(), bias.size()),
+        padded_n_in_(int8_padded_size(n_in())),
+        values_(n_out() * padded_n_in_, 0),
+        scales_(scales),
+        bias_(bias)
+    {
+        assertion(values.size() % bias.size() == 0, "invalid weight count");
+        assertion(scales.size() == n_out(), "invalid number of scales");
+        for (std::size_t j = 0; j < n_out(); ++j)
+        {
+            std::copy_n(values.begin() +
+                static_cast<std::ptrdiff_t>(j * n_in()),
+                n_in(), values_.begin() +
+                    static_cast<std::ptrdiff_t>(j * padded_n_in_));
+        }
+    }
+    void apply_columns(const float_type* in, std::size_t rows,
+        std::size_t first_col, std::size_t n_cols,
+        float_type* out) const override
+    {
+        check_columns(first_col, n_cols);
+        const std::size_t end_col = first_col + n_cols;
+        std::vector<std::int8_t> in_row(padded_n_in_);
+        for (std::size_t r = 0; r < rows; ++r)
+        {
+            const float_type in_scale = quantize_int8_row(
+                in + r * n_in(), n_in(), in_row.data());
+            float_type* out_row = out + r * n_cols;
+            for (std::size_t j = first_col; j < end_col; j += 4)
+            {
+                // The last group repeats the last row if needed.
+                const std::int8_t* w[4];
+                for (std::size_t k = 0; k < 4; ++k)
+                {
+                    w[k] = row(std::min(j + k, end_col - 1));
+                }
+                std::int32_t sums[4];
+                dot_int8_x4(in_row.data(), w, padded_n_in_, sums);
+                for (std::size_t k = 0; k < 4 && j + k < end_col; ++k)
+                {
+                    out_row[j + k - first_col] = static_cast<float_type>(sums[k]) *
+                        in_scale * scales_[j + k] + bias_[j + k];
+                }
+            }
+        }
+    }
+private:
+    const std::int8_t* row(std::size_t j) const
+    {
+        return values_.data() + j * padded_n_in_;
+    }
+    std::size_t padded_n_in_;
+    std::vector<std::int8_t> values_;
+    float_vec scales_;
+    float_vec bias_;
+};
+
+// Quantizes float weights, given as (n_out, n_in) row-major,
+// e.g., to compare the accuracy of a model with and without quantization.
+inline weight_matrix_ptr quantize_weight_matrix_int8(
+    const float_vec& values, const float_vec& bias)
+{
+    assertion(!bias.empty() && values.size() % bias.size() == 0,
+        "invalid weight count");
+    const std::size_t n_in = values.size() / bias.size();
+    std::vector<std::int8_t> quantized(values.size());
+    float_vec scales;
+    scales.reserve(bias.size());
+    std::vector<std::int8_t> padded_row(int8_padded_size(n_in));
+    for (std::size_t j = 0; j < bias.size(); ++j)
+    {
+        scales.push_back(quantize_int8_row(values.data() + j * n_in, n_in,
+            padded_row.data()));
+        std::copy_n(padded_row.begin(), n_in,
+            quantized.begin() + static_cast<std::ptrdiff_t>(j * n_in));
+    }
+    return std::make_shared<int8_weight_matrix>(quantized, scales, bias);
+}
+
+} } // namespace fdeep, namespace internal
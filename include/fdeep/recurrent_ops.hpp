@@ -6,8 +6,17 @@
 
 #pragma once
 
-#include <string>
+#include "fdeep/tensor.hpp"
+#include "fdeep/weight_matrix.hpp"
+#include "fdeep/weights_storage.hpp"
+
+#include <algorithm>
 #include <functional>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace fdeep { namespace internal
 {
@@ -86,169 +95,400 @@ inline std::function<float_type(float_type)> get_activation_func(const std::stri
     return {}; // Is never called
 }
 
-inline tensors lstm_impl(const tensor& input,
-                          tensor& initial_state_h,
-                          tensor& initial_state_c,
-                          const std::size_t n_units,
-                          const bool use_bias,
-                          const bool return_sequences,
-                          const bool return_state,
-                          const float_vec& weights,
-                          const float_vec& recurrent_weights,
-                          const float_vec& bias,
-                          const std::string& activation,
-                          const std::string& recurrent_activation)
+// A block of a row-major matrix, e.g., the columns of one gate.
+using RowMajorMatrixXfRef =
+    Eigen::Ref<RowMajorMatrixXf, 0, Eigen::OuterStride<>>;
+
+// Like get_activation_func, but applies the function to a whole block
+// in place. The common recurrent activations use Eigen's
+// vectorized implementations instead of one call per element.
+inline std::function<void(RowMajorMatrixXfRef)> get_activation_func_in_place(
+    const std::string& activation_func_name)
 {
-    const RowMajorMatrixXf W = eigen_row_major_mat_from_values(weights.size() / (n_units * 4), n_units * 4, weights);
-    const RowMajorMatrixXf U = eigen_row_major_mat_from_values(n_units, n_units * 4, recurrent_weights);
+    if (activation_func_name == "tanh")
+        return [](RowMajorMatrixXfRef m) { m = m.array().tanh().matrix(); };
+    else if (activation_func_name == "sigmoid")
+        return [](RowMajorMatrixXfRef m) { m = (1 + (-m.array()).exp()).inverse().matrix(); };
+    else if (activation_func_name == "hard_sigmoid")
+        return [](RowMajorMatrixXfRef m)
+        {
+            m = (m.array() * static_cast<float_type>(0.2) + static_cast<float_type>(0.5))
+                .max(static_cast<float_type>(0)).min(static_cast<float_type>(1)).matrix();
+        };
+    const auto f = get_activation_func(activation_func_name);
+    return [f](RowMajorMatrixXfRef m) { m = m.unaryExpr(f); };
+}
 
-    // initialize cell output states h, and cell memory states c for t-1 with initial state values
-    RowMajorMatrixXf h(1, n_units);
-    RowMajorMatrixXf c(1, n_units);
-    h = eigen_row_major_mat_from_values(1, n_units, *initial_state_h.as_vector());
-    c = eigen_row_major_mat_from_values(1, n_units, *initial_state_c.as_vector());
+// Kernel (W) and recurrent kernel (U) of one recurrent layer (direction),
+// including their biases (b_x and b_h). Unused biases are zero.
+struct recurrent_weights
+{
+    weight_matrix_ptr W_;
+    weight_matrix_ptr U_;
+};
+
+// The bias of a recurrent layer holds b_x, followed by b_h if there is one.
+inline std::pair<weights_storage, weights_storage> split_recurrent_bias(
+    const std::size_t n_cols,
+    const bool use_bias,
+    const weights_storage& bias)
+{
+    const weights_storage b_x = use_bias && bias.size() >= n_cols
+        ? bias.segment(0, n_cols)
+        : weights_storage(float_vec(n_cols, 0));
+    const weights_storage b_h = use_bias && bias.size() >= 2 * n_cols
+        ? bias.segment(n_cols, n_cols)
+        : weights_storage(float_vec(n_cols, 0));
+    return {b_x, b_h};
+}
+
+// Float weights in the layout of Keras, i.e., (n_in, n_units * n_gates),
+// used in place.
+inline recurrent_weights create_recurrent_weights(
+    const std::size_t n_units,
+    const std::size_t n_gates,
+    const bool use_bias,
+    const weights_storage& weights,
+    const weights_storage& recurrent_weights,
+    const weights_storage& bias)
+{
+    const std::size_t n_cols = n_units * n_gates;
+    assertion(n_cols > 0 && weights.size() % n_cols == 0 &&
+        recurrent_weights.size() == n_units * n_cols,
+        "invalid number of recurrent layer weights");
+    const auto biases = split_recurrent_bias(n_cols, use_bias, bias);
+    return {
+        std::make_shared<float_weight_matrix>(weights, biases.first, false),
+        std::make_shared<float_weight_matrix>(
+            recurrent_weights, biases.second, false)};
+}
+
+inline recurrent_weights create_lstm_weights(const std::size_t n_units,
+    const bool use_bias,
+    const weights_storage& weights,
+    const weights_storage& recurrent_weights,
+    const weights_storage& bias)
+{
+    return create_recurrent_weights(n_units, 4, use_bias,
+        weights, recurrent_weights, bias);
+}
 
-    std::size_t n_timesteps = input.shape().width_;
-    std::size_t n_features = input.shape().depth_;
+// The recurrent kernel bias is only used with reset_after.
+inline recurrent_weights create_gru_weights(const std::size_t n_units,
+    const bool use_bias,
+    const weights_storage& weights,
+    const weights_storage& recurrent_weights,
+    const weights_storage& bias)
+{
+    return create_recurrent_weights(n_units, 3, use_bias,
+        weights, recurrent_weights, bias);
+}
 
-    RowMajorMatrixXf in(n_timesteps, n_features);
+// Sorts the samples of a batch by descending sequence length.
+// At time step k the samples still running then are the first
+// active_counts[k] ones, so finished samples are masked out by
+// simply processing fewer rows of the state matrices.
+// With go_backwards, step k of a sequence of length n
+// is the element at position n - 1 - k.
+struct recurrent_batch_layout
+{
+    std::vector<std::size_t> order_;
+    std::vector<std::size_t> active_counts_;
+    std::vector<std::size_t> step_offsets_;
+    bool go_backwards_;
+};
+
+inline std::size_t recurrent_batch_time_idx(
+    const recurrent_batch_layout& layout,
+    std::size_t sequence_length, std::size_t k)
+{
+    return layout.go_backwards_ ? sequence_length - 1 - k : k;
+}
 
-    // write input to eigen matrix
+inline recurrent_batch_layout create_recurrent_batch_layout(
+    const tensors& inputs, bool go_backwards)
+{
+    assertion(!inputs.empty(), "no input sequences given");
+    const std::size_t n_features = inputs.front().shape().depth_;
+    for (const auto& input : inputs)
+    {
+        if (input.shape().size_dim_5_ != 1
+            || input.shape().size_dim_4_ != 1
+            || input.shape().height_ != 1)
+        {
+            raise_error("size_dim_5, size_dim_4 and height dimension must be 1, but shape is '" + show_tensor_shape(input.shape()) + "'");
+        }
+        assertion(input.shape().depth_ == n_features,
+            "all sequences in a batch must have the same number of features");
+    }
 
-    for (std::size_t a_t = 0; a_t < n_timesteps; ++a_t)
-        for (std::size_t a_f = 0; a_f < n_features; ++a_f)
-            in(EigenIndex(a_t), EigenIndex(a_f)) = input.get_ignore_rank(tensor_pos(a_t, a_f));
+    std::vector<std::size_t> order(inputs.size());
+    std::iota(std::begin(order), std::end(order), 0);
+    std::stable_sort(std::begin(order), std::end(order),
+        [&inputs](std::size_t a, std::size_t b) -> bool
+        {
+            return inputs[a].shape().width_ > inputs[b].shape().width_;
+        });
+
+    const std::size_t max_timesteps = inputs[order.front()].shape().width_;
+    std::vector<std::size_t> active_counts;
+    std::vector<std::size_t> step_offsets;
+    active_counts.reserve(max_timesteps);
+    step_offsets.reserve(max_timesteps);
+    std::size_t offset = 0;
+    std::size_t active = inputs.size();
+    for (std::size_t k = 0; k < max_timesteps; ++k)
+    {
+        while (inputs[order[active - 1]].shape().width_ <= k)
+            --active;
+        active_counts.push_back(active);
+        step_offsets.push_back(offset);
+        offset += active;
+    }
+    return {order, active_counts, step_offsets, go_backwards};
+}
 
-    RowMajorMatrixXf X = in * W;
+// Writes the input sequences into one matrix in time-major order,
+// i.e., all rows belonging to time step k form one contiguous block.
+inline RowMajorMatrixXf recurrent_batch_input_matrix(
+    const recurrent_batch_layout& layout, const tensors& inputs)
+{
+    const std::size_t n_features = inputs.front().shape().depth_;
+    const std::size_t n_rows = layout.active_counts_.empty() ? 0 :
+        layout.step_offsets_.back() + layout.active_counts_.back();
+    RowMajorMatrixXf in(n_rows, n_features);
+    for (std::size_t k = 0; k < layout.active_counts_.size(); ++k)
+    {
+        for (std::size_t j = 0; j < layout.active_counts_[k]; ++j)
+        {
+            const auto& input = inputs[layout.order_[j]];
+            const auto& values = *input.as_vector();
+            const std::size_t t = recurrent_batch_time_idx(
+                layout, input.shape().width_, k);
+            std::copy_n(values.cbegin() + static_cast<float_vec::const_iterator::difference_type>(t * n_features),
+                n_features, in.data() + (layout.step_offsets_[k] + j) * n_features);
+        }
+    }
+    return in;
+}
 
-    if (use_bias)
+inline RowMajorMatrixXf recurrent_batch_states_matrix(
+    const recurrent_batch_layout& layout, const tensors& states,
+    std::size_t n_units)
+{
+    RowMajorMatrixXf m(layout.order_.size(), n_units);
+    for (std::size_t j = 0; j < layout.order_.size(); ++j)
     {
-        // define eigen vector type to be able to use broadcasting
-        typedef Eigen::Matrix<float_type, 1, Eigen::Dynamic> Vector_Xf;
-        Vector_Xf b = eigen_row_major_mat_from_values(1, n_units * 4, bias);
+        const auto& values = *states[layout.order_[j]].as_vector();
+        assertion(values.size() == n_units, "invalid state size");
+        std::copy_n(values.cbegin(), n_units, m.data() + j * n_units);
+    }
+    return m;
+}
 
-        X.rowwise() += b;
+inline void write_recurrent_batch_states(
+    const recurrent_batch_layout& layout, const RowMajorMatrixXf& m,
+    tensors& states)
+{
+    const std::size_t n_units = static_cast<std::size_t>(m.cols());
+    for (std::size_t j = 0; j < layout.order_.size(); ++j)
+    {
+        states[layout.order_[j]] = tensor(tensor_shape(n_units),
+            float_vec(m.data() + j * n_units, m.data() + (j + 1) * n_units));
     }
+}
+
+// Runs multiple independent sequences through an LSTM in lockstep.
+// The sequences may differ in length. Instead of one GEMV per sequence
+// each time step does one GEMM on the recurrent weights.
+// initial_states_h and initial_states_c hold one tensor per sequence
+// and receive the final states afterwards.
+// With go_backwards the sequences are processed from their last time step
+// to their first one, but returned sequences keep the input's time order,
+// i.e., they are aligned to the forward direction, like in Bidirectional.
+inline tensors_vec lstm_impl_batch(const tensors& inputs,
+                          tensors& initial_states_h,
+                          tensors& initial_states_c,
+                          const std::size_t n_units,
+                          const bool return_sequences,
+                          const bool return_state,
+                          const bool go_backwards,
+                          const recurrent_weights& weights,
+                          const std::string& activation,
+                          const std::string& recurrent_activation)
+{
+    assertion(initial_states_h.size() == inputs.size()
+              && initial_states_c.size() == inputs.size(),
+              "number of initial states does not match batch size");
+    const auto layout = create_recurrent_batch_layout(inputs, go_backwards);
+    const std::size_t n_features = inputs.front().shape().depth_;
+
+    const weight_matrix& W = *weights.W_;
+    const weight_matrix& U = *weights.U_;
+    assertion(W.n_in() == n_features, "invalid number of input features");
+
+    // initialize cell output states h, and cell memory states c for t-1 with initial state values
+    RowMajorMatrixXf h = recurrent_batch_states_matrix(layout, initial_states_h, n_units);
+    RowMajorMatrixXf c = recurrent_batch_states_matrix(layout, initial_states_c, n_units);
+
+    const RowMajorMatrixXf in = recurrent_batch_input_matrix(layout, inputs);
+    RowMajorMatrixXf X(in.rows(), EigenIndex(W.n_out()));
+    W.apply(in.data(), static_cast<std::size_t>(in.rows()), X.data());
 
     // get activation functions
-    auto act_func = get_activation_func(activation);
-    auto act_func_recurrent = get_activation_func(recurrent_activation);
+    auto act_func = get_activation_func_in_place(activation);
+    auto act_func_recurrent = get_activation_func_in_place(recurrent_activation);
 
     // computing LSTM output
     const EigenIndex n = EigenIndex(n_units);
 
-    tensors lstm_result;
+    std::vector<float_vec> output_values = fplus::transform(
+        [&](const tensor& input) -> float_vec
+        {
+            return float_vec(return_sequences
+                ? input.shape().width_ * n_units
+                : n_units, float_type(0));
+        }, inputs);
 
-    if (return_sequences)
-        lstm_result = {tensor(tensor_shape(n_timesteps, n_units), float_type(0))};
-    else
-        lstm_result = {tensor(tensor_shape(n_units), float_type(0))};
+    RowMajorMatrixXf gates(h.rows(), n * 4);
 
-    for (EigenIndex k = 0; k < EigenIndex(n_timesteps); ++k)
+    for (std::size_t k = 0; k < layout.active_counts_.size(); ++k)
     {
-        const RowMajorMatrixXf ifco = h * U;
+        const EigenIndex active = EigenIndex(layout.active_counts_[k]);
+        const EigenIndex x_row = EigenIndex(layout.step_offsets_[k]);
 
-        // Use of Matrix.block(): Block of size (p,q), starting at (i,j) matrix.block(i,j,p,q);  matrix.block<p,q>(i,j);
-        const RowMajorMatrixXf i = (X.block(k, 0, 1, n) + ifco.block(0, 0, 1, n)).unaryExpr(act_func_recurrent);
-        const RowMajorMatrixXf f = (X.block(k, n, 1, n) + ifco.block(0, n, 1, n)).unaryExpr(act_func_recurrent);
-        const RowMajorMatrixXf c_pre = (X.block(k, n * 2, 1, n) + ifco.block(0, n * 2, 1, n)).unaryExpr(act_func);
-        const RowMajorMatrixXf o = (X.block(k, n * 3, 1, n) + ifco.block(0, n * 3, 1, n)).unaryExpr(act_func_recurrent);
+        // The gates are computed in place, without temporary matrices.
+        auto ifco = gates.topRows(active);
+        U.apply(h.data(), layout.active_counts_[k], ifco.data());
+        ifco += X.middleRows(x_row, active);
 
-        c = f.array() * c.array() + i.array() * c_pre.array();
-        h = o.array() * c.unaryExpr(act_func).array();
+        // Use of Matrix.block(): Block of size (p,q), starting at (i,j) matrix.block(i,j,p,q);  matrix.block<p,q>(i,j);
+        act_func_recurrent(ifco.block(0, 0, active, n * 2)); // i and f
+        act_func(ifco.block(0, n * 2, active, n)); // c_pre
+        act_func_recurrent(ifco.block(0, n * 3, active, n)); // o
+        const auto i = ifco.block(0, 0, active, n).array();
+        const auto f = ifco.block(0, n, active, n).array();
+        const auto c_pre = ifco.block(0, n * 2, active, n).array();
+        const auto o = ifco.block(0, n * 3, active, n).array();
+
+        c.topRows(active) = (f * c.topRows(active).array() + i * c_pre).matrix();
+        h.topRows(active) = c.topRows(active);
+        act_func(h.topRows(active));
+        h.topRows(active).array() *= o;
+
+        for (std::size_t j = 0; j < layout.active_counts_[k]; ++j)
+        {
+            const std::size_t sample = layout.order_[j];
+            if (return_sequences)
+                std::copy_n(h.row(EigenIndex(j)).data(), n_units,
+                    output_values[sample].data() + n_units *
+                    recurrent_batch_time_idx(layout, inputs[sample].shape().width_, k));
+            else if (k + 1 == inputs[sample].shape().width_)
+                std::copy_n(h.row(EigenIndex(j)).data(), n_units,
+                    output_values[sample].data());
+        }
+    }
 
+    tensors_vec lstm_results;
+    lstm_results.reserve(inputs.size());
+    for (std::size_t sample = 0; sample < inputs.size(); ++sample)
+    {
         if (return_sequences)
-            for (EigenIndex idx = 0; idx < n; ++idx)
-                lstm_result.front().set_ignore_rank(tensor_pos(std::size_t(k), std::size_t(idx)), h(idx));
-        else if (k == EigenIndex(n_timesteps) - 1)
-            for (EigenIndex idx = 0; idx < n; ++idx)
-                lstm_result.front().set_ignore_rank(tensor_pos(std::size_t(idx)), h(idx));
-        }
+            lstm_results.push_back({tensor(tensor_shape(inputs[sample].shape().width_, n_units), std::move(output_values[sample]))});
+        else
+            lstm_results.push_back({tensor(tensor_shape(n_units), std::move(output_values[sample]))});
+    }
+
+    // Copy the final state back into the initial state in the event of a stateful LSTM call
+    write_recurrent_batch_states(layout, h, initial_states_h);
+    write_recurrent_batch_states(layout, c, initial_states_c);
 
     if (return_state) {
-        auto state_h = tensor(tensor_shape(n_units), float_type(0));
-        auto state_c = tensor(tensor_shape(n_units), float_type(0));
-        for (EigenIndex idx = 0; idx < n; ++idx)
-            state_h.set_ignore_rank(tensor_pos(std::size_t(idx)), h(idx));
-        for (EigenIndex idx = 0; idx < n; ++idx)
-            state_c.set_ignore_rank(tensor_pos(std::size_t(idx)), c(idx));
-        lstm_result.push_back(state_h);
-        lstm_result.push_back(state_c);
+        for (std::size_t sample = 0; sample < inputs.size(); ++sample)
+        {
+            lstm_results[sample].push_back(initial_states_h[sample]);
+            lstm_results[sample].push_back(initial_states_c[sample]);
+        }
     }
-    // Copy the final state back into the initial state in the event of a stateful LSTM call
-    initial_state_h = tensor(tensor_shape(n_units), eigen_row_major_mat_to_values(h));
-    initial_state_c = tensor(tensor_shape(n_units), eigen_row_major_mat_to_values(c));
-    return lstm_result;
+    return lstm_results;
 }
 
-inline tensors gru_impl(const tensor& input,
-    tensor& initial_state_h,
+inline tensors lstm_impl(const tensor& input,
+                          tensor& initial_state_h,
+                          tensor& initial_state_c,
+                          const std::size_t n_units,
+                          const bool return_sequences,
+                          const bool return_state,
+                          const bool go_backwards,
+                          const recurrent_weights& weights,
+                          const std::string& activation,
+                          const std::string& recurrent_activation)
+{
+    tensors states_h = {initial_state_h};
+    tensors states_c = {initial_state_c};
+    const auto result = lstm_impl_batch({input}, states_h, states_c,
+        n_units, return_sequences, return_state, go_backwards,
+        weights, activation, recurrent_activation);
+    initial_state_h = states_h.front();
+    initial_state_c = states_c.front();
+    return result.front();
+}
+
+// Runs multiple independent sequences through a GRU in lockstep.
+// See lstm_impl_batch for details.
+inline tensors_vec gru_impl_batch(const tensors& inputs,
+    tensors& initial_states_h,
     const std::size_t n_units,
-    const bool use_bias,
     const bool reset_after,
     const bool return_sequences,
     const bool return_state,
-    const float_vec& weights,
-    const float_vec& recurrent_weights,
-    const float_vec& bias,
+    const bool go_backwards,
+    const recurrent_weights& weights,
     const std::string& activation,
     const std::string& recurrent_activation)
 {
-    const std::size_t n_timesteps = input.shape().width_;
-    const std::size_t n_features = input.shape().depth_;
+    assertion(initial_states_h.size() == inputs.size(),
+        "number of initial states does not match batch size");
+    const auto layout = create_recurrent_batch_layout(inputs, go_backwards);
+    const std::size_t n_features = inputs.front().shape().depth_;
 
     // weight matrices
     const EigenIndex n = EigenIndex(n_units);
-    const RowMajorMatrix<Dynamic, Dynamic> W = eigen_row_major_mat_from_values(n_features, n_units * 3, weights);
-    const RowMajorMatrix<Dynamic, Dynamic> U = eigen_row_major_mat_from_values(n_units, n_units * 3, recurrent_weights);
-
-    // kernel bias
-    RowVector<Dynamic> b_x(n_units * 3);
-    if (use_bias && bias.size() >= 1 * n_units * 3)
-        std::copy_n(bias.cbegin(), n_units * 3, b_x.data());
-    else
-        b_x.setZero();
-
-    // recurrent kernel bias
-    RowVector<Dynamic> b_h(n_units * 3);
-    if (use_bias && bias.size() >= 2 * n_units * 3)
-        std::copy_n(bias.cbegin() + static_cast<float_vec::const_iterator::difference_type>(n_units * 3), n_units * 3, b_h.data());
-    else
-        b_h.setZero();
+    const weight_matrix& W = *weights.W_;
+    const weight_matrix& U = *weights.U_;
+    assertion(W.n_in() == n_features, "invalid number of input features");
 
     // initialize cell output states h
-    // RowVector<Dynamic> h(1, n_units);
-    RowMajorMatrixXf h(1, n_units);
-    h = eigen_row_major_mat_from_values(1, n_units, *initial_state_h.as_vector());
-
-    // write input to eigen matrix of shape (timesteps, n_features)
-    RowMajorMatrix<Dynamic, Dynamic> x(n_timesteps, n_features);
-
-    for (std::size_t a_t = 0; a_t < n_timesteps; ++a_t)
-        for (std::size_t a_f = 0; a_f < n_features; ++a_f)
-            x(EigenIndex(a_t), EigenIndex(a_f)) = input.get_ignore_rank(tensor_pos(a_t, a_f));
+    RowMajorMatrixXf h = recurrent_batch_states_matrix(layout, initial_states_h, n_units);
 
     // kernel applied to inputs (with bias), produces shape (timesteps, n_units * 3)
-    RowMajorMatrix<Dynamic, Dynamic> Wx = x * W;
-    Wx.rowwise() += b_x;
+    const RowMajorMatrixXf in = recurrent_batch_input_matrix(layout, inputs);
+    RowMajorMatrixXf Wx(in.rows(), 3 * n);
+    W.apply(in.data(), static_cast<std::size_t>(in.rows()), Wx.data());
 
     // get activation functions
-    auto act_func = get_activation_func(activation);
-    auto act_func_recurrent = get_activation_func(recurrent_activation);
+    auto act_func = get_activation_func_in_place(activation);
+    auto act_func_recurrent = get_activation_func_in_place(recurrent_activation);
 
     // computing GRU output
-    tensors gru_result;
-
-    if (return_sequences)
-        gru_result = { tensor(tensor_shape(n_timesteps, n_units), float_type(0)) };
-    else
-        gru_result = { tensor(tensor_shape(n_units), float_type(0)) };
+    std::vector<float_vec> output_values = fplus::transform(
+        [&](const tensor& input) -> float_vec
+        {
+            return float_vec(return_sequences
+                ? input.shape().width_ * n_units
+                : n_units, float_type(0));
+        }, inputs);
 
-    for (EigenIndex k = 0; k < EigenIndex(n_timesteps); ++k)
+    for (std::size_t k = 0; k < layout.active_counts_.size(); ++k)
     {
-        RowVector<Dynamic> r;
-        RowVector<Dynamic> z;
-        RowVector<Dynamic> m;
+        const EigenIndex active = EigenIndex(layout.active_counts_[k]);
+        const std::size_t n_active = layout.active_counts_[k];
+        const EigenIndex x_row = EigenIndex(layout.step_offsets_[k]);
+        const RowMajorMatrixXf h_active = h.topRows(active);
+
+        RowMajorMatrixXf r;
+        RowMajorMatrixXf z;
+        RowMajorMatrixXf m;
 
         // in the formulae below, the following notations are used:
         // A b       matrix product
@@ -264,63 +504,93 @@ inline tensors gru_impl(const tensor& input,
 
         if (reset_after)
         {
-            // recurrent kernel applied to timestep (with bias), produces shape (1, n_units * 3)
-            RowMajorMatrix<1, Dynamic> Uh = h * U;
-            Uh += b_h;
+            // recurrent kernel applied to timestep (with bias), produces shape (active, n_units * 3)
+            RowMajorMatrixXf Uh(active, 3 * n);
+            U.apply(h_active.data(), n_active, Uh.data());
 
             // z = sigmoid(W_{x,z} x + b_{i,z} + W_{h,z} h + b_{h,z})
-            z = (Wx.block(k, 0 * n, 1, n) + Uh.block(0, 0 * n, 1, n)).unaryExpr(act_func_recurrent);
+            z = Wx.block(x_row, 0 * n, active, n) + Uh.block(0, 0 * n, active, n);
+            act_func_recurrent(z);
             // r = sigmoid(W_{x,r} x + b_{i,r} + W_{h,r} h + b_{h,r})
-            r = (Wx.block(k, 1 * n, 1, n) + Uh.block(0, 1 * n, 1, n)).unaryExpr(act_func_recurrent);
+            r = Wx.block(x_row, 1 * n, active, n) + Uh.block(0, 1 * n, active, n);
+            act_func_recurrent(r);
             // m = tanh(W_{x,m} x + b_{i,m} + r * (W_{h,m} h + b_{h,m}))
-            m = (Wx.block(k, 2 * n, 1, n) + (r.array() * Uh.block(0, 2 * n, 1, n).array()).matrix()).unaryExpr(act_func);
+            m = Wx.block(x_row, 2 * n, active, n) + (r.array() * Uh.block(0, 2 * n, active, n).array()).matrix();
+            act_func(m);
         }
         else
         {
+            // recurrent kernel applied to timestep (with bias), only for z and r, produces shape (active, n_units * 2)
+            RowMajorMatrixXf Uh(active, 2 * n);
+            U.apply_columns(h_active.data(), n_active, 0, n_units * 2, Uh.data());
+
             // z = sigmoid(W_{x,z} x + b_{x,z} + W_{h,z} h + b_{h,z})
-            z = (Wx.block(k, 0 * n, 1, n) + h * U.block(0, 0 * n, n, n) + b_h.block(0, 0 * n, 1, n)).unaryExpr(act_func_recurrent);
+            z = Wx.block(x_row, 0 * n, active, n) + Uh.block(0, 0 * n, active, n);
+            act_func_recurrent(z);
             // r = sigmoid(W_{x,r} x + b_{x,r} + W_{h,r} h + b_{h,r})
-            r = (Wx.block(k, 1 * n, 1, n) + h * U.block(0, 1 * n, n, n) + b_h.block(0, 1 * n, 1, n)).unaryExpr(act_func_recurrent);
+            r = Wx.block(x_row, 1 * n, active, n) + Uh.block(0, 1 * n, active, n);
+            act_func_recurrent(r);
             // m = tanh(W_{x,m} x + b_{x,m} + W_{h,m} (r o h) + b_{h,m}))
-            m = (Wx.block(k, 2 * n, 1, n) + (r.array() * h.array()).matrix() * U.block(0, 2 * n, n, n) + b_h.block(0, 2 * n, 1, n)).unaryExpr(act_func);
+            const RowMajorMatrixXf rh = (r.array() * h_active.array()).matrix();
+            RowMajorMatrixXf Urh(active, n);
+            U.apply_columns(rh.data(), n_active, n_units * 2, n_units, Urh.data());
+            m = Wx.block(x_row, 2 * n, active, n) + Urh;
+            act_func(m);
         }
 
         // output vector: h' = (1 - z) o m + z o h
-        h = ((1 - z.array()) * m.array() + z.array() * h.array()).matrix();
+        h.topRows(active) = ((1 - z.array()) * m.array() + z.array() * h_active.array()).matrix();
 
-        if (return_sequences)
-            for (EigenIndex idx = 0; idx < n; ++idx)
-                gru_result.front().set_ignore_rank(tensor_pos(std::size_t(k), std::size_t(idx)), h(idx));
-        else if (k == EigenIndex(n_timesteps) - 1)
-            for (EigenIndex idx = 0; idx < n; ++idx)
-                gru_result.front().set_ignore_rank(tensor_pos(std::size_t(idx)), h(idx));
-
-
-        if (return_state) {
-            auto state_h = tensor(tensor_shape(n_units), float_type(0));
-            for (EigenIndex idx = 0; idx < n; ++idx)
-                state_h.set_ignore_rank(tensor_pos(std::size_t(idx)), h(idx));
-            gru_result.push_back(state_h);
+        for (std::size_t j = 0; j < layout.active_counts_[k]; ++j)
+        {
+            const std::size_t sample = layout.order_[j];
+            if (return_sequences)
+                std::copy_n(h.row(EigenIndex(j)).data(), n_units,
+                    output_values[sample].data() + n_units *
+                    recurrent_batch_time_idx(layout, inputs[sample].shape().width_, k));
+            else if (k + 1 == inputs[sample].shape().width_)
+                std::copy_n(h.row(EigenIndex(j)).data(), n_units,
+                    output_values[sample].data());
         }
-        // Copy the final state back into the initial state in the event of a stateful LSTM call
-        initial_state_h = tensor(tensor_shape(n_units), eigen_row_major_mat_to_values(h));
     }
 
-    return gru_result;
+    tensors_vec gru_results;
+    gru_results.reserve(inputs.size());
+    for (std::size_t sample = 0; sample < inputs.size(); ++sample)
+    {
+        if (return_sequences)
+            gru_results.push_back({tensor(tensor_shape(inputs[sample].shape().width_, n_units), std::move(output_values[sample]))});
+        else
+            gru_results.push_back({tensor(tensor_shape(n_units), std::move(output_values[sample]))});
+    }
+
+    // Copy the final state back into the initial state in the event of a stateful GRU call
+    write_recurrent_batch_states(layout, h, initial_states_h);
+
+    if (return_state) {
+        for (std::size_t sample = 0; sample < inputs.size(); ++sample)
+            gru_results[sample].push_back(initial_states_h[sample]);
+    }
+    return gru_results;
 }
 
-inline tensor reverse_time_series_in_tensor(const tensor& ts)
+inline tensors gru_impl(const tensor& input,
+    tensor& initial_state_h,
+    const std::size_t n_units,
+    const bool reset_after,
+    const bool return_sequences,
+    const bool return_state,
+    const bool go_backwards,
+    const recurrent_weights& weights,
+    const std::string& activation,
+    const std::string& recurrent_activation)
 {
-    tensor reversed = tensor(ts.shape(), float_type(0.0));
-    std::size_t n = 0;
-    for (std::size_t x = ts.shape().width_; x--> 0;)
-    {
-        for (std::size_t z = 0; z < ts.shape().depth_; ++z)
-            reversed.set_ignore_rank(tensor_pos(n, z),
-                ts.get_ignore_rank(tensor_pos(x, z)));
-        n++;
-    }
-    return reversed;
+    tensors states_h = {initial_state_h};
+    const auto result = gru_impl_batch({input}, states_h,
+        n_units, reset_after, return_sequences, return_state,
+        go_backwards, weights, activation, recurrent_activation);
+    initial_state_h = states_h.front();
+    return result.front();
 }
 
 } } // namespace fdeep, namespace internal
@@ -0,0 +1,430 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/half_precision.hpp"
+#include "fdeep/weight_matrix.hpp"
+#include "fdeep/weights_storage.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace fdeep { namespace internal
+{
+
+// Pruned weights, i.e., weight matrices with mostly zeros,
+// are stored as compressed sparse rows (CSR) of blocks:
+// Each output channel only keeps the blocks of block_width consecutive
+// inputs that are not all zero. Blocks of 8 keep some zeros,
+// but are multiplied with whole SIMD registers and need fewer indices,
+// so they are used if the zeros are structured (e.g., pruned in blocks).
+static const std::size_t sparse_block_widths[] = {8, 1};
+
+// From this number of input rows on (e.g., in convolutions),
+// the input is transposed, so that each stored weight is multiplied
+// with the (contiguous) values of a tile of rows at once.
+static const std::size_t sparse_transpose_min_rows = 8;
+static const std::size_t sparse_row_tile = 32;
+
+// Multiplying a stored weight costs about this many times
+// as much as multiplying a weight in a dense matrix product,
+// so sparse weights are only used if less than the inverse
+// of this fraction of the weights needs to be stored.
+// For many input rows (e.g., convolutions), dense matrix products
+// are the most efficient, and the input needs to be transposed.
+inline double sparse_relative_cost(std::size_t block_width, bool many_rows)
+{
+    bool simd = false;
+#if defined(__AVX2__)
+    simd = std::is_same<float_type, float>::value;
+#endif
+    if (simd && !many_rows)
+    {
+        return block_width == 1 ? 3.5 : 1.5;
+    }
+    return 5.0;
+}
+
+// Matrices smaller than this are fast enough anyway.
+static const std::size_t sparse_min_weight_count = 4096;
+
+template <std::size_t BlockWidth>
+float_type sparse_row_dot(const float_type* in, const std::uint32_t* cols,
+    const float_type* values, std::size_t n_blocks)
+{
+    std::size_t b = 0;
+    float_type sum = 0;
+#if defined(__AVX2__)
+    if (std::is_same<float_type, float>::value)
+    {
+        const float* in_float = reinterpret_cast<const float*>(in);
+        const float* values_float = reinterpret_cast<const float*>(values);
+        // Two accumulators, to hide the latency of the additions.
+        __m256 acc_0 = _mm256_setzero_ps();
+        __m256 acc_1 = _mm256_setzero_ps();
+        if (BlockWidth == 8)
+        {
+            for (; b + 2 <= n_blocks; b += 2)
+            {
+                acc_0 = multiply_add_float(
+                    _mm256_loadu_ps(values_float + b * 8),
+                    _mm256_loadu_ps(in_float + cols[b]), acc_0);
+                acc_1 = multiply_add_float(
+                    _mm256_loadu_ps(values_float + b * 8 + 8),
+                    _mm256_loadu_ps(in_float + cols[b + 1]), acc_1);
+            }
+        }
+        else
+        {
+            // Single values are gathered, eight at a time.
+            for (; b + 16 <= n_blocks; b += 16)
+            {
+                acc_0 = multiply_add_float(
+                    _mm256_loadu_ps(values_float + b),
+                    _mm256_i32gather_ps(in_float, _mm256_loadu_si256(
+                        reinterpret_cast<const __m256i*>(cols + b)), 4),
+                    acc_0);
+                acc_1 = multiply_add_float(
+                    _mm256_loadu_ps(values_float + b + 8),
+                    _mm256_i32gather_ps(in_float, _mm256_loadu_si256(
+                        reinterpret_cast<const __m256i*>(cols + b + 8)), 4),
+                    acc_1);
+            }
+        }
+        sum = static_cast<float_type>(
+            horizontal_sum_float(_mm256_add_ps(acc_0, acc_1)));
+    }
+#endif
+    for (; b < n_blocks; ++b)
+    {
+        for (std::size_t k = 0; k < BlockWidth; ++k)
+        {
+            sum += values[b * BlockWidth + k] * in[cols[b] + k];
+        }
+    }
+    return sum;
+}
+
+#if defined(__AVX2__)
+// Copies the transposed 8x8 block at src to dest.
+inline void transpose_8x8_float(const float* src, std::size_t src_stride,
+    float* dest, std::size_t dest_stride)
+{
+    __m256 r[8];
+    for (std::size_t k = 0; k < 8; ++k)
+    {
+        r[k] = _mm256_loadu_ps(src + k * src_stride);
+    }
+    const __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+    const __m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    const __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+    const __m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    const __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+    const __m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    const __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+    const __m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    const __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    _mm256_storeu_ps(dest, _mm256_permute2f128_ps(s0, s4, 0x20));
+    _mm256_storeu_ps(dest + dest_stride, _mm256_permute2f128_ps(s1, s5, 0x20));
+    _mm256_storeu_ps(dest + 2 * dest_stride, _mm256_permute2f128_ps(s2, s6, 0x20));
+    _mm256_storeu_ps(dest + 3 * dest_stride, _mm256_permute2f128_ps(s3, s7, 0x20));
+    _mm256_storeu_ps(dest + 4 * dest_stride, _mm256_permute2f128_ps(s0, s4, 0x31));
+    _mm256_storeu_ps(dest + 5 * dest_stride, _mm256_permute2f128_ps(s1, s5, 0x31));
+    _mm256_storeu_ps(dest + 6 * dest_stride, _mm256_permute2f128_ps(s2, s6, 0x31));
+    _mm256_storeu_ps(dest + 7 * dest_stride, _mm256_permute2f128_ps(s3, s7, 0x31));
+}
+#endif
+
+// Copies the transposed (rows, cols) matrix at src,
+// with a row length of src_stride, to dest,
+// with a row length of dest_stride.
+inline void transpose_float_block(const float_type* src, std::size_t src_stride,
+    std::size_t rows, std::size_t cols,
+    float_type* dest, std::size_t dest_stride)
+{
+    std::size_t r_8 = 0;
+    std::size_t c_8 = 0;
+#if defined(__AVX2__)
+    if (std::is_same<float_type, float>::value)
+    {
+        r_8 = rows / 8 * 8;
+        c_8 = cols / 8 * 8;
+        for (std::size_t r = 0; r < r_8; r += 8)
+        {
+            for (std::size_t c = 0; c < c_8; c += 8)
+            {
+                transpose_8x8_float(
+                    reinterpret_cast<const float*>(src + r * src_stride + c),
+                    src_stride,
+                    reinterpret_cast<float*>(dest + c * dest_stride + r),
+                    dest_stride);
+            }
+        }
+    }
+#endif
+    // The remaining values, i.e., all of them without SIMD.
+    for (std::size_t c = 0; c < cols; ++c)
+    {
+        const std::size_t first_r = c < c_8 ? r_8 : 0;
+        for (std::size_t r = first_r; r < rows; ++r)
+        {
+            dest[c * dest_stride + r] = src[r * src_stride + c];
+        }
+    }
+}
+
+// Stores W transposed, i.e., one row per output channel,
+// as compressed sparse rows of blocks (see sparse_block_widths).
+class sparse_weight_matrix : public weight_matrix
+{
+public:
+    // The weights are given like for float_weight_matrix.
+    // block_width must divide n_in.
+    sparse_weight_matrix(const weights_storage& weights,
+        const weights_storage& bias, bool transposed,
+        std::size_t block_width) :
+        weight_matrix(weights.size() / bias.size(), bias.size()),
+        block_width_(block_width),
+        row_starts_(),
+        cols_(),
+        values_(),
+        bias_(bias.to_float_vec())
+    {
+        assertion(weights.size() % bias.size() == 0, "invalid weight count");
+        assertion(block_width_ > 0 && n_in() % block_width_ == 0,
+            "invalid sparse block width");
+        row_starts_.reserve(n_out() + 1);
+        row_starts_.push_back(0);
+        const float_type* w = weights.data();
+        const auto weight = [&](std::size_t j, std::size_t i) -> float_type
+        {
+            return transposed ? w[j * n_in() + i] : w[i * n_out() + j];
+        };
+        for (std::size_t j = 0; j < n_out(); ++j)
+        {
+            for (std::size_t i = 0; i < n_in(); i += block_width_)
+            {
+                bool is_zero = true;
+                for (std::size_t k = 0; k < block_width_; ++k)
+                {
+                    is_zero = is_zero && weight(j, i + k) == 0;
+                }
+                if (!is_zero)
+                {
+                    cols_.push_back(static_cast<std::uint32_t>(i));
+                    for (std::size_t k = 0; k < block_width_; ++k)
+                    {
+                        values_.push_back(weight(j, i + k));
+                    }
+                }
+            }
+            row_starts_.push_back(cols_.size());
+        }
+    }
+    void apply_columns(const float_type* in, std::size_t rows,
+        std::size_t first_col, std::size_t n_cols,
+        float_type* out) const override
+    {
+        check_columns(first_col, n_cols);
+        if (rows < sparse_transpose_min_rows)
+        {
+            for (std::size_t r = 0; r < rows; ++r)
+            {
+                for (std::size_t j = 0; j < n_cols; ++j)
+                {
+                    out[r * n_cols + j] = bias_[first_col + j] +
+                        row_dot(in + r * n_in(), first_col + j);
+                }
+            }
+            return;
+        }
+        // Each tile of input rows is transposed into a contiguous block,
+        // padded with zeros, so all tiles are processed the same way.
+        float_vec in_tile(n_in() * sparse_row_tile, 0);
+        float_vec out_tile(n_cols * sparse_row_tile);
+        for (std::size_t t = 0; t < rows; t += sparse_row_tile)
+        {
+            const std::size_t tile = std::min(sparse_row_tile, rows - t);
+            if (tile < sparse_row_tile)
+            {
+                std::fill(in_tile.begin(), in_tile.end(),
+                    static_cast<float_type>(0));
+            }
+            transpose_float_block(in + t * n_in(), n_in(), tile, n_in(),
+                in_tile.data(), sparse_row_tile);
+            for (std::size_t j = 0; j < n_cols; ++j)
+            {
+                tile_dot(in_tile.data(), first_col + j,
+                    out_tile.data() + j * sparse_row_tile);
+            }
+            transpose_float_block(out_tile.data(), sparse_row_tile,
+                n_cols, tile, out + t * n_cols, n_cols);
+        }
+    }
+    std::size_t block_width() const
+    {
+        return block_width_;
+    }
+    // The fraction of the weights that is stored.
+    double density() const
+    {
+        return static_cast<double>(values_.size()) /
+            static_cast<double>(n_in() * n_out());
+    }
+private:
+    float_type row_dot(const float_type* in_row, std::size_t j) const
+    {
+        const std::size_t begin = row_starts_[j];
+        const std::size_t n_blocks = row_starts_[j + 1] - begin;
+        const std::uint32_t* cols = cols_.data() + begin;
+        const float_type* values = values_.data() + begin * block_width_;
+        if (block_width_ == 8)
+            return sparse_row_dot<8>(in_row, cols, values, n_blocks);
+        return sparse_row_dot<1>(in_row, cols, values, n_blocks);
+    }
+    // Output channel j for a tile of sparse_row_tile input rows,
+    // transposed, i.e., with the values of each input contiguous.
+    void tile_dot(const float_type* in_tile, std::size_t j,
+        float_type* dest) const
+    {
+#if defined(__AVX2__)
+        if (std::is_same<float_type, float>::value)
+        {
+            // The tile is accumulated in registers.
+            __m256 acc_0 = _mm256_set1_ps(static_cast<float>(bias_[j]));
+            __m256 acc_1 = acc_0;
+            __m256 acc_2 = acc_0;
+            __m256 acc_3 = acc_0;
+            for (std::size_t b = row_starts_[j]; b < row_starts_[j + 1]; ++b)
+            {
+                for (std::size_t k = 0; k < block_width_; ++k)
+                {
+                    const float* in_k = reinterpret_cast<const float*>(
+                        in_tile + (cols_[b] + k) * sparse_row_tile);
+                    const __m256 value = _mm256_set1_ps(
+                        static_cast<float>(values_[b * block_width_ + k]));
+                    acc_0 = multiply_add_float(value, _mm256_loadu_ps(in_k), acc_0);
+                    acc_1 = multiply_add_float(value, _mm256_loadu_ps(in_k + 8), acc_1);
+                    acc_2 = multiply_add_float(value, _mm256_loadu_ps(in_k + 16), acc_2);
+                    acc_3 = multiply_add_float(value, _mm256_loadu_ps(in_k + 24), acc_3);
+                }
+            }
+            float* dest_float = reinterpret_cast<float*>(dest);
+            _mm256_storeu_ps(dest_float, acc_0);
+            _mm256_storeu_ps(dest_float + 8, acc_1);
+            _mm256_storeu_ps(dest_float + 16, acc_2);
+            _mm256_storeu_ps(dest_float + 24, acc_3);
+            return;
+        }
+#endif
+        std::fill(dest, dest + sparse_row_tile, bias_[j]);
+        for (std::size_t b = row_starts_[j]; b < row_starts_[j + 1]; ++b)
+        {
+            for (std::size_t k = 0; k < block_width_; ++k)
+            {
+                const float_type* in_k =
+                    in_tile + (cols_[b] + k) * sparse_row_tile;
+                const float_type value = values_[b * block_width_ + k];
+                for (std::size_t r = 0; r < sparse_row_tile; ++r)
+                {
+                    dest[r] += value * in_k[r];
+                }
+            }
+        }
+    }
+    std::size_t block_width_;
+    std::vector<std::size_t> row_starts_;
+    std::vector<std::uint32_t> cols_;
+    float_vec values_;
+    float_vec bias_;
+};
+
+// The number of blocks (of block_width consecutive inputs
+// of an output channel) that are not all zero.
+inline std::size_t count_nonzero_weight_blocks(const weights_storage& weights,
+    std::size_t n_in, std::size_t n_out, bool transposed,
+    std::size_t block_width)
+{
+    const float_type* w = weights.data();
+    std::size_t count = 0;
+    for (std::size_t j = 0; j < n_out; ++j)
+    {
+        for (std::size_t i = 0; i < n_in; i += block_width)
+        {
+            for (std::size_t k = 0; k < block_width; ++k)
+            {
+                const float_type value = transposed
+                    ? w[j * n_in + i + k] : w[(i + k) * n_out + j];
+                if (value != 0)
+                {
+                    ++count;
+                    break;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// Float weights of dense layers (usually applied to single rows)
+// and convolutions (many rows, see sparse_relative_cost),
+// stored sparsely if they have enough zeros (e.g., pruned models)
+// that this is faster, with the block width needing the least work.
+inline weight_matrix_ptr create_float_weight_matrix(
+    const weights_storage& weights, const weights_storage& bias,
+    bool transposed, bool accumulate_double, bool many_rows)
+{
+    const std::size_t n_out = bias.size();
+    const std::size_t n_in = n_out == 0 ? 0 : weights.size() / n_out;
+    std::size_t best_block_width = 0;
+    double best_cost = 1;
+    if (!accumulate_double && weights.size() >= sparse_min_weight_count)
+    {
+        for (const std::size_t block_width : sparse_block_widths)
+        {
+            if (n_in % block_width != 0)
+                continue;
+            const double stored = static_cast<double>(block_width *
+                count_nonzero_weight_blocks(weights, n_in, n_out,
+                    transposed, block_width)) /
+                static_cast<double>(weights.size());
+            const double cost =
+                stored * sparse_relative_cost(block_width, many_rows);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_block_width = block_width;
+            }
+        }
+    }
+    if (best_block_width != 0)
+    {
+        return std::make_shared<sparse_weight_matrix>(
+            weights, bias, transposed, best_block_width);
+    }
+    return std::make_shared<float_weight_matrix>(weights, bias, transposed,
+        accumulate_double);
+}
+
+} } // namespace fdeep, namespace internal
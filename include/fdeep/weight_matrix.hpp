@@ -0,0 +1,344 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/weights_storage.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace fdeep { namespace internal
+{
+
+// The weights and biases of a matrix product,
+// as computed by dense layers and (via im2col) by convolutions:
+// out = in * W + b, for an input of (rows, n_in) values,
+// a weight matrix W of (n_in, n_out) values,
+// and an output of (rows, n_out) values, all stored row-major.
+// Implementations differ in how they store W (e.g., quantized).
+// apply_columns only computes the output columns
+// [first_col, first_col + n_cols), e.g., the ones of one recurrent gate,
+// into an output of (rows, n_cols) values.
+class weight_matrix
+{
+public:
+    weight_matrix(std::size_t n_in, std::size_t n_out) :
+        n_in_(n_in), n_out_(n_out)
+    {
+    }
+    virtual ~weight_matrix()
+    {
+    }
+    std::size_t n_in() const
+    {
+        return n_in_;
+    }
+    std::size_t n_out() const
+    {
+        return n_out_;
+    }
+    void apply(const float_type* in, std::size_t rows,
+        float_type* out) const
+    {
+        apply_columns(in, rows, 0, n_out_, out);
+    }
+    virtual void apply_columns(const float_type* in, std::size_t rows,
+        std::size_t first_col, std::size_t n_cols, float_type* out) const = 0;
+protected:
+    void check_columns(std::size_t first_col, std::size_t n_cols) const
+    {
+        assertion(first_col + n_cols <= n_out_, "invalid weight matrix columns");
+    }
+private:
+    std::size_t n_in_;
+    std::size_t n_out_;
+};
+
+typedef std::shared_ptr<const weight_matrix> weight_matrix_ptr;
+
+static const std::size_t double_accumulation_block_size = 64;
+
+// From this number of input rows on, decoding blocks of compactly stored
+// weights into a buffer and multiplying it like float weights
+// is faster than decoding them again for each input row.
+static const std::size_t decode_min_rows = 4;
+static const std::size_t decode_block_rows = 64;
+
+// Inputs with many zeros (e.g., after ReLU) are multiplied only with
+// the rows of W (stored as (n_in, n_out)) belonging to their non-zero values,
+// if there are only a few input rows (e.g., dense layers on single samples).
+// Each non-zero value costs about as much as computing
+// sparse_input_overhead_cols further output values,
+// so the fraction of non-zero values has to be at most
+// sparse_input_max_density * n_cols / (n_cols + sparse_input_overhead_cols).
+// This is checked for every product, as it depends on the input.
+// Weights with non-finite values are always multiplied completely,
+// because skipping them would lose the NaN of 0 * inf (or 0 * NaN).
+static const std::size_t sparse_input_max_rows = 4;
+static const std::size_t sparse_input_min_weights = 16384;
+static const double sparse_input_max_density = 0.5;
+static const double sparse_input_overhead_cols = 128;
+
+// Computes the output columns [first_col, first_col + n_cols)
+// for weights stored in a compact form (e.g., as half values),
+// with one row per output channel.
+// decode_rows(j, count, dest) writes the rows [j, j + count)
+// as float_type values to dest.
+// dot_x4(in_row, js, dest) writes the dot products of one input row
+// with the four weight rows js to dest.
+// For a few input rows (e.g., dense layers on single samples,
+// the recurrent kernel in each time step), the weights are decoded
+// in registers while computing the dot products.
+// For more rows (e.g., convolutions), blocks of weight rows are decoded
+// into a temporary buffer and multiplied like float weights.
+template <typename DecodeRows, typename DotX4>
+void apply_compact_weight_rows(std::size_t n_in, const float_vec& bias,
+    const float_type* in, std::size_t rows,
+    std::size_t first_col, std::size_t n_cols, float_type* out,
+    DecodeRows decode_rows, DotX4 dot_x4)
+{
+    const std::size_t end_col = first_col + n_cols;
+    if (rows < decode_min_rows)
+    {
+        for (std::size_t r = 0; r < rows; ++r)
+        {
+            float_type* out_row = out + r * n_cols;
+            for (std::size_t j = first_col; j < end_col; j += 4)
+            {
+                // The last group repeats the last row if needed.
+                std::size_t js[4];
+                for (std::size_t k = 0; k < 4; ++k)
+                {
+                    js[k] = std::min(j + k, end_col - 1);
+                }
+                float_type sums[4];
+                dot_x4(in + r * n_in, js, sums);
+                for (std::size_t k = 0; k < 4 && j + k < end_col; ++k)
+                {
+                    out_row[j + k - first_col] = sums[k] + bias[j + k];
+                }
+            }
+        }
+        return;
+    }
+    const EigenIndex n_rows = static_cast<EigenIndex>(rows);
+    const Eigen::Map<const RowMajorMatrixXf, Eigen::Unaligned> in_mat(
+        in, n_rows, static_cast<EigenIndex>(n_in));
+    Eigen::Map<RowMajorMatrixXf, Eigen::Unaligned> out_mat(
+        out, n_rows, static_cast<EigenIndex>(n_cols));
+    RowMajorMatrixXf block(
+        static_cast<EigenIndex>(std::min(decode_block_rows, n_cols)),
+        static_cast<EigenIndex>(n_in));
+    for (std::size_t j = first_col; j < end_col; j += decode_block_rows)
+    {
+        const std::size_t block_rows = std::min(decode_block_rows, end_col - j);
+        decode_rows(j, block_rows, block.data());
+        out_mat.middleCols(static_cast<EigenIndex>(j - first_col),
+            static_cast<EigenIndex>(block_rows)).noalias() =
+            in_mat * block.topRows(static_cast<EigenIndex>(block_rows)).transpose();
+    }
+    out_mat.rowwise() += Eigen::Map<const Eigen::Matrix<
+        float_type, 1, Eigen::Dynamic>>(
+            bias.data() + first_col, static_cast<EigenIndex>(n_cols));
+}
+
+// Stores W as float values, either as (n_in, n_out) row-major,
+// like Keras stores the kernels of dense layers,
+// or transposed, i.e., as (n_out, n_in) row-major,
+// like the filters of convolutions are stored.
+// With accumulate_double, the products of blocks of
+// double_accumulation_block_size inputs are summed up in float_type
+// (by the fast matrix products), and these partial sums in double.
+// The rounding errors then no longer grow with the number of inputs,
+// at a fraction of the cost of computing everything in double.
+class float_weight_matrix : public weight_matrix
+{
+public:
+    float_weight_matrix(const weights_storage& weights,
+        const weights_storage& bias, bool transposed,
+        bool accumulate_double = false) :
+        weight_matrix(weights.size() / bias.size(), bias.size()),
+        weights_(weights),
+        bias_(bias),
+        transposed_(transposed),
+        has_bias_(std::any_of(bias.data(), bias.data() + bias.size(),
+            [](float_type b) { return b != 0; })),
+        accumulate_double_(accumulate_double),
+        sparse_input_allowed_(!transposed &&
+            weights.size() >= sparse_input_min_weights &&
+            std::all_of(weights.data(), weights.data() + weights.size(),
+                [](float_type w) { return std::isfinite(w); }))
+    {
+        assertion(weights.size() % bias.size() == 0, "invalid weight count");
+    }
+    void apply_columns(const float_type* in, std::size_t rows,
+        std::size_t first_col, std::size_t n_cols,
+        float_type* out) const override
+    {
+        check_columns(first_col, n_cols);
+        const EigenIndex n_rows = static_cast<EigenIndex>(rows);
+        const EigenIndex first = static_cast<EigenIndex>(first_col);
+        const EigenIndex n = static_cast<EigenIndex>(n_cols);
+        const Eigen::Map<const RowMajorMatrixXf, Eigen::Unaligned> in_mat(
+            in, n_rows, static_cast<EigenIndex>(n_in()));
+        Eigen::Map<RowMajorMatrixXf, Eigen::Unaligned> out_mat(
+            out, n_rows, n);
+        if (accumulate_double_ && n_in() > double_accumulation_block_size)
+        {
+            apply_columns_accumulating_double(in_mat, first, n, out_mat);
+            return;
+        }
+        if (multiplies_sparse_input(in, rows, n_cols))
+        {
+            apply_columns_sparse_input(in, rows, first, n, out_mat);
+            return;
+        }
+        // Whole matrices avoid the strided blocks,
+        // e.g., for the recurrent kernel in each time step.
+        if (first_col == 0 && n_cols == n_out())
+        {
+            if (transposed_)
+                out_mat.noalias() = in_mat * map_row_major_mat(
+                    weights_, n_out(), n_in()).transpose();
+            else
+                out_mat.noalias() = in_mat * map_row_major_mat(
+                    weights_, n_in(), n_out());
+        }
+        else if (transposed_)
+        {
+            out_mat.noalias() = in_mat * map_row_major_mat(
+                weights_, n_out(), n_in()).middleRows(first, n).transpose();
+        }
+        else
+        {
+            out_mat.noalias() = in_mat * map_row_major_mat(
+                weights_, n_in(), n_out()).middleCols(first, n);
+        }
+        if (has_bias_)
+        {
+            out_mat.rowwise() += map_row_major_mat(
+                bias_, 1, n_out()).row(0).segment(first, n);
+        }
+    }
+    // Tells if apply_columns only uses the weights of the non-zero inputs.
+    bool multiplies_sparse_input(const float_type* in, std::size_t rows,
+        std::size_t n_cols) const
+    {
+        return sparse_input_allowed_ &&
+            !(accumulate_double_ && n_in() > double_accumulation_block_size) &&
+            rows < sparse_input_max_rows &&
+            n_in() * n_cols >= sparse_input_min_weights &&
+            is_sparse_input(in, rows, n_cols);
+    }
+private:
+    bool is_sparse_input(const float_type* in, std::size_t rows,
+        std::size_t n_cols) const
+    {
+        const std::size_t size = rows * n_in();
+        const std::size_t non_zeros = static_cast<std::size_t>(
+            std::count_if(in, in + size, [](float_type x) { return x != 0; }));
+        const double cols = static_cast<double>(n_cols);
+        return static_cast<double>(non_zeros) <=
+            sparse_input_max_density * cols /
+                (cols + sparse_input_overhead_cols) *
+                static_cast<double>(size);
+    }
+    void apply_columns_sparse_input(const float_type* in, std::size_t rows,
+        EigenIndex first, EigenIndex n,
+        Eigen::Map<RowMajorMatrixXf, Eigen::Unaligned>& out_mat) const
+    {
+        const auto weights = map_row_major_mat(weights_, n_in(), n_out());
+        std::vector<std::size_t> non_zeros;
+        non_zeros.reserve(n_in());
+        for (std::size_t r = 0; r < rows; ++r)
+        {
+            const float_type* in_row = in + r * n_in();
+            non_zeros.clear();
+            for (std::size_t i = 0; i < n_in(); ++i)
+            {
+                if (in_row[i] != 0)
+                {
+                    non_zeros.push_back(i);
+                }
+            }
+            auto out_row = out_mat.row(static_cast<EigenIndex>(r));
+            if (has_bias_)
+                out_row = map_row_major_mat(
+                    bias_, 1, n_out()).row(0).segment(first, n);
+            else
+                out_row.setZero();
+            const auto weight_row = [&](std::size_t k)
+            {
+                return weights.row(static_cast<EigenIndex>(non_zeros[k])).
+                    segment(first, n);
+            };
+            const auto value = [&](std::size_t k)
+            {
+                return in_row[non_zeros[k]];
+            };
+            // Four rows at once, so the output is read and written less often.
+            std::size_t k = 0;
+            for (; k + 4 <= non_zeros.size(); k += 4)
+            {
+                out_row.noalias() +=
+                    value(k) * weight_row(k) +
+                    value(k + 1) * weight_row(k + 1) +
+                    value(k + 2) * weight_row(k + 2) +
+                    value(k + 3) * weight_row(k + 3);
+            }
+            for (; k < non_zeros.size(); ++k)
+            {
+                out_row.noalias() += value(k) * weight_row(k);
+            }
+        }
+    }
+    void apply_columns_accumulating_double(
+        const Eigen::Map<const RowMajorMatrixXf, Eigen::Unaligned>& in_mat,
+        EigenIndex first, EigenIndex n,
+        Eigen::Map<RowMajorMatrixXf, Eigen::Unaligned>& out_mat) const
+    {
+        typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic,
+            Eigen::RowMajor> RowMajorMatrixXd;
+        RowMajorMatrixXd sums = map_row_major_mat(bias_, 1, n_out()).
+            row(0).segment(first, n).cast<double>().replicate(in_mat.rows(), 1);
+        RowMajorMatrixXf partial_sums(in_mat.rows(), n);
+        const EigenIndex n_inputs = static_cast<EigenIndex>(n_in());
+        const EigenIndex block_size =
+            static_cast<EigenIndex>(double_accumulation_block_size);
+        for (EigenIndex i = 0; i < n_inputs; i += block_size)
+        {
+            const EigenIndex block = std::min(block_size, n_inputs - i);
+            if (transposed_)
+            {
+                partial_sums.noalias() = in_mat.middleCols(i, block) *
+                    map_row_major_mat(weights_, n_out(), n_in()).block(
+                        first, i, n, block).transpose();
+            }
+            else
+            {
+                partial_sums.noalias() = in_mat.middleCols(i, block) *
+                    map_row_major_mat(weights_, n_in(), n_out()).block(
+                        i, first, block, n);
+            }
+            sums += partial_sums.cast<double>();
+        }
+        out_mat = sums.cast<float_type>();
+    }
+    weights_storage weights_;
+    weights_storage bias_;
+    bool transposed_;
+    bool has_bias_;
+    bool accumulate_double_;
+    bool sparse_input_allowed_;
+};
+
+} } // namespace fdeep, namespace internal
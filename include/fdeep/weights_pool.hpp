@@ -0,0 +1,79 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include "fdeep/binary_model.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace fdeep { namespace internal
+{
+
+// Lets models share identical weights,
+// e.g., the unchanged layers of two versions of a model
+// (see model_registry).
+// Weights are looked up by a hash of their content,
+// and compared in full if the hash matches.
+// The pool only refers to them weakly,
+// so they are freed when no model uses them any more.
+class weights_pool
+{
+public:
+    weights_pool() : mutex_(), entries_(), size_after_purge_(0)
+    {
+    }
+
+    // Returns values with the same content from the pool, if there are any.
+    // Otherwise the given values are added to the pool and returned.
+    std::shared_ptr<const float_vec> deduplicate(
+        const std::shared_ptr<const float_vec>& values)
+    {
+        const std::uint64_t hash = hash_binary_data(
+            reinterpret_cast<const std::uint8_t*>(values->data()),
+            values->size() * sizeof(float_type));
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto range = entries_.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            const auto existing = it->second.lock();
+            if (existing && *existing == *values)
+            {
+                return existing;
+            }
+        }
+        entries_.emplace(hash, values);
+        if (entries_.size() > 2 * size_after_purge_ + 64)
+        {
+            purge();
+        }
+        return values;
+    }
+
+private:
+    void purge()
+    {
+        for (auto it = entries_.begin(); it != entries_.end();)
+        {
+            it = it->second.expired() ? entries_.erase(it) : std::next(it);
+        }
+        size_after_purge_ = entries_.size();
+    }
+
+    std::mutex mutex_;
+    std::unordered_multimap<std::uint64_t,
+        std::weak_ptr<const float_vec>> entries_;
+    std::size_t size_after_purge_;
+};
+
+} } // namespace fdeep, namespace internal
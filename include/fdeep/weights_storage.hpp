@@ -0,0 +1,86 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#pragma once
+
+#include "fdeep/common.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace fdeep { namespace internal
+{
+
+// Read-only layer weights, which are either owned,
+// or borrowed from memory outliving the layer,
+// i.e., a memory-mapped binary model file kept alive by the model.
+// Copies share the values.
+class weights_storage
+{
+public:
+    explicit weights_storage(float_vec&& values) :
+        owned_(std::make_shared<const float_vec>(std::move(values))),
+        data_(owned_->data()),
+        size_(owned_->size())
+    {
+    }
+    explicit weights_storage(const std::shared_ptr<const float_vec>& values) :
+        owned_(values),
+        data_(owned_->data()),
+        size_(owned_->size())
+    {
+    }
+    weights_storage(const float_type* data, std::size_t size) :
+        owned_(), data_(data), size_(size)
+    {
+    }
+    weights_storage(const weights_storage&) = default;
+    weights_storage& operator=(const weights_storage&) = default;
+    const float_type* data() const
+    {
+        return data_;
+    }
+    std::size_t size() const
+    {
+        return size_;
+    }
+    bool is_borrowed() const
+    {
+        return !owned_;
+    }
+    weights_storage segment(std::size_t offset, std::size_t count) const
+    {
+        assertion(offset + count <= size_, "invalid weights segment");
+        return weights_storage(owned_, data_ + offset, count);
+    }
+    float_vec to_float_vec() const
+    {
+        return float_vec(data_, data_ + size_);
+    }
+private:
+    weights_storage(const std::shared_ptr<const float_vec>& owned,
+        const float_type* data, std::size_t size) :
+        owned_(owned), data_(data), size_(size)
+    {
+    }
+    std::shared_ptr<const float_vec> owned_;
+    const float_type* data_;
+    std::size_t size_;
+};
+
+using ConstMappedRowMajorMatrixXf =
+    Eigen::Map<const RowMajorMatrixXf, Eigen::Unaligned>;
+
+inline ConstMappedRowMajorMatrixXf map_row_major_mat(
+    const weights_storage& weights, std::size_t height, std::size_t width)
+{
+    assertion(height * width == weights.size(), "invalid shape");
+    return ConstMappedRowMajorMatrixXf(weights.data(),
+        static_cast<EigenIndex>(height), static_cast<EigenIndex>(width));
+}
+
+} } // namespace fdeep, namespace internal
@@ -2,11 +2,14 @@
 """Convert a Keras model to frugally-deep format.
 """
 
+import argparse
 import base64
 import datetime
 import hashlib
 import json
-import sys
+import os
+import struct
+from collections import namedtuple
 
 import numpy as np
 from tensorflow.keras import backend as K
@@ -21,6 +24,19 @@ __email__ = "editgym@gmail.com"
 
 STORE_FLOATS_HUMAN_READABLE = False
 
+BINARY_MODEL_MAGIC = b'FDEEPBIN'
+BINARY_MODEL_VERSION = 2
+BINARY_MODEL_BYTE_ORDER_MARK = 0x01020304
+BINARY_MODEL_HEADER_SIZE = 40
+BINARY_MODEL_BLOB_ALIGNMENT = 64
+
+# How to store the weights of a model (see convert).
+# With as_blobs, arrays are stored as raw blobs for the binary format.
+ConversionOptions = namedtuple(
+    'ConversionOptions',
+    ['as_blobs', 'quantize_int8', 'half_precision', 'palettize_4bit', 'low_rank_tolerance'],
+    defaults=[False, False, None, False, None])
+
 
 def transform_input_kernel(kernel):
     """Transforms weights of a single CuDNN input kernel into the regular Keras format."""
@@ -64,6 +80,51 @@ def write_text_file(path, text):
         print(text, file=text_file)
 
 
+def align_binary_offset(offset):
+    """Round an offset up to the next multiple of the blob alignment"""
+    return -(-offset // BINARY_MODEL_BLOB_ALIGNMENT) * BINARY_MODEL_BLOB_ALIGNMENT
+
+
+def write_binary_file(path, json_output):
+    """Write a model in the binary format (see fdeep/binary_model.hpp).
+    The float arrays are stored as aligned raw blobs behind the metadata,
+    so the model can be memory-mapped and used without decoding.
+    So are the bytes of arrays of other types (see encode_int8).
+    """
+    blobs = []
+    blobs_size = 0
+
+    def replace_blobs(value):
+        nonlocal blobs_size
+        if isinstance(value, FloatBlob):
+            blob_offset = align_binary_offset(blobs_size)
+            blobs.append((blob_offset, value.arr.astype('<f4', copy=False)))
+            blobs_size = blob_offset + value.arr.nbytes
+            return {'blob_offset': blob_offset, 'blob_count': len(value.arr)}
+        if isinstance(value, ByteBlob):
+            blob_offset = align_binary_offset(blobs_size)
+            blobs.append((blob_offset, value.arr))
+            blobs_size = blob_offset + value.arr.nbytes
+            return {'bytes_offset': blob_offset, 'bytes_size': value.arr.nbytes}
+        if isinstance(value, dict):
+            return {key: replace_blobs(val) for key, val in value.items()}
+        if isinstance(value, list):
+            return [replace_blobs(val) for val in value]
+        return value
+
+    metadata = json.dumps(replace_blobs(json_output),
+                          allow_nan=False, sort_keys=True).encode('utf-8')
+    blobs_offset = align_binary_offset(BINARY_MODEL_HEADER_SIZE + len(metadata))
+    with open(path, 'wb') as binary_file:
+        binary_file.write(struct.pack('<8sIIIIQQ', BINARY_MODEL_MAGIC, BINARY_MODEL_VERSION,
+                                      BINARY_MODEL_BYTE_ORDER_MARK, BINARY_MODEL_BLOB_ALIGNMENT, 0,
+                                      len(metadata), blobs_offset))
+        binary_file.write(metadata)
+        for blob_offset, arr in blobs:
+            binary_file.write(b'\0' * (blobs_offset + blob_offset - binary_file.tell()))
+            binary_file.write(arr.tobytes())
+
+
 def int_or_none(value):
     """Leave None values as is, convert everything else to int"""
     if value is None:
@@ -81,11 +142,11 @@ def get_layer_input_shape_tensor_shape(layer):
     return keras_shape_to_fdeep_tensor_shape(layer.input_shape)
 
 
-def show_tensor(tens):
+def show_tensor(tens, options):
     """Serialize 3-tensor to a dict"""
     return {
         'shape': tens.shape[1:],
-        'values': encode_floats(tens.flatten())
+        'values': encode_floats(tens.flatten(), options)
     }
 
 
@@ -141,7 +202,7 @@ def are_embedding_layer_positions_ok_for_testing(model):
     return embedding_layer_names(model) == embedding_layer_names_at_input_nodes(model)
 
 
-def gen_test_data(model):
+def gen_test_data(model, options):
     """Generate data for model verification test."""
 
     def set_shape_idx_0_to_1_if_none(shape):
@@ -192,8 +253,8 @@ def gen_test_data(model):
     duration_avg = duration_sum / test_runs
     print('Forward pass took {} s on average.'.format(duration_avg))
     return {
-        'inputs': list(map(show_tensor, as_list(data_in))),
-        'outputs': list(map(show_tensor, as_list(data_out_test)))
+        'inputs': [show_tensor(tens, options) for tens in as_list(data_in)],
+        'outputs': [show_tensor(tens, options) for tens in as_list(data_out_test)]
     }
 
 
@@ -202,8 +263,154 @@ def split_every(size, seq):
     return (seq[pos:pos + size] for pos in range(0, len(seq), size))
 
 
-def encode_floats(arr):
+class FloatBlob:
+    """Float array to be stored as a raw blob in the binary model format."""
+
+    def __init__(self, arr):
+        self.arr = np.asarray(arr, dtype=np.float32).flatten()
+
+
+class ByteBlob:
+    """Non-float array to be stored as a raw blob in the binary model format."""
+
+    def __init__(self, arr):
+        self.arr = np.asarray(arr).flatten()
+
+
+def encode_typed_array(arr, dtype, options):
+    """Serialize a sequence of non-float values, given in the little-endian layout of dtype."""
+    if options.as_blobs:
+        data = ByteBlob(arr)
+    else:
+        data = list(split_every(1024, base64.b64encode(arr.tobytes()).decode('ascii')))
+    return {'dtype': dtype, 'bytes': data}
+
+
+def encode_int8(arr, options):
+    """Serialize a sequence of int8 values."""
+    return encode_typed_array(np.asarray(arr, dtype=np.int8), 'int8', options)
+
+
+def encode_half(arr, options):
+    """Serialize a sequence of floats as 16-bit floats (options.half_precision),
+    i.e., their bit patterns as uint16 values, rounded to the nearest value.
+    """
+    arr = np.asarray(arr, dtype=np.float32).flatten()
+    if options.half_precision == 'float16':
+        bits = arr.astype('<f2').view('<u2')
+    else:
+        assert options.half_precision == 'bfloat16'
+        assert np.all(np.isfinite(arr))
+        # Upper half of the float32 bits, rounded to nearest, ties to even.
+        bits32 = arr.view(np.uint32).astype(np.uint64)
+        bits = ((bits32 + 0x7fff + ((bits32 >> 16) & 1)) >> 16).astype('<u2')
+    return encode_typed_array(bits, options.half_precision, options)
+
+
+def encode_kernel(weights_out_in, weights_in_out, options, prefix=''):
+    """Serialize the kernel of a layer as floats (given as weights_in_out),
+    or as 16-bit floats (transposed, i.e., as weights_out_in) if options.half_precision is set.
+    """
+    if options.half_precision:
+        return {prefix + 'weights_half': encode_half(weights_out_in, options)}
+    return {prefix + 'weights': encode_floats(weights_in_out, options)}
+
+
+def show_recurrent_kernels(input_weights, recurrent_weights, options, prefix=''):
+    """Serialize the input and recurrent kernels of a recurrent layer,
+    as floats in the Keras layout, or transposed as int8 values if options.quantize_int8 is set,
+    or as 16-bit floats if options.half_precision is set.
+    """
+    if options.quantize_int8:
+        result = show_int8_weights(input_weights.T, options, prefix)
+        result.update(show_int8_weights(recurrent_weights.T, options, prefix + 'recurrent_'))
+        return result
+    if options.half_precision:
+        return {prefix + 'weights_half': encode_half(input_weights.T, options),
+                prefix + 'recurrent_weights_half': encode_half(recurrent_weights.T, options)}
+    return {prefix + 'weights': encode_floats(input_weights, options),
+            prefix + 'recurrent_weights': encode_floats(recurrent_weights, options)}
+
+
+def quantize_weights_int8(weights):
+    """Quantize a (n_out, n_in) weight matrix symmetrically to int8,
+    with one scale per output channel (row), calibrated to its maximum absolute value.
+    """
+    scales = np.max(np.abs(weights), axis=1) / 127
+    safe_scales = np.where(scales > 0, scales, 1)
+    quantized = np.clip(np.round(weights / safe_scales[:, np.newaxis]), -127, 127)
+    return quantized.astype(np.int8), scales.astype(np.float32)
+
+
+def show_int8_weights(weights_out_in, options, prefix=''):
+    """Serialize the (n_out, n_in) weights of a dense layer, convolution
+    or recurrent kernel quantized to int8."""
+    quantized, scales = quantize_weights_int8(weights_out_in)
+    return {
+        prefix + 'weights_int8': encode_int8(quantized, options),
+        prefix + 'weights_scales': encode_floats(scales, options)
+    }
+
+
+def palettize_weights_4bit(weights, iterations=30):
+    """Cluster the weights of a layer into (up to) 16 values with k-means
+    (Lloyd's algorithm, which in one dimension only needs sorted centroids).
+    Returns the index of the cluster of each weight and the cluster centroids.
+    """
+    flat = weights.flatten().astype(np.float64)
+    centroids = np.unique(np.quantile(flat, np.linspace(0, 1, 16)))
+    for _ in range(iterations):
+        labels = np.searchsorted((centroids[1:] + centroids[:-1]) / 2, flat)
+        counts = np.bincount(labels, minlength=len(centroids))
+        sums = np.bincount(labels, weights=flat, minlength=len(centroids))
+        centroids = np.sort(np.where(counts > 0, sums / np.maximum(counts, 1), centroids))
+    labels = np.searchsorted((centroids[1:] + centroids[:-1]) / 2, flat)
+    return labels.reshape(weights.shape).astype(np.uint8), centroids.astype(np.float32)
+
+
+def show_palettized_weights(weights_out_in, options):
+    """Serialize the (n_out, n_in) weights of a dense layer or convolution
+    as 4-bit indices into a palette, packed into bytes row by row,
+    two per byte, with the first one in the lower half.
+    """
+    indices, palette = palettize_weights_4bit(weights_out_in)
+    n_out, n_in = indices.shape
+    padded = np.zeros((n_out, n_in + n_in % 2), dtype=np.uint8)
+    padded[:, :n_in] = indices
+    packed = padded[:, 0::2] | (padded[:, 1::2] << 4)
+    encoded_indices = encode_typed_array(np.require(packed, requirements='C'), 'uint4', options)
+    encoded_indices['shape'] = [int(n_out), int(n_in)]
+    return {
+        'weights_palette_indices': encoded_indices,
+        'weights_palette': encode_floats(palette, options)
+    }
+
+
+def factorize_low_rank(weights_in_out, tolerance):
+    """Factorize a (n_in, n_out) weight matrix W into U (n_in, rank) and V (rank, n_out)
+    with a truncated singular value decomposition, using the smallest rank
+    for which the Frobenius norm of W - U V is at most tolerance times the one of W.
+    Returns None if the factors would not have fewer values than W.
+    """
+    n_in, n_out = weights_in_out.shape
+    u, s, vt = np.linalg.svd(weights_in_out.astype(np.float64), full_matrices=False)
+    squared = s ** 2
+    total = np.sum(squared)
+    if total == 0:
+        return None
+    remaining = np.append(total - np.cumsum(squared), 0)
+    rank = int(np.argmax(remaining <= (tolerance ** 2) * total)) + 1
+    rank = min(rank, len(s))
+    if rank * (n_in + n_out) >= n_in * n_out:
+        return None
+    return (np.ascontiguousarray(u[:, :rank] * s[:rank], dtype=np.float32),
+            np.ascontiguousarray(vt[:rank], dtype=np.float32))
+
+
+def encode_floats(arr, options):
     """Serialize a sequence of floats."""
+    if options.as_blobs:
+        return FloatBlob(arr)
     if STORE_FLOATS_HUMAN_READABLE:
         return arr.flatten().tolist()
     return list(split_every(1024, base64.b64encode(arr).decode('ascii')))
@@ -227,7 +434,7 @@ def prepare_filter_weights_conv_1d(weights):
     return np.moveaxis(weights, [0, 1, 2], [1, 2, 0]).flatten()
 
 
-def show_conv_1d_layer(layer):
+def show_conv_1d_layer(layer, options):
     """Serialize Conv1D layer to dict"""
     weights = layer.get_weights()
     assert len(weights) == 1 or len(weights) == 2
@@ -236,16 +443,23 @@ def show_conv_1d_layer(layer):
     assert layer.padding in ['valid', 'same', 'causal']
     assert len(layer.input_shape) == 3
     assert layer.input_shape[0] in {None, 1}
-    result = {
-        'weights': encode_floats(weights_flat)
-    }
+    if options.quantize_int8 and layer.dilation_rate == (1,):
+        result = show_int8_weights(weights_flat.reshape(weights[0].shape[-1], -1), options)
+    elif options.palettize_4bit and layer.dilation_rate == (1,):
+        result = show_palettized_weights(weights_flat.reshape(weights[0].shape[-1], -1), options)
+    elif layer.dilation_rate == (1,):
+        result = encode_kernel(weights_flat, weights_flat, options)
+    else:
+        result = {
+            'weights': encode_floats(weights_flat, options)
+        }
     if len(weights) == 2:
         bias = weights[1]
-        result['bias'] = encode_floats(bias)
+        result['bias'] = encode_floats(bias, options)
     return result
 
 
-def show_conv_2d_layer(layer):
+def show_conv_2d_layer(layer, options):
     """Serialize Conv2D layer to dict"""
     weights = layer.get_weights()
     assert len(weights) == 1 or len(weights) == 2
@@ -254,16 +468,23 @@ def show_conv_2d_layer(layer):
     assert layer.padding in ['valid', 'same']
     assert len(layer.input_shape) == 4
     assert layer.input_shape[0] in {None, 1}
-    result = {
-        'weights': encode_floats(weights_flat)
-    }
+    if options.quantize_int8 and layer.dilation_rate == (1, 1):
+        result = show_int8_weights(weights_flat.reshape(weights[0].shape[-1], -1), options)
+    elif options.palettize_4bit and layer.dilation_rate == (1, 1):
+        result = show_palettized_weights(weights_flat.reshape(weights[0].shape[-1], -1), options)
+    elif layer.dilation_rate == (1, 1):
+        result = encode_kernel(weights_flat, weights_flat, options)
+    else:
+        result = {
+            'weights': encode_floats(weights_flat, options)
+        }
     if len(weights) == 2:
         bias = weights[1]
-        result['bias'] = encode_floats(bias)
+        result['bias'] = encode_floats(bias, options)
     return result
 
 
-def show_separable_conv_2d_layer(layer):
+def show_separable_conv_2d_layer(layer, options):
     """Serialize SeparableConv2D layer to dict"""
     weights = layer.get_weights()
     assert layer.depth_multiplier == 1
@@ -279,16 +500,16 @@ def show_separable_conv_2d_layer(layer):
     assert len(layer.input_shape) == 4
     assert layer.input_shape[0] in {None, 1}
     result = {
-        'slice_weights': encode_floats(slice_weights),
-        'stack_weights': encode_floats(stack_weights),
+        'slice_weights': encode_floats(slice_weights, options),
+        'stack_weights': encode_floats(stack_weights, options),
     }
     if len(weights) == 3:
         bias = weights[2]
-        result['bias'] = encode_floats(bias)
+        result['bias'] = encode_floats(bias, options)
     return result
 
 
-def show_depthwise_conv_2d_layer(layer):
+def show_depthwise_conv_2d_layer(layer, options):
     """Serialize DepthwiseConv2D layer to dict"""
     weights = layer.get_weights()
     assert layer.depth_multiplier == 1
@@ -302,74 +523,84 @@ def show_depthwise_conv_2d_layer(layer):
     assert len(layer.input_shape) == 4
     assert layer.input_shape[0] in {None, 1}
     result = {
-        'slice_weights': encode_floats(slice_weights),
+        'slice_weights': encode_floats(slice_weights, options),
     }
     if len(weights) == 2:
         bias = weights[1]
-        result['bias'] = encode_floats(bias)
+        result['bias'] = encode_floats(bias, options)
     return result
 
 
-def show_batch_normalization_layer(layer):
+def show_batch_normalization_layer(layer, options):
     """Serialize batch normalization layer to dict"""
     moving_mean = K.get_value(layer.moving_mean)
     moving_variance = K.get_value(layer.moving_variance)
     result = {}
-    result['moving_mean'] = encode_floats(moving_mean)
-    result['moving_variance'] = encode_floats(moving_variance)
+    result['moving_mean'] = encode_floats(moving_mean, options)
+    result['moving_variance'] = encode_floats(moving_variance, options)
     if layer.center:
         beta = K.get_value(layer.beta)
-        result['beta'] = encode_floats(beta)
+        result['beta'] = encode_floats(beta, options)
     if layer.scale:
         gamma = K.get_value(layer.gamma)
-        result['gamma'] = encode_floats(gamma)
+        result['gamma'] = encode_floats(gamma, options)
     return result
 
 
-def show_dense_layer(layer):
+def show_dense_layer(layer, options):
     """Serialize dense layer to dict"""
     weights = layer.get_weights()
     assert len(weights) == 1 or len(weights) == 2
     assert len(weights[0].shape) == 2
     weights_flat = weights[0].flatten()
-    result = {
-        'weights': encode_floats(weights_flat)
-    }
+    low_rank = None if options.low_rank_tolerance is None \
+        else factorize_low_rank(weights[0], options.low_rank_tolerance)
+    if low_rank is not None:
+        print('Factorizing {} ({}x{}) with rank {}.'.format(
+            layer.name, weights[0].shape[0], weights[0].shape[1], low_rank[1].shape[0]))
+        result = {
+            'weights_low_rank_u': encode_floats(low_rank[0], options),
+            'weights_low_rank_v': encode_floats(low_rank[1], options)
+        }
+    elif options.quantize_int8:
+        result = show_int8_weights(weights[0].T, options)
+    elif options.palettize_4bit:
+        result = show_palettized_weights(weights[0].T, options)
+    else:
+        result = encode_kernel(weights[0].T, weights_flat, options)
     if len(weights) == 2:
         bias = weights[1]
-        result['bias'] = encode_floats(bias)
+        result['bias'] = encode_floats(bias, options)
     return result
 
 
-def show_prelu_layer(layer):
+def show_prelu_layer(layer, options):
     """Serialize prelu layer to dict"""
     weights = layer.get_weights()
     assert len(weights) == 1
     weights_flat = weights[0].flatten()
     result = {
-        'alpha': encode_floats(weights_flat)
+        'alpha': encode_floats(weights_flat, options)
     }
     return result
 
 
-def show_relu_layer(layer):
+def show_relu_layer(layer, options):
     """Serialize relu layer to dict"""
     assert layer.negative_slope == 0
     assert layer.threshold == 0
     return {}
 
 
-def show_embedding_layer(layer):
+def show_embedding_layer(layer, options):
     """Serialize Embedding layer to dict"""
     weights = layer.get_weights()
     assert len(weights) == 1
-    result = {
-        'weights': encode_floats(weights[0])
-    }
-    return result
+    # One row per vocabulary item either way.
+    return encode_kernel(weights[0], weights[0], options)
 
 
-def show_lstm_layer(layer):
+def show_lstm_layer(layer, options):
     """Serialize LSTM layer to dict"""
     assert not layer.go_backwards
     assert not layer.unroll
@@ -377,27 +608,25 @@ def show_lstm_layer(layer):
     if isinstance(layer.input, list):
         assert len(layer.input) in [1, 3]
     assert len(weights) == 2 or len(weights) == 3
-    result = {'weights': encode_floats(weights[0]),
-              'recurrent_weights': encode_floats(weights[1])}
+    result = show_recurrent_kernels(weights[0], weights[1], options)
 
     if len(weights) == 3:
-        result['bias'] = encode_floats(weights[2])
+        result['bias'] = encode_floats(weights[2], options)
 
     return result
 
 
-def show_gru_layer(layer):
+def show_gru_layer(layer, options):
     """Serialize GRU layer to dict"""
     assert not layer.go_backwards
     assert not layer.unroll
     assert not layer.return_state
     weights = layer.get_weights()
     assert len(weights) == 2 or len(weights) == 3
-    result = {'weights': encode_floats(weights[0]),
-              'recurrent_weights': encode_floats(weights[1])}
+    result = show_recurrent_kernels(weights[0], weights[1], options)
 
     if len(weights) == 3:
-        result['bias'] = encode_floats(weights[2])
+        result['bias'] = encode_floats(weights[2], options)
 
     return result
 
@@ -407,7 +636,7 @@ def transform_cudnn_weights(input_weights, recurrent_weights, n_gates):
            transform_kernels(recurrent_weights, n_gates, transform_recurrent_kernel)
 
 
-def show_cudnn_lstm_layer(layer):
+def show_cudnn_lstm_layer(layer, options):
     """Serialize a GPU-trained LSTM layer to dict"""
     weights = layer.get_weights()
     if isinstance(layer.input, list):
@@ -417,14 +646,13 @@ def show_cudnn_lstm_layer(layer):
     n_gates = 4
     input_weights, recurrent_weights = transform_cudnn_weights(weights[0], weights[1], n_gates)
 
-    result = {'weights': encode_floats(input_weights),
-              'recurrent_weights': encode_floats(recurrent_weights),
-              'bias': encode_floats(transform_bias(weights[2]))}
+    result = show_recurrent_kernels(input_weights, recurrent_weights, options)
+    result['bias'] = encode_floats(transform_bias(weights[2]), options)
 
     return result
 
 
-def show_cudnn_gru_layer(layer):
+def show_cudnn_gru_layer(layer, options):
     """Serialize a GPU-trained GRU layer to dict"""
     weights = layer.get_weights()
     assert len(weights) == 3  # CuDNN GRU always has a bias
@@ -432,9 +660,8 @@ def show_cudnn_gru_layer(layer):
     n_gates = 3
     input_weights, recurrent_weights = transform_cudnn_weights(weights[0], weights[1], n_gates)
 
-    result = {'weights': encode_floats(input_weights),
-              'recurrent_weights': encode_floats(recurrent_weights),
-              'bias': encode_floats(weights[2])}
+    result = show_recurrent_kernels(input_weights, recurrent_weights, options)
+    result['bias'] = encode_floats(weights[2], options)
 
     return result
 
@@ -461,7 +688,7 @@ def get_transform_func(layer):
     return input_transform_func, recurrent_transform_func, bias_transform_func
 
 
-def show_bidirectional_layer(layer):
+def show_bidirectional_layer(layer, options):
     """Serialize Bidirectional layer to dict"""
     forward_weights = layer.forward_layer.get_weights()
     assert len(forward_weights) == 2 or len(forward_weights) == 3
@@ -473,26 +700,27 @@ def show_bidirectional_layer(layer):
     backward_input_transform_func, backward_recurrent_transform_func, backward_bias_transform_func = get_transform_func(
         layer.backward_layer)
 
-    result = {'forward_weights': encode_floats(forward_input_transform_func(forward_weights[0])),
-              'forward_recurrent_weights': encode_floats(forward_recurrent_transform_func(forward_weights[1])),
-              'backward_weights': encode_floats(backward_input_transform_func(backward_weights[0])),
-              'backward_recurrent_weights': encode_floats(backward_recurrent_transform_func(backward_weights[1]))}
+    result = merge_two_disjunct_dicts(
+        show_recurrent_kernels(forward_input_transform_func(forward_weights[0]),
+                               forward_recurrent_transform_func(forward_weights[1]), options, 'forward_'),
+        show_recurrent_kernels(backward_input_transform_func(backward_weights[0]),
+                               backward_recurrent_transform_func(backward_weights[1]), options, 'backward_'))
 
     if len(forward_weights) == 3:
-        result['forward_bias'] = encode_floats(forward_bias_transform_func(forward_weights[2]))
+        result['forward_bias'] = encode_floats(forward_bias_transform_func(forward_weights[2]), options)
     if len(backward_weights) == 3:
-        result['backward_bias'] = encode_floats(backward_bias_transform_func(backward_weights[2]))
+        result['backward_bias'] = encode_floats(backward_bias_transform_func(backward_weights[2]), options)
 
     return result
 
 
-def show_input_layer(layer):
+def show_input_layer(layer, options):
     """Serialize input layer to dict"""
     assert not layer.sparse
     return {}
 
 
-def show_softmax_layer(layer):
+def show_softmax_layer(layer, options):
     """Serialize softmax layer to dict"""
     assert layer.axis == -1
 
@@ -525,7 +753,7 @@ def get_layer_functions_dict():
     }
 
 
-def show_time_distributed_layer(layer):
+def show_time_distributed_layer(layer, options):
     show_layer_functions = get_layer_functions_dict()
     config = layer.get_config()
     class_name = config['layer']['class_name']
@@ -563,7 +791,7 @@ def show_time_distributed_layer(layer):
 
         setattr(copied_layer, "output_shape", getattr(layer, "output_shape"))
 
-        return layer_function(copied_layer)
+        return layer_function(copied_layer, options)
 
     else:
         return None
@@ -594,7 +822,7 @@ def is_ascii(some_string):
         return True
 
 
-def get_all_weights(model):
+def get_all_weights(model, options):
     """Serialize all weights of the models layers"""
     show_layer_functions = get_layer_functions_dict()
     result = {}
@@ -603,7 +831,7 @@ def get_all_weights(model):
     for layer in layers:
         layer_type = type(layer).__name__
         if layer_type in ['Model', 'Sequential']:
-            result = merge_two_disjunct_dicts(result, get_all_weights(layer))
+            result = merge_two_disjunct_dicts(result, get_all_weights(layer, options))
         else:
             if hasattr(layer, 'data_format'):
                 if layer_type in ['AveragePooling1D', 'MaxPooling1D', 'AveragePooling2D', 'MaxPooling2D',
@@ -620,15 +848,17 @@ def get_all_weights(model):
                 raise ValueError('duplicate layer name ' + name)
             shown_layer = None
             if show_func:
-                shown_layer = show_func(layer)
+                shown_layer = show_func(layer, options)
             if shown_layer:
                 result[name] = shown_layer
             if show_func and layer_type == 'TimeDistributed':
                 if name not in result:
                     result[name] = {}
 
-                result[name]['td_input_len'] = encode_floats(np.array([len(layer.input_shape) - 1], dtype=np.float32))
-                result[name]['td_output_len'] = encode_floats(np.array([len(layer.output_shape) - 1], dtype=np.float32))
+                result[name]['td_input_len'] = encode_floats(
+                    np.array([len(layer.input_shape) - 1], dtype=np.float32), options)
+                result[name]['td_output_len'] = encode_floats(
+                    np.array([len(layer.output_shape) - 1], dtype=np.float32), options)
     return result
 
 
@@ -745,7 +975,7 @@ def singleton_list_to_value(value_or_values):
     return value_or_values
 
 
-def model_to_fdeep_json(model, no_tests=False):
+def model_to_fdeep_json(model, no_tests=False, tests_as_blobs=False, options=ConversionOptions()):
     """Convert any Keras model to the frugally-deep model format."""
 
     # Force creation of underlying functional model.
@@ -755,7 +985,8 @@ def model_to_fdeep_json(model, no_tests=False):
 
     model = convert_sequential_to_model(model)
 
-    test_data = None if no_tests else gen_test_data(model)
+    test_data = None if no_tests else gen_test_data(
+        model, options._replace(as_blobs=True) if tests_as_blobs else options)
 
     json_output = {}
     print('Converting model architecture.')
@@ -768,7 +999,7 @@ def model_to_fdeep_json(model, no_tests=False):
         json_output['tests'] = [test_data]
 
     print('Converting model weights.')
-    json_output['trainable_params'] = get_all_weights(model)
+    json_output['trainable_params'] = get_all_weights(model, options)
     print('Done converting model weights.')
 
     print('Calculating model hash.')
@@ -778,39 +1009,87 @@ def model_to_fdeep_json(model, no_tests=False):
     return json_output
 
 
-def convert(in_path, out_path, no_tests=False):
-    """Convert any (h5-)stored Keras model to the frugally-deep model format."""
+def convert(in_path, out_path, no_tests=False, binary=False, tests_sidecar=False, quantize_int8=False,
+            half_precision=None, palettize_4bit=False, low_rank_tolerance=None):
+    """Convert any (h5-)stored Keras model to the frugally-deep model format.
+    With tests_sidecar, the test data is written to a separate file
+    (in the binary format) next to the model, named like it plus ".tests",
+    which is only read if the model is verified when loading it.
+    With quantize_int8, the weights of dense layers, (non-dilated) convolutions
+    and the kernels of recurrent layers are stored as int8 values,
+    with one scale per output channel.
+    The test data still holds the outputs of the original model,
+    so the model needs a larger verify_epsilon when loading it.
+    With half_precision ('float16' or 'bfloat16'), the kernels of dense,
+    (non-dilated) convolution, embedding and recurrent layers,
+    unless quantized to int8, are stored as 16-bit floats, which halves their size.
+    With palettize_4bit, the weights of dense layers and (non-dilated) convolutions
+    are clustered into 16 values per layer, and stored as 4-bit indices.
+    With low_rank_tolerance, the kernels of dense layers are stored as the factors
+    of a truncated singular value decomposition, with the smallest rank
+    keeping the relative error of the kernel within this tolerance,
+    if this needs less values than the kernel (instead of the options above).
+    Whether the accuracy of the model is sufficient with it,
+    can be checked with the test data when loading the model.
+    """
+    assert half_precision in [None, 'float16', 'bfloat16']
+    assert not (quantize_int8 and palettize_4bit)
+    assert low_rank_tolerance is None or low_rank_tolerance >= 0
 
     print('loading {}'.format(in_path))
     model = load_model(in_path)
-    json_output = model_to_fdeep_json(model, no_tests)
+    options = ConversionOptions(as_blobs=binary, quantize_int8=quantize_int8, half_precision=half_precision,
+                                palettize_4bit=palettize_4bit, low_rank_tolerance=low_rank_tolerance)
+    json_output = model_to_fdeep_json(model, no_tests, tests_sidecar, options)
+    if tests_sidecar and 'tests' in json_output:
+        tests_path = out_path + '.tests'
+        print('writing {}'.format(tests_path))
+        write_binary_file(tests_path, {'tests': json_output.pop('tests')})
+        json_output['tests_file'] = os.path.basename(tests_path)
     print('writing {}'.format(out_path))
-    write_text_file(out_path, json.dumps(
-        json_output, allow_nan=False, indent=2, sort_keys=True))
-
-
-def main():
-    """Parse command line and convert model."""
+    if binary:
+        write_binary_file(out_path, json_output)
+    else:
+        write_text_file(out_path, json.dumps(
+            json_output, allow_nan=False, indent=2, sort_keys=True))
 
-    usage = 'usage: [Keras model in HDF5 format] [output path] (--no-tests)'
 
-    # todo: Use ArgumentParser instead.
-    if len(sys.argv) not in [3, 4]:
-        print(usage)
-        sys.exit(1)
+def non_negative_float(value):
+    """Parse a float, which must not be negative"""
+    result = float(value)
+    if result < 0:
+        raise argparse.ArgumentTypeError('must not be negative: {}'.format(value))
+    return result
 
-    in_path = sys.argv[1]
-    out_path = sys.argv[2]
 
-    no_tests = False
-    if len(sys.argv) == 4:
-        if sys.argv[3] not in ['--no-tests']:
-            print(usage)
-            sys.exit(1)
-        if sys.argv[3] == '--no-tests':
-            no_tests = True
+def main():
+    """Parse command line and convert model."""
 
-    convert(in_path, out_path, no_tests)
+    parser = argparse.ArgumentParser(description='Convert a Keras model to the frugally-deep format.')
+    parser.add_argument('in_path', help='Keras model in HDF5 format')
+    parser.add_argument('out_path', help='output path')
+    parser.add_argument('--no-tests', action='store_true',
+                        help='do not store test data to verify the model with when loading it')
+    parser.add_argument('--binary', action='store_true',
+                        help='write the binary model format')
+    parser.add_argument('--tests-sidecar', action='store_true',
+                        help='write the test data to a separate file')
+    compact_weights = parser.add_mutually_exclusive_group()
+    compact_weights.add_argument('--quantize-int8', action='store_true',
+                                 help='store the weights of dense layers, convolutions and recurrent kernels as int8')
+    compact_weights.add_argument('--palettize-4bit', action='store_true',
+                                 help='store the weights of dense layers and convolutions as 4-bit palette indices')
+    half_precision = parser.add_mutually_exclusive_group()
+    half_precision.add_argument('--float16', action='store_const', dest='half_precision', const='float16',
+                                help='store kernels as 16-bit floats')
+    half_precision.add_argument('--bfloat16', action='store_const', dest='half_precision', const='bfloat16',
+                                help='store kernels as bfloat16 values')
+    parser.add_argument('--low-rank', type=non_negative_float, metavar='TOLERANCE',
+                        help='factorize dense kernels, keeping the relative error within this tolerance')
+    args = parser.parse_args()
+
+    convert(args.in_path, args.out_path, args.no_tests, args.binary, args.tests_sidecar, args.quantize_int8,
+            args.half_precision, args.palettize_4bit, args.low_rank)
 
 
 if __name__ == "__main__":
@@ -5,6 +5,7 @@
 import sys
 
 import numpy as np
+from tensorflow.keras.initializers import Constant
 from tensorflow.keras.layers import BatchNormalization, Concatenate
 from tensorflow.keras.layers import Bidirectional, TimeDistributed
 from tensorflow.keras.layers import Conv1D, ZeroPadding1D, Cropping1D
@@ -414,7 +415,8 @@ def get_test_model_recurrent():
         (17, 4),
         (1, 10),
         (20, 40),
-        (6, 7, 10, 3)
+        (6, 7, 10, 3),
+        (64, 48)
     ]
 
     outputs = []
@@ -465,6 +467,14 @@ def get_test_model_recurrent():
     outputs.append(TimeDistributed(MaxPooling2D(2, 2))(inputs[3]))
     outputs.append(TimeDistributed(AveragePooling2D(2, 2))(inputs[3]))
 
+    # Long enough for Bidirectional to run both directions in parallel.
+    outputs.append(Bidirectional(LSTM(units=16,
+                                      return_sequences=True,
+                                      bias_initializer='random_uniform'), merge_mode='mul')(inputs[4]))
+    outputs.append(Bidirectional(GRU(units=16,
+                                     return_sequences=False,
+                                     bias_initializer='random_uniform'), merge_mode='sum')(inputs[4]))
+
     model = Model(inputs=inputs, outputs=outputs, name='test_model_recurrent')
     model.compile(loss='mse', optimizer='nadam')
 
@@ -548,6 +558,13 @@ def get_test_model_lstm():
     outputs.extend(LSTM(units=12, return_sequences=True,
                         return_state=True)(inputs[2], initial_state=[inputs[3], inputs[4]]))
 
+    # predict_batch runs sequences of different lengths in lockstep,
+    # also backwards in Bidirectional.
+    outputs.append(LSTM(units=5, return_sequences=True)(inputs[2]))
+    lstm_bidi_variable = Bidirectional(LSTM(units=4, return_sequences=True))(inputs[2])
+    outputs.append(lstm_bidi_variable)
+    outputs.append(Bidirectional(LSTM(units=3), merge_mode='ave')(lstm_bidi_variable))
+
     model = Model(inputs=inputs, outputs=outputs, name='test_model_lstm')
     model.compile(loss='mse', optimizer='nadam')
 
@@ -572,7 +589,8 @@ def get_test_model_gru_stateful_optional(stateful):
     """Returns a test model for Gated Recurrent Unit (GRU) layers."""
     input_shapes = [
         (17, 4),
-        (1, 10)
+        (1, 10),
+        (None, 4)
     ]
     stateful_batch_size = 1
     inputs = [Input(batch_shape=(stateful_batch_size,) + s) for s in input_shapes]
@@ -659,6 +677,8 @@ def get_test_model_variable():
         (None, None, 1),
         (None, None, 3),
         (None, 4),
+        (None, 7, 10, 3),
+        (None, 5),
     ]
 
     inputs = [Input(shape=s) for s in input_shapes]
@@ -678,6 +698,13 @@ def get_test_model_variable():
     outputs.append(PReLU(shared_axes=[1, 2, 3])(inputs[1]))
     outputs.append(PReLU(shared_axes=[1])(inputs[2]))
 
+    # All time steps are processed at once.
+    # The tests compare the results with the ones of single time steps.
+    outputs.append(TimeDistributed(Dense(5, activation='softmax'))(inputs[4]))
+    outputs.append(TimeDistributed(Dense(4, activation='relu'))(inputs[3]))
+    outputs.append(TimeDistributed(Conv2D(4, (3, 3), padding='same', activation='softmax'))(inputs[3]))
+    outputs.append(TimeDistributed(Conv2D(2, (3, 3), strides=2))(inputs[3]))
+
     model = Model(inputs=inputs, outputs=outputs, name='test_model_variable')
     model.compile(loss='mse', optimizer='nadam')
 
@@ -722,6 +749,103 @@ def get_test_model_sequential():
     return model
 
 
+def prune_weights(layer, sparsity, block_size):
+    """Sets a random fraction of the blocks of block_size consecutive
+    input weights of each output channel of a dense layer or convolution to zero."""
+    weights = layer.get_weights()
+    kernel = weights[0].reshape(-1, weights[0].shape[-1])
+    keep = np.random.random((kernel.shape[0] // block_size, kernel.shape[1])) >= sparsity
+    kernel = kernel * np.repeat(keep, block_size, axis=0)
+    layer.set_weights([kernel.reshape(weights[0].shape)] + weights[1:])
+
+
+def kill_channels(layer, channels, bias=None):
+    """Sets all weights of some output channels of a dense layer
+    or convolution to zero, and their bias to the given value if any."""
+    weights = layer.get_weights()
+    weights[0][..., channels] = 0
+    if bias is not None:
+        weights[1][channels] = bias
+    layer.set_weights(weights)
+
+
+def get_test_model_pruned():
+    """Returns a model with pruned (mostly zero) weights,
+    with dead channels, i.e., channels with constant values,
+    with a low-rank kernel, and with mostly zero activations."""
+    input_shapes = [
+        (512,),
+        (16, 16, 16),
+        (12, 12, 8),
+    ]
+
+    inputs = [Input(shape=s) for s in input_shapes]
+
+    dense = Dense(256, activation='relu')
+    dense_blocks = Dense(64)
+    conv = Conv2D(32, (3, 3))
+    conv_blocks = Conv2D(32, (3, 3), padding='same')
+
+    low_rank_dense = Dense(256)
+    # Most values are zero after the ReLU.
+    sparse_relu = Dense(1024, activation='relu', bias_initializer=Constant(-1))
+    dead_dense = Dense(32, activation='elu')
+    dead_conv = Conv2D(16, (3, 3), activation='relu')
+    dead_bn = BatchNormalization()
+    dead_conv_same = Conv2D(8, (3, 3), padding='same', activation='relu')
+
+    x = dead_conv(inputs[2])
+    x = dead_bn(x)
+    x = LeakyReLU()(x)
+    x = Conv2D(8, (3, 3))(x)
+    x = dead_conv_same(x)
+    x = Conv2D(4, (3, 3), padding='same')(x)
+
+    outputs = [
+        dense(inputs[0]),
+        dense_blocks(inputs[0]),
+        conv(inputs[1]),
+        conv_blocks(inputs[1]),
+        Dense(8)(dead_dense(inputs[0])),
+        x,
+        low_rank_dense(inputs[0]),
+        Dense(256)(sparse_relu(inputs[0])),
+    ]
+
+    model = Model(inputs=inputs, outputs=outputs, name='test_model_pruned')
+    model.compile(loss='mse', optimizer='nadam')
+
+    # fit to dummy data
+    training_data_size = 1
+    data_in = generate_input_data(training_data_size, input_shapes)
+    initial_data_out = model.predict(data_in)
+    data_out = generate_output_data(training_data_size, initial_data_out)
+    model.fit(data_in, data_out, epochs=10)
+
+    prune_weights(dense, 0.9, 1)
+    prune_weights(dense_blocks, 0.8, 8)
+    prune_weights(conv, 0.9, 1)
+    prune_weights(conv_blocks, 0.9, 8)
+
+    # The next layer is a dense layer or a convolution without padding,
+    # so the constant values of the dead channels can be folded into its bias.
+    kill_channels(dead_dense, [1, 5, 6, 20], 0.25)
+    kill_channels(dead_conv, [0, 3, 4, 11], 0.5)
+    gamma, beta, moving_mean, moving_variance = dead_bn.get_weights()
+    gamma[[7, 9]] = 0
+    dead_bn.set_weights([gamma, beta, moving_mean, moving_variance])
+    # The next convolution pads, so only the channels with zero values
+    # can be removed.
+    kill_channels(dead_conv_same, [2, 5], -0.5)
+    kill_channels(dead_conv_same, [6], 0.5)
+
+    low_rank_weights = low_rank_dense.get_weights()
+    low_rank_weights[0] = np.matmul(
+        np.random.normal(0, 0.2, (512, 16)), np.random.normal(0, 0.2, (16, 256))).astype(np.float32)
+    low_rank_dense.set_weights(low_rank_weights)
+    return model
+
+
 def get_test_model_lstm_stateful():
     stateful_batch_size = 1
     input_shapes = [
@@ -805,6 +929,48 @@ def get_test_model_lstm_stateful():
     return model
 
 
+def get_test_model_lstm_streaming():
+    return get_test_model_streaming(LSTM, 'test_model_lstm_streaming')
+
+
+def get_test_model_gru_streaming():
+    return get_test_model_streaming(GRU, 'test_model_gru_streaming')
+
+
+def get_test_model_streaming(recurrent_layer, name):
+    """Returns a stateful model with one sequence input of variable length,
+    which can be fed one time step after the other (model::step)."""
+    stateful_batch_size = 1
+    input_shapes = [
+        (None, 4)
+    ]
+    inputs = [Input(batch_shape=(stateful_batch_size,) + s) for s in input_shapes]
+    x = recurrent_layer(
+        stateful=True,
+        units=8,
+        recurrent_activation='sigmoid',
+        return_sequences=True
+    )(inputs[0])
+    x = recurrent_layer(
+        stateful=True,
+        units=6,
+        recurrent_activation='hard_sigmoid',
+        return_sequences=False
+    )(x)
+    outputs = [Dense(3, activation='tanh')(x)]
+
+    model = Model(inputs=inputs, outputs=outputs, name=name)
+    model.compile(loss='mse', optimizer='nadam')
+
+    # fit to dummy data
+    training_data_size = stateful_batch_size
+    data_in = generate_input_data(training_data_size, input_shapes)
+    initial_data_out = model.predict(data_in)
+    data_out = generate_output_data(training_data_size, initial_data_out)
+    model.fit(data_in, data_out, batch_size=stateful_batch_size, epochs=10)
+    return model
+
+
 def main():
     """Generate different test models and save them to the given directory."""
     if len(sys.argv) != 3:
@@ -822,8 +988,11 @@ def main():
             'gru': get_test_model_gru,
             'variable': get_test_model_variable,
             'sequential': get_test_model_sequential,
+            'pruned': get_test_model_pruned,
             'lstm_stateful': get_test_model_lstm_stateful,
-            'gru_stateful': get_test_model_gru_stateful
+            'gru_stateful': get_test_model_gru_stateful,
+            'lstm_streaming': get_test_model_lstm_streaming,
+            'gru_streaming': get_test_model_gru_streaming
         }
 
         if not model_name in get_model_functions:
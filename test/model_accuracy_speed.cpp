@@ -0,0 +1,381 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+// Compares variants of a model, e.g., converted with and without
+// --quantize-int8, --float16 or --palettize-4bit, and loaded in different ways,
+// regarding how far their outputs are off the reference values
+// (the embedded test cases, i.e., the outputs of Keras, or a dataset)
+// and how long a forward pass takes, to find the fastest configuration
+// that is still accurate enough.
+// The compile-time configuration (float type, double accumulation,
+// instruction sets) is compared by building this tool multiple times.
+//
+// Usage:
+//     model_accuracy_speed [options] model_file [model_file ...]
+// Options:
+//     --inputs a.npy[,b.npy,...]   dataset inputs, one file per model input,
+//                                  with the samples along the first axis
+//     --outputs y.npy[,...]        reference outputs of the dataset,
+//                                  one file per model output
+//     --runs N                     timed passes over the test cases (default 10)
+//     --epsilon E                  largest acceptable absolute error
+// Without a dataset, every model file is run on its own test cases,
+// or on the ones of the first model file if it has none.
+// With --epsilon, the exit code is 1 if no configuration is accurate enough.
+
+#include "fdeep/fdeep.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+struct npy_array
+{
+    std::vector<std::size_t> shape_;
+    fdeep::float_vec values_;
+};
+
+std::string npy_header_value(const std::string& header, const std::string& key)
+{
+    const auto key_pos = header.find("'" + key + "':");
+    fdeep::internal::assertion(key_pos != std::string::npos,
+        "npy header is missing " + key);
+    const auto begin = header.find_first_not_of(" ", key_pos + key.size() + 3);
+    const auto end = header[begin] == '('
+        ? header.find(')', begin) + 1
+        : header.find_first_of(",}", begin);
+    return header.substr(begin, end - begin);
+}
+
+// Reads a (C-ordered, little-endian) float32 or float64 array,
+// as written by numpy.save.
+npy_array load_npy(const std::string& path)
+{
+    std::ifstream stream(path, std::ios::binary);
+    fdeep::internal::assertion(stream.good(), "Can not open " + path);
+    const std::vector<char> bytes((std::istreambuf_iterator<char>(stream)),
+        std::istreambuf_iterator<char>());
+    fdeep::internal::assertion(bytes.size() >= 10 &&
+        std::memcmp(bytes.data(), "\x93NUMPY", 6) == 0,
+        path + " is not an npy file");
+    const std::size_t length_size = bytes[6] == 1 ? 2 : 4;
+    std::size_t header_size = 0;
+    for (std::size_t i = 0; i < length_size; ++i)
+    {
+        header_size |= static_cast<std::size_t>(
+            static_cast<unsigned char>(bytes[8 + i])) << (8 * i);
+    }
+    const std::size_t data_begin = 8 + length_size + header_size;
+    fdeep::internal::assertion(data_begin <= bytes.size(),
+        path + " is truncated");
+    const std::string header(bytes.data() + 8 + length_size, header_size);
+
+    const std::string descr = npy_header_value(header, "descr");
+    fdeep::internal::assertion(descr == "'<f4'" || descr == "'<f8'",
+        path + ": only float32 and float64 arrays are supported");
+    fdeep::internal::assertion(
+        npy_header_value(header, "fortran_order") == "False",
+        path + ": only C-ordered arrays are supported");
+
+    npy_array result = {{}, {}};
+    const std::string shape = npy_header_value(header, "shape");
+    std::size_t pos = 1;
+    while (pos < shape.size())
+    {
+        const auto end = shape.find_first_of(",)", pos);
+        const auto dim = fplus::trim_whitespace(shape.substr(pos, end - pos));
+        if (!dim.empty())
+        {
+            result.shape_.push_back(std::stoul(dim));
+        }
+        pos = end + 1;
+    }
+    const std::size_t count = fplus::product(result.shape_);
+    const bool is_double = descr == "'<f8'";
+    const std::size_t value_size = is_double ? sizeof(double) : sizeof(float);
+    fdeep::internal::assertion(
+        bytes.size() - data_begin >= count * value_size,
+        path + " is truncated");
+    result.values_.resize(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        const char* value = bytes.data() + data_begin + i * value_size;
+        if (is_double)
+        {
+            double d;
+            std::memcpy(&d, value, sizeof(d));
+            result.values_[i] = static_cast<fdeep::float_type>(d);
+        }
+        else
+        {
+            float f;
+            std::memcpy(&f, value, sizeof(f));
+            result.values_[i] = static_cast<fdeep::float_type>(f);
+        }
+    }
+    return result;
+}
+
+// One tensor per sample, i.e., per entry along the first axis.
+fdeep::tensors npy_samples(const npy_array& array)
+{
+    fdeep::internal::assertion(!array.shape_.empty(),
+        "npy arrays need a sample axis");
+    std::vector<std::size_t> dims(array.shape_.begin() + 1, array.shape_.end());
+    if (dims.empty())
+    {
+        dims.push_back(1);
+    }
+    const auto shape = fdeep::internal::create_tensor_shape_from_dims(dims);
+    fdeep::tensors result;
+    for (std::size_t i = 0; i < array.shape_.front(); ++i)
+    {
+        const auto begin = array.values_.begin() +
+            static_cast<std::ptrdiff_t>(i * shape.volume());
+        result.push_back(fdeep::tensor(shape,
+            fdeep::float_vec(begin, begin + static_cast<std::ptrdiff_t>(shape.volume()))));
+    }
+    return result;
+}
+
+fdeep::internal::test_cases load_npy_dataset(
+    const std::vector<std::string>& input_paths,
+    const std::vector<std::string>& output_paths)
+{
+    const auto inputs = fplus::transform(fplus::compose(load_npy, npy_samples),
+        input_paths);
+    const auto outputs = fplus::transform(fplus::compose(load_npy, npy_samples),
+        output_paths);
+    const auto all = fplus::append(inputs, outputs);
+    fdeep::internal::assertion(!all.empty() &&
+        fplus::all_the_same_on(fplus::size_of_cont<fdeep::tensors>, all),
+        "all npy files need the same number of samples");
+    fdeep::internal::test_cases result(all.front().size());
+    for (std::size_t i = 0; i < result.size(); ++i)
+    {
+        for (const auto& input : inputs)
+            result[i].input_.push_back(input[i]);
+        for (const auto& output : outputs)
+            result[i].output_.push_back(output[i]);
+    }
+    return result;
+}
+
+// The ways a model file can be loaded that compute differently.
+// Lazy layers skip the removal of dead channels, for example.
+std::vector<std::string> loaders(const std::string& model_file)
+{
+    std::ifstream stream(model_file, std::ios::binary);
+    char magic[8] = {};
+    stream.read(magic, sizeof(magic));
+    if (std::memcmp(magic, fdeep::internal::binary_model_magic, 8) == 0)
+    {
+        return {"load_model_binary", "load_model_binary_lazy"};
+    }
+    return {"load_model"};
+}
+
+fdeep::model load(const std::string& model_file, const std::string& loader)
+{
+    if (loader == "load_model_binary")
+        return fdeep::load_model_binary(model_file, false, nullptr);
+    if (loader == "load_model_binary_lazy")
+        return fdeep::load_model_binary_lazy(model_file, false, nullptr);
+    return fdeep::load_model(model_file, false, nullptr);
+}
+
+// Runs all test cases in one session, as stateful models carry
+// their states from one to the next (like when verifying a model).
+std::vector<fdeep::tensors> run_test_cases(const fdeep::model& model,
+    const fdeep::internal::test_cases& tests)
+{
+    auto session = model.create_session();
+    return fplus::transform(
+        [&](const fdeep::internal::test_case& test)
+        {
+            return model.predict_stateful(session, test.input_);
+        }, tests);
+}
+
+struct configuration_result
+{
+    std::string model_file_;
+    std::string loader_;
+    std::vector<fdeep::internal::output_errors> errors_;
+    double latency_;
+    double max_abs_error() const
+    {
+        return fplus::maximum(fplus::transform(
+            [](const fdeep::internal::output_errors& errors)
+            {
+                return errors.max_abs_error_;
+            }, errors_));
+    }
+};
+
+configuration_result measure(const std::string& model_file,
+    const std::string& loader, const fdeep::internal::test_cases& tests,
+    std::size_t runs)
+{
+    const auto model = load(model_file, loader);
+    configuration_result result = {model_file, loader, {}, 0};
+    // The first pass also warms up the caches.
+    const auto outputs = run_test_cases(model, tests);
+    for (std::size_t i = 0; i < tests.size(); ++i)
+    {
+        fdeep::internal::add_output_errors(result.errors_,
+            outputs[i], tests[i].output_);
+    }
+    // The fastest pass is the least disturbed by other processes.
+    result.latency_ = std::numeric_limits<double>::max();
+    for (std::size_t run = 0; run < runs; ++run)
+    {
+        fplus::stopwatch stopwatch;
+        run_test_cases(model, tests);
+        result.latency_ = std::min(result.latency_,
+            stopwatch.elapsed() / static_cast<double>(tests.size()));
+    }
+    return result;
+}
+
+std::string compile_configuration()
+{
+    std::string result = sizeof(fdeep::float_type) == sizeof(float)
+        ? "float" : "double";
+#if defined(FDEEP_ACCUMULATE_DOUBLE)
+    result += ", FDEEP_ACCUMULATE_DOUBLE";
+#endif
+#if defined(__AVX512F__)
+    result += ", AVX-512";
+#elif defined(__AVX2__)
+    result += ", AVX2";
+#endif
+#if defined(__FMA__)
+    result += ", FMA";
+#endif
+#if defined(__F16C__)
+    result += ", F16C";
+#endif
+#if defined(__AVXVNNI__) || defined(__AVX512VNNI__)
+    result += ", VNNI";
+#endif
+    return result;
+}
+
+void print_usage()
+{
+    std::cerr << "Usage: model_accuracy_speed"
+        << " [--inputs a.npy[,b.npy,...] --outputs y.npy[,...]]"
+        << " [--runs N] [--epsilon E] model_file [model_file ...]" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> model_files;
+    std::vector<std::string> input_paths;
+    std::vector<std::string> output_paths;
+    std::size_t runs = 10;
+    double epsilon = -1;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--inputs" && has_value)
+            input_paths = fplus::split(',', false, std::string(argv[++i]));
+        else if (arg == "--outputs" && has_value)
+            output_paths = fplus::split(',', false, std::string(argv[++i]));
+        else if (arg == "--runs" && has_value)
+            runs = std::stoul(argv[++i]);
+        else if (arg == "--epsilon" && has_value)
+            epsilon = std::stod(argv[++i]);
+        else if (fplus::is_prefix_of(std::string("--"), arg))
+        {
+            print_usage();
+            return 2;
+        }
+        else
+            model_files.push_back(arg);
+    }
+    if (model_files.empty() || input_paths.empty() != output_paths.empty())
+    {
+        print_usage();
+        return 2;
+    }
+
+    const auto dataset = input_paths.empty()
+        ? fdeep::internal::test_cases()
+        : load_npy_dataset(input_paths, output_paths);
+    const auto first_tests = dataset.empty()
+        ? fdeep::internal::load_model_file_test_cases(model_files.front())
+        : dataset;
+
+    std::cout << "Compiled for: " << compile_configuration() << std::endl;
+    std::cout << std::left << std::setw(40) << "model file"
+        << std::setw(24) << "loader" << std::setw(8) << "output"
+        << std::setw(16) << "max abs error" << std::setw(16) << "mean abs error"
+        << "latency [ms]" << std::endl;
+    std::vector<configuration_result> results;
+    for (const auto& model_file : model_files)
+    {
+        auto tests = dataset.empty()
+            ? fdeep::internal::load_model_file_test_cases(model_file)
+            : dataset;
+        if (tests.empty())
+        {
+            tests = first_tests;
+        }
+        fdeep::internal::assertion(!tests.empty(),
+            "No test cases available for " + model_file +
+            ", please provide a dataset.");
+        for (const auto& loader : loaders(model_file))
+        {
+            const auto result = measure(model_file, loader, tests, runs);
+            for (std::size_t i = 0; i < result.errors_.size(); ++i)
+            {
+                std::cout << std::setw(40) << model_file
+                    << std::setw(24) << loader << std::setw(8) << i
+                    << std::setw(16) << result.errors_[i].max_abs_error_
+                    << std::setw(16) << result.errors_[i].mean_abs_error()
+                    << 1000 * result.latency_ << std::endl;
+            }
+            results.push_back(result);
+        }
+    }
+
+    if (epsilon < 0)
+    {
+        return 0;
+    }
+    const auto accurate = fplus::keep_if(
+        [epsilon](const configuration_result& result)
+        {
+            return result.max_abs_error() <= epsilon;
+        }, results);
+    if (accurate.empty())
+    {
+        std::cout << "No configuration is within an error of "
+            << epsilon << "." << std::endl;
+        return 1;
+    }
+    const auto fastest = fplus::minimum_on(
+        [](const configuration_result& result) { return result.latency_; },
+        accurate);
+    std::cout << "Fastest configuration within an error of " << epsilon << ": "
+        << fastest.model_file_ << " (" << fastest.loader_ << "), "
+        << 1000 * fastest.latency_ << " ms" << std::endl;
+    return 0;
+}
@@ -20,3 +20,13 @@ TEST_CASE("test_model_embedding_test, load_model")
     model.predict_multi(multi_inputs, false);
     model.predict_multi(multi_inputs, true);
 }
+
+TEST_CASE("test_model_embedding_test, load_model_bfloat16")
+{
+    const auto model = fdeep::load_model("../test_model_embedding_bfloat16.json",
+        true, fdeep::cout_logger, static_cast<fdeep::float_type>(0.01));
+    const auto multi_inputs = fplus::generate<std::vector<fdeep::tensors>>(
+        [&]() -> fdeep::tensors {return model.generate_dummy_inputs();},
+        10);
+    model.predict_multi(multi_inputs, false);
+}
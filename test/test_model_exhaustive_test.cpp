@@ -8,6 +8,9 @@
 #include "doctest/doctest.h"
 #include <fdeep/fdeep.hpp>
 
+#include <cstdio>
+#include <string>
+
 TEST_CASE("test_model_exhaustive_test, load_model")
 {
     const auto model = fdeep::load_model("../test_model_exhaustive.json",
@@ -18,3 +21,128 @@ TEST_CASE("test_model_exhaustive_test, load_model")
     model.predict_multi(multi_inputs, false);
     model.predict_multi(multi_inputs, true);
 }
+
+
+TEST_CASE("test_model_exhaustive_test, load_model_binary")
+{
+    const auto model = fdeep::load_model_binary("../test_model_exhaustive.fdeepbin",
+        true, fdeep::cout_logger, static_cast<fdeep::float_type>(0.00001));
+    const auto model_json = fdeep::load_model("../test_model_exhaustive.json",
+        false, nullptr);
+    const auto inputs = model.generate_dummy_inputs();
+    fdeep::internal::check_test_outputs(static_cast<fdeep::float_type>(0),
+        model.predict(inputs), model_json.predict(inputs));
+}
+
+TEST_CASE("test_model_exhaustive_test, load_model_binary_mapped")
+{
+    const auto model = fdeep::load_model_binary_mapped("../test_model_exhaustive.fdeepbin",
+        true, fdeep::cout_logger, static_cast<fdeep::float_type>(0.00001));
+    const auto model_copied = fdeep::load_model_binary("../test_model_exhaustive.fdeepbin",
+        false, nullptr);
+    const auto inputs = model.generate_dummy_inputs();
+    fdeep::internal::check_test_outputs(static_cast<fdeep::float_type>(0),
+        model.predict(inputs), model_copied.predict(inputs));
+}
+
+// Removes the entry of the model from the cache directory,
+// so the next load_model_cached fills it.
+void remove_cache_entry(const std::string& file_path, const std::string& cache_dir)
+{
+    const std::string cache_file_path = cache_dir + "/" +
+        fdeep::internal::model_cache_key(fdeep::internal::mapped_file(file_path)) +
+        ".fdeepbin";
+    std::remove(cache_file_path.c_str());
+}
+
+TEST_CASE("test_model_exhaustive_test, load_model_cached")
+{
+    remove_cache_entry("../test_model_exhaustive.json", "..");
+    std::string log;
+    const auto logger = [&log](const std::string& msg) { log += msg; };
+    // The first call fills the cache, the second one loads from it.
+    const auto model_filled = fdeep::load_model_cached("../test_model_exhaustive.json",
+        "..", true, logger, static_cast<fdeep::float_type>(0.00001));
+    REQUIRE(log.find("Loading json") != std::string::npos);
+    log.clear();
+    const auto model_cached = fdeep::load_model_cached("../test_model_exhaustive.json",
+        "..", true, logger, static_cast<fdeep::float_type>(0.00001));
+    REQUIRE(log.find("Loading json") == std::string::npos);
+    REQUIRE(log.find("Mapping binary model") != std::string::npos);
+    REQUIRE(model_cached.hash() == model_filled.hash());
+    const auto inputs = model_cached.generate_dummy_inputs();
+    fdeep::internal::check_test_outputs(static_cast<fdeep::float_type>(0),
+        model_cached.predict(inputs), model_filled.predict(inputs));
+}
+
+TEST_CASE("test_model_exhaustive_test, load_model_cached_unverified_then_verified")
+{
+    remove_cache_entry("../test_model_exhaustive.json", "..");
+    std::string log;
+    const auto logger = [&log](const std::string& msg) { log += msg; };
+    // The entry filled without verification still has the test cases.
+    fdeep::load_model_cached("../test_model_exhaustive.json",
+        "..", false, logger, static_cast<fdeep::float_type>(0.00001));
+    REQUIRE(log.find("Loading json") != std::string::npos);
+    REQUIRE(log.find("Running test") == std::string::npos);
+    log.clear();
+    fdeep::load_model_cached("../test_model_exhaustive.json",
+        "..", true, logger, static_cast<fdeep::float_type>(0.00001));
+    REQUIRE(log.find("Mapping binary model") != std::string::npos);
+    REQUIRE(log.find("No test cases available") == std::string::npos);
+    REQUIRE(log.find("Running test") != std::string::npos);
+}
+
+TEST_CASE("test_model_exhaustive_test, load_model_verified_in_background")
+{
+    const auto model = fdeep::load_model_verified_in_background(
+        "../test_model_exhaustive.json", 1, fdeep::cout_logger,
+        static_cast<fdeep::float_type>(0.00001));
+    REQUIRE(model.verification().valid());
+    model.predict(model.generate_dummy_inputs());
+    model.verification().get();
+}
+
+TEST_CASE("test_model_exhaustive_test, load_model_tests_sidecar")
+{
+    const auto model = fdeep::load_model("../test_model_exhaustive_sidecar.json",
+        true, fdeep::cout_logger, static_cast<fdeep::float_type>(0.00001));
+    const auto model_json = fdeep::load_model("../test_model_exhaustive.json",
+        false, nullptr);
+    const auto inputs = model.generate_dummy_inputs();
+    fdeep::internal::check_test_outputs(static_cast<fdeep::float_type>(0),
+        model.predict(inputs), model_json.predict(inputs));
+}
+
+TEST_CASE("test_model_exhaustive_test, load_model_binary_lazy")
+{
+    const auto model = fdeep::load_model_binary_lazy("../test_model_exhaustive.fdeepbin",
+        true, fdeep::cout_logger, static_cast<fdeep::float_type>(0.00001));
+    const auto model_lazy = fdeep::load_model_binary_lazy("../test_model_exhaustive.fdeepbin",
+        false, nullptr);
+    const auto inputs = model.generate_dummy_inputs();
+    const auto outputs = model.predict(inputs);
+    fdeep::internal::check_test_outputs(static_cast<fdeep::float_type>(0),
+        model_lazy.predict(inputs), outputs);
+    model_lazy.materialize_layers();
+    fdeep::internal::check_test_outputs(static_cast<fdeep::float_type>(0),
+        model_lazy.predict(inputs), outputs);
+}
+
+TEST_CASE("test_model_exhaustive_test, model_registry")
+{
+    fdeep::model_registry registry(fdeep::cout_logger,
+        static_cast<fdeep::float_type>(0.00001));
+    REQUIRE(registry.get() == nullptr);
+    registry.load_in_background("../test_model_exhaustive.json").get();
+    const auto model_first = registry.get();
+    REQUIRE(model_first != nullptr);
+    registry.load_in_background("../test_model_exhaustive.json", false).get();
+    const auto model_second = registry.get();
+    REQUIRE(model_second != model_first);
+    const auto inputs = model_second->generate_dummy_inputs();
+    fdeep::internal::check_test_outputs(static_cast<fdeep::float_type>(0),
+        model_second->predict(inputs), model_first->predict(inputs));
+    REQUIRE_THROWS(registry.load_in_background("../nonexisting.json").get());
+    REQUIRE(registry.get() == model_second);
+}
@@ -17,3 +17,27 @@ TEST_CASE("test_model_gru_test_stateful, load_model")
     model.predict_stateful(model.generate_dummy_inputs());
     model.predict_stateful(model.generate_dummy_inputs());
 }
+
+TEST_CASE("test_model_gru_test_stateful, sessions")
+{
+    auto model = fdeep::load_model("../test_model_gru_stateful.json",
+        false, fdeep::cout_logger);
+    const auto inputs = model.generate_dummy_inputs();
+    const auto expected_1 = model.predict_stateful(inputs);
+    const auto expected_2 = model.predict_stateful(inputs);
+
+    // Interleaved streams must not influence each other.
+    auto session_a = model.create_session();
+    auto session_b = model.create_session();
+    const auto result_a_1 = model.predict_stateful(session_a, inputs);
+    const auto result_b_1 = model.predict_stateful(session_b, inputs);
+    const auto result_a_2 = model.predict_stateful(session_a, inputs);
+    session_b.reset_states();
+    const auto result_b_2 = model.predict_stateful(session_b, inputs);
+
+    const auto epsilon = static_cast<fdeep::float_type>(0.00001);
+    fdeep::internal::check_test_outputs(epsilon, result_a_1, expected_1);
+    fdeep::internal::check_test_outputs(epsilon, result_b_1, expected_1);
+    fdeep::internal::check_test_outputs(epsilon, result_a_2, expected_2);
+    fdeep::internal::check_test_outputs(epsilon, result_b_2, expected_1);
+}
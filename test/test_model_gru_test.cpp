@@ -8,6 +8,8 @@
 #include "doctest/doctest.h"
 #include <fdeep/fdeep.hpp>
 
+#include <cmath>
+
 #define FDEEP_FLOAT_TYPE double
 
 TEST_CASE("test_model_gru_test, load_model")
@@ -20,3 +22,112 @@ TEST_CASE("test_model_gru_test, load_model")
     model.predict_multi(multi_inputs, false);
     model.predict_multi(multi_inputs, true);
 }
+
+TEST_CASE("test_model_gru_test, predict_batch")
+{
+    const auto model = fdeep::load_model("../test_model_gru.json",
+        false, fdeep::cout_logger);
+    const auto multi_inputs = fplus::generate<std::vector<fdeep::tensors>>(
+        [&]() -> fdeep::tensors {return model.generate_dummy_inputs();},
+        10);
+    const auto batch_outputs = model.predict_batch(multi_inputs);
+    const auto single_outputs = model.predict_multi(multi_inputs, false);
+    REQUIRE(batch_outputs.size() == single_outputs.size());
+    for (std::size_t i = 0; i < batch_outputs.size(); ++i)
+    {
+        fdeep::internal::check_test_outputs(
+            static_cast<fdeep::float_type>(0.00001),
+            batch_outputs[i], single_outputs[i]);
+    }
+}
+
+TEST_CASE("test_model_gru_test, predict_batch_variable_length")
+{
+    const auto model = fdeep::load_model("../test_model_gru.json",
+        false, fdeep::cout_logger);
+    // The third input is a sequence of variable length,
+    // also processed backwards and bidirectionally by the model.
+    const std::vector<std::size_t> lengths = {5, 1, 9, 3, 9, 2};
+    std::vector<fdeep::tensors> multi_inputs;
+    for (std::size_t i = 0; i < lengths.size(); ++i)
+    {
+        auto shapes = model.get_dummy_input_shapes();
+        shapes[2] = fdeep::tensor_shape(lengths[i], shapes[2].depth_);
+        multi_inputs.push_back(fplus::transform(
+            [&](const fdeep::tensor_shape& shape) -> fdeep::tensor
+            {
+                fdeep::float_vec values(shape.volume());
+                for (std::size_t j = 0; j < values.size(); ++j)
+                {
+                    values[j] = static_cast<fdeep::float_type>(
+                        std::sin(static_cast<double>(7 * i + j)));
+                }
+                return fdeep::tensor(shape, std::move(values));
+            }, shapes));
+    }
+    const auto batch_outputs = model.predict_batch(multi_inputs);
+    REQUIRE(batch_outputs.size() == multi_inputs.size());
+    for (std::size_t i = 0; i < batch_outputs.size(); ++i)
+    {
+        fdeep::internal::check_test_outputs(
+            static_cast<fdeep::float_type>(0.00001),
+            batch_outputs[i], model.predict(multi_inputs[i]));
+    }
+}
+
+TEST_CASE("test_model_gru_test, step")
+{
+    const auto model = fdeep::load_model("../test_model_gru_streaming.json",
+        false, fdeep::cout_logger);
+    const std::size_t n_steps = 12;
+    const std::size_t n_features = 4;
+    const auto frame_values = [&](std::size_t step) -> fdeep::float_vec
+    {
+        fdeep::float_vec values(n_features);
+        for (std::size_t i = 0; i < n_features; ++i)
+        {
+            values[i] = static_cast<fdeep::float_type>(
+                std::sin(static_cast<double>(step * n_features + i)));
+        }
+        return values;
+    };
+    fdeep::float_vec sequence_values;
+    for (std::size_t step = 0; step < n_steps; ++step)
+    {
+        const auto values = frame_values(step);
+        sequence_values.insert(sequence_values.end(), values.begin(), values.end());
+    }
+    const auto epsilon = static_cast<fdeep::float_type>(0.00001);
+
+    // Feeding the sequence frame by frame gives the same result
+    // as feeding it as a whole.
+    auto session_steps = model.create_session();
+    const auto first_outputs = model.step(session_steps,
+        fdeep::tensor(fdeep::tensor_shape(n_features), frame_values(0)));
+    fdeep::tensors step_outputs = first_outputs;
+    for (std::size_t step = 1; step < n_steps; ++step)
+    {
+        step_outputs = model.step(session_steps,
+            fdeep::tensor(fdeep::tensor_shape(n_features), frame_values(step)));
+    }
+    auto session_sequence = model.create_session();
+    fdeep::internal::check_test_outputs(epsilon, step_outputs,
+        model.predict_stateful(session_sequence, {fdeep::tensor(
+            fdeep::tensor_shape(n_steps, n_features), std::move(sequence_values))}));
+
+    // A fresh session starts from zero states,
+    // independently of the sessions stepped before.
+    auto session_fresh = model.create_session();
+    fdeep::internal::check_test_outputs(epsilon, model.step(session_fresh,
+        fdeep::tensor(fdeep::tensor_shape(1, n_features), frame_values(0))),
+        first_outputs);
+    session_steps.reset_states();
+    fdeep::internal::check_test_outputs(epsilon, model.step(session_steps,
+        fdeep::tensor(fdeep::tensor_shape(n_features), frame_values(0))),
+        first_outputs);
+
+    // A frame of a different size is validated again, and rejected.
+    REQUIRE_THROWS(model.step(session_steps,
+        fdeep::tensor(fdeep::tensor_shape(n_features + 1),
+            static_cast<fdeep::float_type>(0.5))));
+}
@@ -0,0 +1,126 @@
+// Copyright 2016, Tobias Hermann.
+// https://github.com/Dobiasd/frugally-deep
+// Distributed under the MIT License.
+// (See accompanying LICENSE file or at
+//  https://opensource.org/licenses/MIT)
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest/doctest.h"
+#include <fdeep/fdeep.hpp>
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+TEST_CASE("test_model_pruned_test, load_model")
+{
+    const auto model = fdeep::load_model("../test_model_pruned.json",
+        true, fdeep::cout_logger, static_cast<fdeep::float_type>(0.00001));
+    const auto multi_inputs = fplus::generate<std::vector<fdeep::tensors>>(
+        [&]() -> fdeep::tensors {return model.generate_dummy_inputs();},
+        10);
+    model.predict_multi(multi_inputs, false);
+    model.predict_multi(multi_inputs, true);
+}
+
+TEST_CASE("test_model_pruned_test, load_model_low_rank")
+{
+    const auto model = fdeep::load_model("../test_model_pruned_low_rank.json",
+        true, fdeep::cout_logger, static_cast<fdeep::float_type>(0.01));
+    const auto model_float = fdeep::load_model("../test_model_pruned.json",
+        false, nullptr);
+    const auto inputs = model.generate_dummy_inputs();
+    fdeep::internal::check_test_outputs(static_cast<fdeep::float_type>(0.01),
+        model.predict(inputs), model_float.predict(inputs));
+}
+
+TEST_CASE("test_model_pruned_test, load_model_keeping_dead_channels")
+{
+    std::string log;
+    const auto logger = [&log](const std::string& msg) { log += msg; };
+    const auto model = fdeep::load_model("../test_model_pruned.json",
+        true, logger, static_cast<fdeep::float_type>(0.00001));
+    REQUIRE(log.find("dead channel(s)") != std::string::npos);
+    log.clear();
+    const auto model_exported = fdeep::load_model("../test_model_pruned.json",
+        true, logger, static_cast<fdeep::float_type>(0.00001),
+        fdeep::internal::layer_creators(), false);
+    REQUIRE(log.find("dead channel(s)") == std::string::npos);
+    const auto inputs = model.generate_dummy_inputs();
+    fdeep::internal::check_test_outputs(static_cast<fdeep::float_type>(0.0001),
+        model.predict(inputs), model_exported.predict(inputs));
+}
+
+TEST_CASE("test_model_pruned_test, sparse_input")
+{
+    const std::size_t n_in = 256;
+    const std::size_t n_out = 96;
+    const std::size_t rows = 2;
+    fdeep::float_vec weights(n_in * n_out);
+    for (std::size_t i = 0; i < weights.size(); ++i)
+    {
+        weights[i] = static_cast<fdeep::float_type>(
+            std::sin(static_cast<double>(i)));
+    }
+    fdeep::float_vec bias(n_out);
+    for (std::size_t j = 0; j < n_out; ++j)
+    {
+        bias[j] = static_cast<fdeep::float_type>(
+            std::cos(static_cast<double>(j)));
+    }
+    // Only a few non-zero values per row, like after a ReLU.
+    fdeep::float_vec in(rows * n_in, 0);
+    for (std::size_t i = 3; i < in.size(); i += 37)
+    {
+        in[i] = static_cast<fdeep::float_type>(i) / 100;
+    }
+    const auto dense_product = [&](const fdeep::float_vec& w,
+        std::size_t r, std::size_t j) -> double
+    {
+        double sum = static_cast<double>(bias[j]);
+        for (std::size_t i = 0; i < n_in; ++i)
+        {
+            sum += static_cast<double>(in[r * n_in + i]) *
+                static_cast<double>(w[i * n_out + j]);
+        }
+        return sum;
+    };
+
+    const fdeep::internal::float_weight_matrix matrix(
+        fdeep::internal::weights_storage(fdeep::float_vec(weights)),
+        fdeep::internal::weights_storage(fdeep::float_vec(bias)), false);
+    // All columns, and a segment of them, as used by the recurrent layers.
+    for (const auto& cols : std::vector<std::pair<std::size_t, std::size_t>>{
+        {0, n_out}, {16, 64}})
+    {
+        const std::size_t first_col = cols.first;
+        const std::size_t n_cols = cols.second;
+        REQUIRE(matrix.multiplies_sparse_input(in.data(), rows, n_cols));
+        fdeep::float_vec out(rows * n_cols);
+        matrix.apply_columns(in.data(), rows, first_col, n_cols, out.data());
+        for (std::size_t r = 0; r < rows; ++r)
+        {
+            for (std::size_t j = 0; j < n_cols; ++j)
+            {
+                REQUIRE(std::abs(static_cast<double>(out[r * n_cols + j]) -
+                    dense_product(weights, r, first_col + j)) < 0.0001);
+            }
+        }
+    }
+
+    // 0 * inf is NaN, so weights with non-finite values are multiplied completely.
+    fdeep::float_vec weights_inf = weights;
+    weights_inf[5] = std::numeric_limits<fdeep::float_type>::infinity();
+    REQUIRE(in[0] == 0);
+    const fdeep::internal::float_weight_matrix matrix_inf(
+        fdeep::internal::weights_storage(fdeep::float_vec(weights_inf)),
+        fdeep::internal::weights_storage(fdeep::float_vec(bias)), false);
+    REQUIRE(!matrix_inf.multiplies_sparse_input(in.data(), rows, n_out));
+    fdeep::float_vec out(rows * n_out);
+    matrix_inf.apply_columns(in.data(), rows, 0, n_out, out.data());
+    REQUIRE(std::isnan(out[5]));
+    REQUIRE(std::isnan(dense_product(weights_inf, 0, 5)));
+}
@@ -20,3 +20,24 @@ TEST_CASE("test_model_recurrent_test, load_model")
     model.predict_multi(multi_inputs, false);
     model.predict_multi(multi_inputs, true);
 }
+
+TEST_CASE("test_model_recurrent_test, load_model_float16")
+{
+    const auto model = fdeep::load_model("../test_model_recurrent_float16.json",
+        true, fdeep::cout_logger, static_cast<fdeep::float_type>(0.01));
+    const auto multi_inputs = fplus::generate<std::vector<fdeep::tensors>>(
+        [&]() -> fdeep::tensors {return model.generate_dummy_inputs();},
+        10);
+    model.predict_multi(multi_inputs, false);
+}
+
+TEST_CASE("test_model_recurrent_test, load_model_int8")
+{
+    const auto model = fdeep::load_model("../test_model_recurrent_int8.json",
+        true, fdeep::cout_logger, static_cast<fdeep::float_type>(0.05));
+    const auto model_float = fdeep::load_model("../test_model_recurrent.json",
+        false, nullptr);
+    const auto inputs = model.generate_dummy_inputs();
+    fdeep::internal::check_test_outputs(static_cast<fdeep::float_type>(0.05),
+        model.predict(inputs), model_float.predict(inputs));
+}
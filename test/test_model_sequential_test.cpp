@@ -18,3 +18,25 @@ TEST_CASE("test_model_sequential_test, load_model")
     model.predict_multi(multi_inputs, false);
     model.predict_multi(multi_inputs, true);
 }
+
+TEST_CASE("test_model_sequential_test, load_model_int8")
+{
+    const auto model = fdeep::load_model("../test_model_sequential_int8.json",
+        true, fdeep::cout_logger, static_cast<fdeep::float_type>(0.01));
+    const auto model_float = fdeep::load_model("../test_model_sequential.json",
+        false, nullptr);
+    const auto inputs = model.generate_dummy_inputs();
+    fdeep::internal::check_test_outputs(static_cast<fdeep::float_type>(0.01),
+        model.predict(inputs), model_float.predict(inputs));
+}
+
+TEST_CASE("test_model_sequential_test, load_model_palettized")
+{
+    const auto model = fdeep::load_model("../test_model_sequential_palettized.json",
+        true, fdeep::cout_logger, static_cast<fdeep::float_type>(0.05));
+    const auto model_float = fdeep::load_model("../test_model_sequential.json",
+        false, nullptr);
+    const auto inputs = model.generate_dummy_inputs();
+    fdeep::internal::check_test_outputs(static_cast<fdeep::float_type>(0.05),
+        model.predict(inputs), model_float.predict(inputs));
+}
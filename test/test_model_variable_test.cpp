@@ -8,6 +8,9 @@
 #include "doctest/doctest.h"
 #include <fdeep/fdeep.hpp>
 
+#include <cmath>
+#include <cstddef>
+
 TEST_CASE("test_model_variable_test, load_model")
 {
     const auto model = fdeep::load_model("../test_model_variable.json",
@@ -18,3 +21,59 @@ TEST_CASE("test_model_variable_test, load_model")
     model.predict_multi(multi_inputs, false);
     model.predict_multi(multi_inputs, true);
 }
+
+TEST_CASE("test_model_variable_test, time_distributed_steps")
+{
+    const auto model = fdeep::load_model("../test_model_variable.json",
+        false, fdeep::cout_logger);
+    // The last outputs are the ones of TimeDistributed layers
+    // applied to the sequences in the last two inputs.
+    const std::size_t n_time_distributed = 4;
+    const std::size_t n_steps = 6;
+    const auto sine_tensor = [](const fdeep::tensor_shape& shape) -> fdeep::tensor
+    {
+        fdeep::float_vec values(shape.volume());
+        for (std::size_t i = 0; i < values.size(); ++i)
+        {
+            values[i] = static_cast<fdeep::float_type>(
+                std::sin(static_cast<double>(i)));
+        }
+        return fdeep::tensor(shape, std::move(values));
+    };
+    // The time dimension is the outermost one.
+    const auto time_step = [&](const fdeep::tensor& sequence, std::size_t step)
+        -> fdeep::tensor
+    {
+        const auto& shape = sequence.shape();
+        const std::size_t volume = shape.volume() / n_steps;
+        const auto begin = sequence.as_vector()->cbegin() +
+            static_cast<std::ptrdiff_t>(step * volume);
+        return fdeep::tensor(
+            fdeep::internal::change_tensor_shape_dimension_by_index(
+                shape, 5 - shape.rank(), 1),
+            fdeep::float_vec(begin, begin + static_cast<std::ptrdiff_t>(volume)));
+    };
+
+    auto inputs = model.generate_dummy_inputs();
+    inputs[3] = sine_tensor(fdeep::tensor_shape(n_steps, 7, 10, 3));
+    inputs[4] = sine_tensor(fdeep::tensor_shape(n_steps, 5));
+    const auto outputs = model.predict(inputs);
+
+    for (std::size_t step = 0; step < n_steps; ++step)
+    {
+        auto step_inputs = inputs;
+        step_inputs[3] = time_step(inputs[3], step);
+        step_inputs[4] = time_step(inputs[4], step);
+        const auto step_outputs = model.predict(step_inputs);
+        for (std::size_t i = outputs.size() - n_time_distributed;
+            i < outputs.size(); ++i)
+        {
+            REQUIRE(outputs[i].shape().volume() ==
+                n_steps * step_outputs[i].shape().volume());
+            fdeep::internal::check_test_outputs(
+                static_cast<fdeep::float_type>(0.00001),
+                {time_step(outputs[i], step)},
+                {step_outputs[i]});
+        }
+    }
+}